@@ -0,0 +1,401 @@
+// Throughput benchmarks of the recorder, the reader and ImuSync on synthetic
+// workloads. Each result is printed as a JSON line, for example
+//     {"benchmark":"recorder/imu1k-stereo30/jsonl","recordsPerSecond":...}
+// so that runs can be compared to catch regressions.
+//
+// Usage: jsonl-recorder-bench [--seconds S] [--reader-bytes N] [--filter TEXT] [--file PATH]
+//     --seconds       Sensor time recorded by each recorder workload (default 20)
+//     --reader-bytes  Size of the recording the reader benchmarks read (default 512 MB)
+//     --filter        Only run benchmarks whose name contains TEXT
+//     --file          Scratch recording (default bench_output.txt, removed at exit)
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "imu_sync.hpp"
+#include "jsonl_reader.hpp"
+#include "recorder.hpp"
+
+namespace {
+using json = nlohmann::json;
+typedef std::chrono::steady_clock Clock;
+
+double seconds(Clock::duration d) {
+    return std::chrono::duration<double>(d).count();
+}
+
+struct Options {
+    double seconds = 20.0;
+    std::uint64_t readerBytes = 512ull << 20;
+    std::string filter;
+    std::string file = "bench_output.txt";
+};
+
+bool selected(const Options &options, const std::string &name) {
+    return name.find(options.filter) != std::string::npos;
+}
+
+void report(const std::string &name, json result) {
+    result["benchmark"] = name;
+    std::cout << result.dump() << std::endl;
+}
+
+// Exact percentiles of durations in seconds
+json percentiles(std::vector<double> &samples) {
+    if (samples.empty()) return json::object();
+    std::sort(samples.begin(), samples.end());
+    const auto at = [&](double q) {
+        return samples[std::min(samples.size() - 1, static_cast<std::size_t>(q * samples.size()))];
+    };
+    return {
+        { "max", samples.back() },
+        { "p50", at(0.5) },
+        { "p99", at(0.99) },
+        { "p999", at(0.999) }
+    };
+}
+
+const char *streamName(recorder::Stream stream) {
+    switch (stream) {
+        case recorder::Stream::GYROSCOPE: return "gyroscope";
+        case recorder::Stream::ACCELEROMETER: return "accelerometer";
+        case recorder::Stream::GPS: return "gps";
+        case recorder::Stream::ARKIT: return "ARKit";
+        case recorder::Stream::GROUND_TRUTH: return "groundTruth";
+        case recorder::Stream::ODOMETRY_OUTPUT: return "output";
+        case recorder::Stream::FRAMES: return "frames";
+        case recorder::Stream::JSON: return "json";
+    }
+    return "";
+}
+
+double fileMegabytes(const std::string &path) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    return static_cast<double>(file.tellg()) / 1e6;
+}
+
+json histogram(const recorder::LatencyHistogram &h) {
+    return {
+        { "count", h.count },
+        { "max", h.maxSeconds },
+        { "mean", h.meanSeconds() },
+        { "p99", h.quantileSeconds(0.99) }
+    };
+}
+
+// Rates of the sensors of a synthetic recording, in Hz. 0 disables one.
+struct Workload {
+    const char *name;
+    double imuHz;
+    // Stereo frame groups, and an odometry output for each
+    double frameHz;
+    double jsonHz;
+    std::size_t jsonBytes;
+};
+
+const Workload WORKLOADS[] = {
+    { "imu1k-stereo30", 1000.0, 30.0, 0.0, 0 },
+    { "imu8k-stereo60", 8000.0, 60.0, 0.0, 0 },
+    { "json-blobs", 0.0, 0.0, 100.0, 16 * 1024 },
+    { "mixed", 2000.0, 30.0, 10.0, 16 * 1024 }
+};
+
+json jsonBlob(std::size_t bytes, double t) {
+    json values = json::array();
+    // About 20 bytes per serialized number
+    for (std::size_t i = 0; i < bytes / 20; ++i) values.push_back(t + 1e-3 * i);
+    return { { "time", t }, { "blob", { { "values", values } } } };
+}
+
+/**
+ * Call the add*() methods of the recorder for `duration` seconds of sensor
+ * time, as fast as possible, in time order. Returns the number of records.
+ * Each call is timed into latencies.
+ */
+std::size_t generate(recorder::Recorder &r, const Workload &w, double duration, double t0, std::vector<double> &latencies) {
+    const json blob = w.jsonHz > 0.0 ? jsonBlob(w.jsonBytes, 0.0) : json();
+    std::vector<recorder::FrameData> frames(2);
+    std::size_t records = 0;
+    // Next time of each sensor
+    double imuT = t0, frameT = t0, jsonT = t0;
+    const double end = t0 + duration;
+    const auto timed = [&](const auto &add) {
+        const Clock::time_point start = Clock::now();
+        add();
+        latencies.push_back(seconds(Clock::now() - start));
+        records++;
+    };
+    while (true) {
+        const double imu = w.imuHz > 0.0 ? imuT : end;
+        const double frame = w.frameHz > 0.0 ? frameT : end;
+        const double js = w.jsonHz > 0.0 ? jsonT : end;
+        const double t = std::min(std::min(imu, frame), js);
+        if (t >= end) break;
+        if (t == imu) {
+            timed([&]() { r.addGyroscope(t, 0.01, -0.02, 0.03); });
+            timed([&]() { r.addAccelerometer(t, 0.1, 9.81, -0.2); });
+            imuT += 1.0 / w.imuHz;
+        } else if (t == frame) {
+            for (int i = 0; i < 2; ++i) {
+                frames[i] = recorder::FrameData { t, i, 500.0, 500.0, 320.0, 240.0 };
+            }
+            timed([&]() { r.addFrameGroup(t, frames); });
+            recorder::Pose pose;
+            pose.time = t;
+            pose.position = { t, 2.0 * t, -t };
+            pose.orientation = { 0.0, 0.0, 0.0, 1.0 };
+            timed([&]() { r.addOdometryOutput(pose, { 1.0, 2.0, -1.0 }); });
+            frameT += 1.0 / w.frameHz;
+        } else {
+            json j = blob;
+            j["time"] = t;
+            timed([&]() { r.addJson(j); });
+            jsonT += 1.0 / w.jsonHz;
+        }
+    }
+    return records;
+}
+
+void benchRecorder(const Options &options) {
+    struct Variant {
+        const char *name;
+        std::function<void(recorder::Settings&)> apply;
+    };
+    const Variant variants[] = {
+        { "jsonl", [](recorder::Settings &) {} },
+        { "jsonl-async", [](recorder::Settings &s) { s.fileBackend = recorder::FileBackend::ASYNC; } },
+        { "binary", [](recorder::Settings &s) { s.format = recorder::Format::BINARY; } }
+    };
+    for (const Workload &w : WORKLOADS) {
+        for (const Variant &v : variants) {
+            const std::string name = std::string("recorder/") + w.name + "/" + v.name;
+            if (!selected(options, name)) continue;
+            recorder::Settings settings;
+            // Measures sustained throughput: producers wait instead of dropping.
+            settings.overflowPolicy = recorder::OverflowPolicy::BLOCK;
+            v.apply(settings);
+            std::vector<double> latencies;
+            std::size_t records;
+            recorder::RecorderStats stats;
+            const Clock::time_point start = Clock::now();
+            {
+                auto r = recorder::Recorder::build(options.file, settings);
+                records = generate(*r, w, options.seconds, 0.0, latencies);
+                r->flush();
+                stats = r->stats();
+            }
+            const double elapsed = seconds(Clock::now() - start);
+            json queueLatency = json::object();
+            for (const auto &p : stats.queueLatency) {
+                queueLatency[streamName(p.first)] = histogram(p.second);
+            }
+            report(name, {
+                { "records", records },
+                { "seconds", elapsed },
+                { "recordsPerSecond", records / elapsed },
+                { "megabytesPerSecond", stats.bytes / elapsed / 1e6 },
+                { "realtimeFactor", options.seconds / elapsed },
+                { "addLatency", percentiles(latencies) },
+                { "queueHighWater", stats.queueHighWater },
+                { "queueLatency", queueLatency },
+                { "outputTime", histogram(stats.outputTime) }
+            });
+        }
+    }
+}
+
+// Several threads adding IMU samples as fast as they can, for the scaling of
+// the per-thread staging buffers and the add latency of one of the threads
+void benchProducers(const Options &options) {
+    for (int threadCount : { 1, 2, 4, 8 }) {
+        const std::string name = "producers/threads" + std::to_string(threadCount);
+        if (!selected(options, name)) continue;
+        recorder::Settings settings;
+        settings.overflowPolicy = recorder::OverflowPolicy::BLOCK;
+        // 10 kHz of sensor time per thread
+        const std::size_t samples = static_cast<std::size_t>(options.seconds * 1e4);
+        std::vector<double> latencies;
+        latencies.reserve(samples);
+        recorder::RecorderStats stats;
+        const Clock::time_point start = Clock::now();
+        {
+            auto r = recorder::Recorder::build(options.file, settings);
+            std::vector<std::thread> threads;
+            for (int thread = 0; thread < threadCount; ++thread) {
+                threads.emplace_back([&, thread]() {
+                    for (std::size_t i = 0; i < samples; ++i) {
+                        const double t = 1e-4 * i;
+                        if (thread != 0) {
+                            r->addGyroscope(t, 0.01, -0.02, 0.03);
+                            continue;
+                        }
+                        const Clock::time_point before = Clock::now();
+                        r->addAccelerometer(t, 0.1, 9.81, -0.2);
+                        latencies.push_back(seconds(Clock::now() - before));
+                    }
+                });
+            }
+            for (auto &t : threads) t.join();
+            r->flush();
+            stats = r->stats();
+        }
+        const double elapsed = seconds(Clock::now() - start);
+        const std::size_t records = samples * threadCount;
+        report(name, {
+            { "records", records },
+            { "seconds", elapsed },
+            { "recordsPerSecond", records / elapsed },
+            { "addLatency", percentiles(latencies) },
+            { "queueHighWater", stats.queueHighWater }
+        });
+    }
+}
+
+// Record the mixed workload until the file has about the requested size
+void writeReaderInput(const Options &options, bool summary) {
+    recorder::Settings settings;
+    settings.overflowPolicy = recorder::OverflowPolicy::BLOCK;
+    settings.writeSummary = summary;
+    auto r = recorder::Recorder::build(options.file, settings);
+    const Workload &w = WORKLOADS[3];
+    std::vector<double> latencies;
+    constexpr double CHUNK_SECONDS = 10.0;
+    double t = 0.0;
+    while (r->stats().bytes < options.readerBytes) {
+        latencies.clear();
+        generate(*r, w, CHUNK_SECONDS, t, latencies);
+        t += CHUNK_SECONDS;
+        r->flush();
+    }
+}
+
+void benchReader(const Options &options) {
+    const unsigned cores = std::max(std::thread::hardware_concurrency(), 1u);
+    const std::vector<unsigned> threadCounts = cores > 1 ? std::vector<unsigned> { 1, cores } : std::vector<unsigned> { 1 };
+    const auto any = [&](const std::string &prefix) {
+        for (unsigned threads : threadCounts) {
+            if (selected(options, prefix + std::to_string(threads))) return true;
+        }
+        return false;
+    };
+    if (!any("reader/read/threads") && !any("reader/smallest-timestamp/threads")
+        && !selected(options, "reader/smallest-timestamp/summary")) return;
+
+    // The file is read from the page cache, so this measures parsing.
+    writeReaderInput(options, false);
+    const double megabytes = fileMegabytes(options.file);
+    for (unsigned threads : threadCounts) {
+        const std::string name = "reader/read/threads" + std::to_string(threads);
+        if (!selected(options, name)) continue;
+        JsonlReader reader;
+        reader.threads = threads;
+        std::atomic<std::size_t> records(0);
+        reader.onGyroscope = [&](double, double, double, double) { records++; };
+        reader.onAccelerometer = [&](double, double, double, double) { records++; };
+        reader.onFrames = [&](std::vector<JsonlReader::FrameParameters>) { records++; };
+        reader.onOdometryOutput = [&](const recorder::Pose &, const recorder::Vector3d &) { records++; };
+        reader.onOther = [&](double, const char *, std::size_t) { records++; };
+        const Clock::time_point start = Clock::now();
+        reader.read(options.file);
+        const double elapsed = seconds(Clock::now() - start);
+        report(name, {
+            { "megabytes", megabytes },
+            { "seconds", elapsed },
+            { "megabytesPerSecond", megabytes / elapsed },
+            { "recordsPerSecond", records.load() / elapsed }
+        });
+    }
+    for (unsigned threads : threadCounts) {
+        const std::string name = "reader/smallest-timestamp/threads" + std::to_string(threads);
+        if (!selected(options, name)) continue;
+        JsonlReader reader;
+        reader.threads = threads;
+        const Clock::time_point start = Clock::now();
+        reader.getSmallestTimestamp(options.file);
+        const double elapsed = seconds(Clock::now() - start);
+        report(name, {
+            { "megabytes", megabytes },
+            { "seconds", elapsed },
+            { "megabytesPerSecond", megabytes / elapsed }
+        });
+    }
+    const std::string name = "reader/smallest-timestamp/summary";
+    if (selected(options, name)) {
+        // From the summary record at the end of the file, without a scan
+        writeReaderInput(options, true);
+        const double summaryMegabytes = fileMegabytes(options.file);
+        JsonlReader reader;
+        const Clock::time_point start = Clock::now();
+        reader.getSmallestTimestamp(options.file);
+        const double elapsed = seconds(Clock::now() - start);
+        report(name, {
+            { "megabytes", summaryMegabytes },
+            { "seconds", elapsed },
+            { "megabytesPerSecond", summaryMegabytes / elapsed }
+        });
+    }
+}
+
+void benchImuSync(const Options &options) {
+    const std::string name = "imu-sync/gyro1k-acc500";
+    if (!selected(options, name)) return;
+    ImuSync sync;
+    std::size_t synced = 0;
+    sync.onSyncedLeader = [&](double, double, double, double, double, double, double) { synced++; };
+    // Leader at 1 kHz, follower at 500 Hz, offset in time
+    constexpr std::size_t LEADER_SAMPLES = 10 * 1000 * 1000;
+    const Clock::time_point start = Clock::now();
+    for (std::size_t i = 0; i < LEADER_SAMPLES; ++i) {
+        const double t = 1e-3 * i;
+        sync.addLeader(t, 0.01, -0.02, 0.03);
+        if (i % 2 == 0) sync.addFollower(t + 3e-4, 0.1, 9.81, -0.2);
+    }
+    const double elapsed = seconds(Clock::now() - start);
+    const std::size_t samples = LEADER_SAMPLES + LEADER_SAMPLES / 2;
+    report(name, {
+        { "samples", samples },
+        { "synced", synced },
+        { "seconds", elapsed },
+        { "samplesPerSecond", samples / elapsed }
+    });
+}
+
+bool parseOptions(int argc, char *argv[], Options &options) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (i + 1 >= argc) return false;
+        const char *value = argv[++i];
+        if (arg == "--seconds") options.seconds = std::atof(value);
+        else if (arg == "--reader-bytes") options.readerBytes = std::strtoull(value, nullptr, 10);
+        else if (arg == "--filter") options.filter = value;
+        else if (arg == "--file") options.file = value;
+        else return false;
+    }
+    return options.seconds > 0.0;
+}
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        std::fprintf(stderr, "usage: %s [--seconds S] [--reader-bytes N] [--filter TEXT] [--file PATH]\n", argv[0]);
+        return 1;
+    }
+    benchRecorder(options);
+    benchProducers(options);
+    benchReader(options);
+    benchImuSync(options);
+    std::remove(options.file.c_str());
+    std::remove((options.file + ".index").c_str());
+    return 0;
+}
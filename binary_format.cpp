@@ -0,0 +1,356 @@
+#include "binary_format.hpp"
+#include "compression.hpp"
+#include "serializer.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <vector>
+
+namespace recorder {
+namespace {
+// PNG-style magic: the first byte cannot start a JSONL file.
+constexpr char MAGIC[8] = { '\x89', 'J', 'R', 'B', '\r', '\n', '\x1a', '\n' };
+constexpr std::uint32_t VERSION = 1;
+
+enum class Tag : std::uint8_t {
+    GYROSCOPE = 1,
+    ACCELEROMETER = 2,
+    GPS = 3,
+    ARKIT = 4,
+    GROUND_TRUTH = 5,
+    ODOMETRY_OUTPUT = 6,
+    FRAME_GROUP = 7,
+    FRAME_DROP = 8,
+    RECORD_DROP = 9,
+    JSON = 10
+};
+
+constexpr std::size_t FRAME_SIZE = 5 * 8 + 2 * 4;
+
+void putU32(std::string &out, std::uint32_t x) {
+    char b[4];
+    for (int i = 0; i < 4; ++i) b[i] = static_cast<char>((x >> (8 * i)) & 0xff);
+    out.append(b, 4);
+}
+
+void putU64(std::string &out, std::uint64_t x) {
+    char b[8];
+    for (int i = 0; i < 8; ++i) b[i] = static_cast<char>((x >> (8 * i)) & 0xff);
+    out.append(b, 8);
+}
+
+void putI32(std::string &out, int x) {
+    putU32(out, static_cast<std::uint32_t>(x));
+}
+
+void putF64(std::string &out, double x) {
+    std::uint64_t u;
+    std::memcpy(&u, &x, sizeof(u));
+    putU64(out, u);
+}
+
+void putTag(std::string &out, Tag tag) {
+    out.push_back(static_cast<char>(tag));
+}
+
+// Sequential little-endian reads from a payload buffer
+struct Payload {
+    const unsigned char *p;
+
+    std::uint32_t u32() {
+        std::uint32_t x = 0;
+        for (int i = 0; i < 4; ++i) x |= static_cast<std::uint32_t>(p[i]) << (8 * i);
+        p += 4;
+        return x;
+    }
+
+    std::uint64_t u64() {
+        std::uint64_t x = 0;
+        for (int i = 0; i < 8; ++i) x |= static_cast<std::uint64_t>(p[i]) << (8 * i);
+        p += 8;
+        return x;
+    }
+
+    int i32() {
+        return static_cast<int>(u32());
+    }
+
+    double f64() {
+        const std::uint64_t u = u64();
+        double x;
+        std::memcpy(&x, &u, sizeof(x));
+        return x;
+    }
+};
+
+struct BinaryEncoder : RecordHandler {
+    std::string &out;
+    BinaryEncoder(std::string &out) : out(out) {}
+
+    void sensor(Tag tag, double t, double x, double y, double z, double temperature) {
+        putTag(out, tag);
+        putF64(out, t);
+        putF64(out, x);
+        putF64(out, y);
+        putF64(out, z);
+        putF64(out, temperature);
+    }
+
+    void position(Tag tag, const Pose &pose) {
+        putTag(out, tag);
+        putF64(out, pose.time);
+        putF64(out, pose.position.x);
+        putF64(out, pose.position.y);
+        putF64(out, pose.position.z);
+    }
+
+    void gyroscope(const GyroscopeData &d) final {
+        sensor(Tag::GYROSCOPE, d.t, d.x, d.y, d.z, d.temperature);
+    }
+
+    void accelerometer(const AccelerometerData &d) final {
+        sensor(Tag::ACCELEROMETER, d.t, d.x, d.y, d.z, d.temperature);
+    }
+
+    void gps(const GpsData &d) final {
+        putTag(out, Tag::GPS);
+        putF64(out, d.t);
+        putF64(out, d.latitude);
+        putF64(out, d.longitude);
+        putF64(out, d.accuracy);
+        putF64(out, d.altitude);
+    }
+
+    void arkit(const Pose &pose) final {
+        position(Tag::ARKIT, pose);
+    }
+
+    void groundTruth(const Pose &pose) final {
+        position(Tag::GROUND_TRUTH, pose);
+    }
+
+    void odometryOutput(const Pose &pose, const Vector3d &velocity) final {
+        position(Tag::ODOMETRY_OUTPUT, pose);
+        putF64(out, pose.orientation.w);
+        putF64(out, pose.orientation.x);
+        putF64(out, pose.orientation.y);
+        putF64(out, pose.orientation.z);
+        putF64(out, velocity.x);
+        putF64(out, velocity.y);
+        putF64(out, velocity.z);
+    }
+
+    void frameGroup(double t, int groupNumber, const FrameData *frames, const int *frameNumbers, std::size_t n) final {
+        putTag(out, Tag::FRAME_GROUP);
+        putF64(out, t);
+        putI32(out, groupNumber);
+        putU32(out, static_cast<std::uint32_t>(n));
+        for (std::size_t i = 0; i < n; ++i) {
+            const FrameData &f = frames[i];
+            putF64(out, f.t);
+            putI32(out, f.cameraInd);
+            putI32(out, frameNumbers[i]);
+            putF64(out, f.focalLengthX);
+            putF64(out, f.focalLengthY);
+            putF64(out, f.px);
+            putF64(out, f.py);
+        }
+    }
+
+    void frameDrop(double t) final {
+        putTag(out, Tag::FRAME_DROP);
+        putF64(out, t);
+    }
+
+    void recordDrop(Stream stream, std::size_t count, double t) final {
+        putTag(out, Tag::RECORD_DROP);
+        putF64(out, t);
+        putU64(out, count);
+        putU32(out, static_cast<std::uint32_t>(stream));
+    }
+
+    void json(const char *data, std::size_t n) final {
+        putTag(out, Tag::JSON);
+        putU32(out, static_cast<std::uint32_t>(n));
+        out.append(data, n);
+    }
+};
+
+std::size_t fixedPayloadSize(Tag tag) {
+    switch (tag) {
+        case Tag::GYROSCOPE:
+        case Tag::ACCELEROMETER:
+        case Tag::GPS: return 5 * 8;
+        case Tag::ARKIT:
+        case Tag::GROUND_TRUTH: return 4 * 8;
+        case Tag::ODOMETRY_OUTPUT: return 11 * 8;
+        // Variable size parts follow these
+        case Tag::FRAME_GROUP: return 8 + 4 + 4;
+        case Tag::FRAME_DROP: return 8;
+        case Tag::RECORD_DROP: return 8 + 8 + 4;
+        case Tag::JSON: return 4;
+    }
+    return 0;
+}
+
+bool read(std::istream &in, std::vector<unsigned char> &buf, std::size_t offset, std::size_t n) {
+    buf.resize(offset + n);
+    in.read(reinterpret_cast<char*>(buf.data() + offset), n);
+    return static_cast<std::size_t>(in.gcount()) == n;
+}
+} // anonymous namespace
+
+void writeBinaryHeader(std::string &out) {
+    out.append(MAGIC, sizeof(MAGIC));
+    putU32(out, VERSION);
+}
+
+std::unique_ptr<RecordHandler> buildBinaryEncoder(std::string &out) {
+    return std::unique_ptr<RecordHandler>(new BinaryEncoder(out));
+}
+
+bool isBinaryRecording(std::istream &in) {
+    return in.peek() == static_cast<unsigned char>(MAGIC[0]);
+}
+
+bool decodeBinary(std::istream &in, RecordHandler &handler) {
+    std::vector<unsigned char> buf;
+    if (!read(in, buf, 0, sizeof(MAGIC) + 4)) return false;
+    if (std::memcmp(buf.data(), MAGIC, sizeof(MAGIC)) != 0) return false;
+    if (Payload { buf.data() + sizeof(MAGIC) }.u32() != VERSION) return false;
+
+    std::vector<FrameData> frames;
+    std::vector<int> frameNumbers;
+    while (true) {
+        const int c = in.get();
+        if (c == std::char_traits<char>::eof()) return true;
+        const Tag tag = static_cast<Tag>(c);
+        const std::size_t size = fixedPayloadSize(tag);
+        if (size == 0 || !read(in, buf, 0, size)) return false;
+        Payload p { buf.data() };
+        switch (tag) {
+            case Tag::GYROSCOPE: {
+                GyroscopeData d;
+                d.t = p.f64(); d.x = p.f64(); d.y = p.f64(); d.z = p.f64(); d.temperature = p.f64();
+                handler.gyroscope(d);
+                break;
+            }
+            case Tag::ACCELEROMETER: {
+                AccelerometerData d;
+                d.t = p.f64(); d.x = p.f64(); d.y = p.f64(); d.z = p.f64(); d.temperature = p.f64();
+                handler.accelerometer(d);
+                break;
+            }
+            case Tag::GPS: {
+                GpsData d;
+                d.t = p.f64(); d.latitude = p.f64(); d.longitude = p.f64(); d.accuracy = p.f64(); d.altitude = p.f64();
+                handler.gps(d);
+                break;
+            }
+            case Tag::ARKIT:
+            case Tag::GROUND_TRUTH:
+            case Tag::ODOMETRY_OUTPUT: {
+                Pose pose = {};
+                pose.time = p.f64();
+                pose.position.x = p.f64(); pose.position.y = p.f64(); pose.position.z = p.f64();
+                if (tag == Tag::ARKIT) {
+                    handler.arkit(pose);
+                } else if (tag == Tag::GROUND_TRUTH) {
+                    handler.groundTruth(pose);
+                } else {
+                    pose.orientation.w = p.f64(); pose.orientation.x = p.f64();
+                    pose.orientation.y = p.f64(); pose.orientation.z = p.f64();
+                    Vector3d velocity;
+                    velocity.x = p.f64(); velocity.y = p.f64(); velocity.z = p.f64();
+                    handler.odometryOutput(pose, velocity);
+                }
+                break;
+            }
+            case Tag::FRAME_GROUP: {
+                const double t = p.f64();
+                const int groupNumber = p.i32();
+                const std::uint32_t n = p.u32();
+                if (!read(in, buf, 0, n * FRAME_SIZE)) return false;
+                p.p = buf.data();
+                frames.resize(n);
+                frameNumbers.resize(n);
+                for (std::uint32_t i = 0; i < n; ++i) {
+                    FrameData &f = frames[i];
+                    f.t = p.f64();
+                    f.cameraInd = p.i32();
+                    frameNumbers[i] = p.i32();
+                    f.focalLengthX = p.f64();
+                    f.focalLengthY = p.f64();
+                    f.px = p.f64();
+                    f.py = p.f64();
+                }
+                handler.frameGroup(t, groupNumber, frames.data(), frameNumbers.data(), n);
+                break;
+            }
+            case Tag::FRAME_DROP:
+                handler.frameDrop(p.f64());
+                break;
+            case Tag::RECORD_DROP: {
+                const double t = p.f64();
+                const std::uint64_t count = p.u64();
+                const std::uint32_t stream = p.u32();
+                if (stream >= STREAM_COUNT) return false;
+                handler.recordDrop(static_cast<Stream>(stream), count, t);
+                break;
+            }
+            case Tag::JSON: {
+                const std::uint32_t n = p.u32();
+                if (!read(in, buf, 0, n)) return false;
+                handler.json(reinterpret_cast<const char*>(buf.data()), n);
+                break;
+            }
+        }
+    }
+}
+
+bool convertBinaryToJsonl(const std::string &binaryPath, std::ostream &jsonlOutput) {
+    auto input = openJsonlInput(binaryPath);
+    if (!input || !isBinaryRecording(*input)) return false;
+
+    // Flush converted lines to the output in large chunks.
+    struct Converter : RecordHandler {
+        std::string lines;
+        std::unique_ptr<RecordHandler> encoder;
+        std::ostream &output;
+
+        Converter(std::ostream &output) : encoder(buildJsonlEncoder(lines)), output(output) {}
+
+        void written() {
+            if (lines.size() < 64 * 1024) return;
+            output.write(lines.data(), lines.size());
+            lines.clear();
+        }
+
+        void gyroscope(const GyroscopeData &d) final { encoder->gyroscope(d); written(); }
+        void accelerometer(const AccelerometerData &d) final { encoder->accelerometer(d); written(); }
+        void gps(const GpsData &d) final { encoder->gps(d); written(); }
+        void arkit(const Pose &pose) final { encoder->arkit(pose); written(); }
+        void groundTruth(const Pose &pose) final { encoder->groundTruth(pose); written(); }
+        void odometryOutput(const Pose &pose, const Vector3d &velocity) final {
+            encoder->odometryOutput(pose, velocity);
+            written();
+        }
+        void frameGroup(double t, int groupNumber, const FrameData *frames, const int *frameNumbers, std::size_t n) final {
+            encoder->frameGroup(t, groupNumber, frames, frameNumbers, n);
+            written();
+        }
+        void frameDrop(double t) final { encoder->frameDrop(t); written(); }
+        void recordDrop(Stream stream, std::size_t count, double t) final {
+            encoder->recordDrop(stream, count, t);
+            written();
+        }
+        void json(const char *data, std::size_t n) final { encoder->json(data, n); written(); }
+    } converter(jsonlOutput);
+
+    const bool ok = decodeBinary(*input, converter);
+    jsonlOutput.write(converter.lines.data(), converter.lines.size());
+    jsonlOutput.flush();
+    return ok && jsonlOutput.good();
+}
+} // namespace recorder
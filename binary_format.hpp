@@ -0,0 +1,37 @@
+// private header file
+#ifndef JSONL_RECORDER_BINARY_FORMAT_HPP
+#define JSONL_RECORDER_BINARY_FORMAT_HPP
+#include <istream>
+#include <memory>
+#include <string>
+
+#include "record.hpp"
+
+namespace recorder {
+/**
+ * Compact binary alternative to JSONL (Format::BINARY). A file starts with
+ * an 8-byte magic and a 32-bit format version. Each record follows as a
+ * one-byte type and a payload of little-endian doubles and integers. The
+ * payload is fixed-size per type. The exceptions are frame groups, which
+ * have a frame count, and JSON records, which are length-prefixed text.
+ * Every binary record has an exact JSONL equivalent.
+ */
+
+/** Append the file header */
+void writeBinaryHeader(std::string &out);
+
+/** RecordHandler that appends each record in the binary format to out */
+std::unique_ptr<RecordHandler> buildBinaryEncoder(std::string &out);
+
+/** True if the stream is positioned at the start of a binary recording */
+bool isBinaryRecording(std::istream &in);
+
+/**
+ * Decode a binary recording, including the header, passing each record to
+ * handler. Returns false if the data is not a valid recording or ends
+ * with an incomplete record. Records before that point are still decoded.
+ */
+bool decodeBinary(std::istream &in, RecordHandler &handler);
+} // namespace recorder
+
+#endif
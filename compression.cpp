@@ -0,0 +1,211 @@
+#include "compression.hpp"
+#include "output.hpp"
+#include "multithreading/future.hpp"
+
+#include <cassert>
+#include <cstdio>
+#include <fstream>
+
+#define log_warn std::printf
+
+#ifdef USE_ZLIB_COMPRESSION
+#include <condition_variable>
+#include <mutex>
+#include <streambuf>
+#include <vector>
+#include <zlib.h>
+
+namespace recorder {
+namespace {
+class CompressingSink : public OutputSink {
+private:
+    // Blocks queued for compression before write() starts to wait.
+    static constexpr std::size_t MAX_BLOCKS_IN_FLIGHT = 8;
+
+    const std::unique_ptr<OutputSink> sink;
+    z_stream z;
+    std::vector<char> compressed;
+
+    std::mutex mutex;
+    std::condition_variable blockDone;
+    std::size_t blocksInFlight = 0;
+    std::vector< std::vector<char> > freeBlocks;
+    std::atomic<std::size_t> pending;
+    std::unique_ptr<Processor> worker;
+
+    void compress(std::vector<char> &block) {
+        deflateReset(&z);
+        z.next_in = reinterpret_cast<Bytef*>(block.data());
+        z.avail_in = static_cast<uInt>(block.size());
+        compressed.resize(deflateBound(&z, static_cast<uLong>(block.size())));
+        z.next_out = reinterpret_cast<Bytef*>(compressed.data());
+        z.avail_out = static_cast<uInt>(compressed.size());
+        const int ret = deflate(&z, Z_FINISH);
+        assert(ret == Z_STREAM_END && "deflateBound too small");
+        (void)ret;
+        compressed.resize(z.total_out);
+        sink->write(compressed);
+    }
+
+public:
+    CompressingSink(std::unique_ptr<OutputSink> sink, int level) :
+        sink(std::move(sink)),
+        pending(0),
+        worker(Processor::createThreadPool(1))
+    {
+        z.zalloc = Z_NULL;
+        z.zfree = Z_NULL;
+        z.opaque = Z_NULL;
+        // windowBits + 16 writes a gzip header and trailer
+        const int ret = deflateInit2(&z, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+        assert(ret == Z_OK && "deflateInit2 failed");
+        (void)ret;
+    }
+
+    ~CompressingSink() {
+        flush();
+        worker.reset();
+        deflateEnd(&z);
+    }
+
+    void write(std::vector<char> &block) final {
+        std::shared_ptr< std::vector<char> > queued;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            blockDone.wait(lock, [this] { return blocksInFlight < MAX_BLOCKS_IN_FLIGHT; });
+            blocksInFlight++;
+            queued = std::make_shared< std::vector<char> >(std::move(block));
+            block.clear();
+            if (!freeBlocks.empty()) {
+                block.swap(freeBlocks.back());
+                freeBlocks.pop_back();
+            }
+        }
+        pending += queued->size();
+        worker->post([this, queued]() {
+            compress(*queued);
+            pending -= queued->size();
+            queued->clear();
+            std::lock_guard<std::mutex> lock(mutex);
+            freeBlocks.push_back(std::move(*queued));
+            blocksInFlight--;
+            blockDone.notify_all();
+        });
+    }
+
+    void sync() final {
+        // After the blocks queued so far, from the thread that writes them
+        worker->post([this]() { sink->sync(); });
+    }
+
+    void flush() final {
+        worker->barrier().wait();
+        sink->flush();
+    }
+
+    std::size_t pendingBytes() const final {
+        return pending.load() + sink->pendingBytes();
+    }
+};
+
+// Reads concatenated gzip members, as written by CompressingSink
+class GzipStreamBuf : public std::streambuf {
+private:
+    std::ifstream file;
+    z_stream z;
+    std::vector<char> in, out;
+
+public:
+    GzipStreamBuf(const std::string &path) :
+        file(path, std::ios::binary),
+        in(64 * 1024),
+        out(256 * 1024)
+    {
+        z.zalloc = Z_NULL;
+        z.zfree = Z_NULL;
+        z.opaque = Z_NULL;
+        z.next_in = Z_NULL;
+        z.avail_in = 0;
+        const int ret = inflateInit2(&z, 15 + 16);
+        assert(ret == Z_OK && "inflateInit2 failed");
+        (void)ret;
+    }
+
+    ~GzipStreamBuf() {
+        inflateEnd(&z);
+    }
+
+protected:
+    int_type underflow() final {
+        if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+        while (true) {
+            if (z.avail_in == 0) {
+                file.read(in.data(), in.size());
+                if (file.gcount() <= 0) return traits_type::eof();
+                z.next_in = reinterpret_cast<Bytef*>(in.data());
+                z.avail_in = static_cast<uInt>(file.gcount());
+            }
+            z.next_out = reinterpret_cast<Bytef*>(out.data());
+            z.avail_out = static_cast<uInt>(out.size());
+            const int ret = inflate(&z, Z_NO_FLUSH);
+            if (ret == Z_STREAM_END) {
+                // Next gzip member, if any
+                inflateReset(&z);
+            } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                log_warn("JsonlReader: corrupt gzip data, stopping\n");
+                return traits_type::eof();
+            }
+            const std::size_t n = out.size() - z.avail_out;
+            if (n > 0) {
+                setg(out.data(), out.data(), out.data() + n);
+                return traits_type::to_int_type(*gptr());
+            }
+        }
+    }
+};
+
+class GzipInput : public std::istream {
+private:
+    GzipStreamBuf buf;
+
+public:
+    GzipInput(const std::string &path) : std::istream(nullptr), buf(path) {
+        rdbuf(&buf);
+    }
+};
+} // anonymous namespace
+
+std::unique_ptr<OutputSink> OutputSink::buildCompressing(std::unique_ptr<OutputSink> sink, int level) {
+    return std::unique_ptr<OutputSink>(new CompressingSink(std::move(sink), level));
+}
+} // namespace recorder
+
+#else
+namespace recorder {
+std::unique_ptr<OutputSink> OutputSink::buildCompressing(std::unique_ptr<OutputSink> sink, int level) {
+    (void)sink;
+    (void)level;
+    assert(false && "not built with compression support");
+    return nullptr;
+}
+} // namespace recorder
+#endif
+
+namespace recorder {
+std::unique_ptr<std::istream> openJsonlInput(const std::string &path) {
+    std::unique_ptr<std::ifstream> file(new std::ifstream(path, std::ios::binary));
+    if (!file->is_open()) return nullptr;
+    const bool gzip = file->get() == 0x1f && file->get() == 0x8b;
+    if (!gzip) {
+        file->clear();
+        file->seekg(0);
+        return file;
+    }
+    #ifdef USE_ZLIB_COMPRESSION
+    return std::unique_ptr<std::istream>(new GzipInput(path));
+    #else
+    log_warn("JsonlReader: not built with compression support, cannot read %s\n", path.c_str());
+    return nullptr;
+    #endif
+}
+} // namespace recorder
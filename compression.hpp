@@ -0,0 +1,17 @@
+// private header file
+#ifndef JSONL_RECORDER_COMPRESSION_HPP
+#define JSONL_RECORDER_COMPRESSION_HPP
+#include <istream>
+#include <memory>
+#include <string>
+
+namespace recorder {
+/**
+ * Open a JSONL file for reading. Gzip compressed files (for example written
+ * with Settings::compression) are decompressed transparently.
+ *
+ * @return nullptr if the file cannot be opened
+ */
+std::unique_ptr<std::istream> openJsonlInput(const std::string &path);
+}
+#endif
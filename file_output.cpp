@@ -0,0 +1,462 @@
+#include "output.hpp"
+#include "multithreading/future.hpp"
+
+#include <cstdio>
+#include <fstream>
+
+#define log_warn std::printf
+
+#ifdef __linux__
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <unistd.h>
+
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+namespace recorder {
+namespace {
+#ifdef USE_IO_URING
+// Minimal io_uring submission and completion rings, without liburing. Used
+// from one thread at a time.
+class Uring {
+private:
+    int fd = -1;
+    void *sqRing = MAP_FAILED;
+    void *cqRing = MAP_FAILED;
+    std::size_t sqRingSize = 0;
+    std::size_t cqRingSize = 0;
+    io_uring_sqe *sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    std::size_t sqesSize = 0;
+    unsigned *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    io_uring_cqe *cqes;
+
+    int enter(unsigned toSubmit, unsigned minComplete, unsigned flags) {
+        int ret;
+        do {
+            ret = static_cast<int>(syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0));
+        } while (ret < 0 && errno == EINTR);
+        return ret;
+    }
+
+    // @return false if the entry could not be submitted
+    bool submit(const io_uring_sqe &sqe) {
+        const unsigned tail = *sqTail;
+        const unsigned i = tail & *sqMask;
+        sqes[i] = sqe;
+        sqArray[i] = i;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        if (enter(1, 0, 0) == 1) return true;
+        // Not consumed by the kernel, which only reads the tail in enter().
+        __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+        return false;
+    }
+
+public:
+    /** @return false if io_uring is not available */
+    bool init(unsigned entries) {
+        io_uring_params p;
+        std::memset(&p, 0, sizeof(p));
+        fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &p));
+        if (fd < 0) return false;
+        sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        const bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (single) sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED) return false;
+        cqRing = single ? sqRing : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED) return false;
+        sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+        if (sqes == MAP_FAILED) return false;
+
+        char *sq = static_cast<char*>(sqRing);
+        sqTail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+        sqMask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+        char *cq = static_cast<char*>(cqRing);
+        cqHead = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+        cqTail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+        cqMask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+        return true;
+    }
+
+    ~Uring() {
+        if (sqes != MAP_FAILED) munmap(sqes, sqesSize);
+        if (cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqRingSize);
+        if (sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+        if (fd >= 0) close(fd);
+    }
+
+    /**
+     * Submit a write. With drain, it starts only after the earlier requests
+     * have completed. The ring must have room, i.e., fewer requests in
+     * flight than entries.
+     *
+     * @return false if the write could not be submitted
+     */
+    bool write(int file, const char *data, std::size_t n, std::uint64_t offset, std::uint64_t userData, bool drain) {
+        io_uring_sqe sqe;
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_WRITE;
+        sqe.flags = drain ? IOSQE_IO_DRAIN : 0;
+        sqe.fd = file;
+        sqe.addr = reinterpret_cast<std::uint64_t>(data);
+        sqe.len = static_cast<std::uint32_t>(n);
+        sqe.off = offset;
+        sqe.user_data = userData;
+        return submit(sqe);
+    }
+
+    /**
+     * Submit an fdatasync() that starts after the earlier requests have
+     * completed, and before the later ones start
+     *
+     * @return false if it could not be submitted
+     */
+    bool sync(int file, std::uint64_t userData) {
+        io_uring_sqe sqe;
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_FSYNC;
+        sqe.flags = IOSQE_IO_DRAIN;
+        sqe.fd = file;
+        sqe.fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe.user_data = userData;
+        return submit(sqe);
+    }
+
+    /**
+     * Call done(userData, result) for each completed request, after waiting
+     * for at least one if wait is set.
+     */
+    template <class Done> void complete(bool wait, const Done &done) {
+        if (wait) enter(0, 1, IORING_ENTER_GETEVENTS);
+        unsigned head = *cqHead;
+        const unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            const io_uring_cqe &cqe = cqes[head & *cqMask];
+            done(cqe.user_data, cqe.res);
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
+};
+#endif
+
+/**
+ * Writes each block at the next offset of the file asynchronously, with a
+ * few blocks in flight. With O_DIRECT, the buffers, lengths and offsets are
+ * aligned: the unaligned end of a block is written padded and written again
+ * as the start of the next one, and the padding is truncated on flush().
+ * sync() queues an fdatasync() behind the blocks written so far.
+ */
+class FileSink : public OutputSink {
+private:
+    static constexpr std::size_t BUFFERS_IN_FLIGHT = 4;
+    static constexpr std::size_t ALIGNMENT = 4096;
+    // io_uring user data of a sync, the others are buffer indices
+    static constexpr std::uint64_t SYNC_REQUEST = BUFFERS_IN_FLIGHT;
+
+    struct Buffer {
+        char *data = nullptr;
+        std::size_t capacity = 0;
+        // Bytes to write, including an earlier tail and padding
+        std::size_t size = 0;
+        std::size_t written = 0;
+        std::uint64_t offset = 0;
+        // New bytes of the block, for pendingBytes()
+        std::size_t blockBytes = 0;
+    };
+
+    int fd;
+    bool direct;
+    std::array<Buffer, BUFFERS_IN_FLIGHT> buffers;
+    std::mutex mutex;
+    std::condition_variable bufferFreed;
+    std::vector<Buffer*> freeBuffers;
+    std::uint64_t fileSize = 0;
+    // O_DIRECT only: the bytes of the file after its last aligned offset
+    char *tail = nullptr;
+    std::size_t tailSize = 0;
+    std::atomic<std::size_t> pending;
+    std::atomic<bool> failed;
+#ifdef USE_IO_URING
+    std::unique_ptr<Uring> uring;
+    std::size_t inFlight = 0;
+    // Set if the kernel cannot write with io_uring, which is then replaced
+    // by the worker once nothing is in flight
+    bool uringUnsupported = false;
+    // At most one sync is in flight, another one requested meanwhile
+    // follows it
+    bool syncing = false;
+    bool syncAgain = false;
+#endif
+    // Without io_uring
+    std::unique_ptr<Processor> worker;
+
+    static char *allocateAligned(std::size_t n) {
+        void *p = nullptr;
+        if (posix_memalign(&p, ALIGNMENT, n) != 0) return nullptr;
+        return static_cast<char*>(p);
+    }
+
+    void fail(const char *what, int error) {
+        if (!failed.exchange(true)) {
+            log_warn("recorder: %s failed: %s\n", what, std::strerror(error));
+        }
+    }
+
+    // Write what remains of the buffer synchronously
+    void writeFully(Buffer &b) {
+        while (b.written < b.size) {
+            const ssize_t n = pwrite(fd, b.data + b.written, b.size - b.written, static_cast<off_t>(b.offset + b.written));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                fail("pwrite", n < 0 ? errno : EIO);
+                break;
+            }
+            b.written += static_cast<std::size_t>(n);
+        }
+    }
+
+    void syncNow() {
+        if (fdatasync(fd) != 0) fail("fdatasync", errno);
+    }
+
+    void release(Buffer &b) {
+        pending -= b.blockBytes;
+        std::lock_guard<std::mutex> lock(mutex);
+        freeBuffers.push_back(&b);
+        bufferFreed.notify_all();
+    }
+
+#ifdef USE_IO_URING
+    void reap(bool wait) {
+        uring->complete(wait, [this](std::uint64_t i, int result) {
+            inFlight--;
+            if (i == SYNC_REQUEST) {
+                syncing = false;
+                if (result == -EINVAL || result == -EOPNOTSUPP) {
+                    uringUnsupported = true;
+                    syncNow();
+                } else if (result < 0) {
+                    fail("io_uring fdatasync", -result);
+                }
+                return;
+            }
+            Buffer &b = buffers[i];
+            if (result == -EINVAL || result == -EOPNOTSUPP) {
+                // E.g. a kernel without IORING_OP_WRITE
+                uringUnsupported = true;
+            } else if (result < 0) {
+                fail("io_uring write", -result);
+                b.written = b.size;
+            } else {
+                b.written += static_cast<std::size_t>(result);
+            }
+            // Short writes are rare, finish them here.
+            writeFully(b);
+            release(b);
+        });
+        if (uringUnsupported && inFlight == 0) {
+            uring.reset();
+            worker = Processor::createThreadPool(1);
+        }
+        if (syncAgain && !syncing) {
+            syncAgain = false;
+            sync();
+        }
+    }
+#endif
+
+    Buffer &freeBuffer() {
+#ifdef USE_IO_URING
+        if (uring) {
+            reap(false);
+            while (freeBuffers.empty() && uring) reap(true);
+        }
+#endif
+        std::unique_lock<std::mutex> lock(mutex);
+        bufferFreed.wait(lock, [this] { return !freeBuffers.empty(); });
+        Buffer &b = *freeBuffers.back();
+        freeBuffers.pop_back();
+        return b;
+    }
+
+    void submit(Buffer &b, bool drain) {
+#ifdef USE_IO_URING
+        while (uring && uringUnsupported) reap(true);
+        if (uring) {
+            inFlight++;
+            if (uring->write(fd, b.data, b.size, b.offset, static_cast<std::uint64_t>(&b - buffers.data()), drain)) return;
+            inFlight--;
+            // Write in order with the earlier blocks.
+            while (uring && inFlight > 0) reap(true);
+            writeFully(b);
+            release(b);
+            return;
+        }
+#endif
+        (void)drain;
+        // One thread writes the blocks in order.
+        Buffer *buffer = &b;
+        worker->post([this, buffer]() {
+            writeFully(*buffer);
+            release(*buffer);
+        });
+    }
+
+public:
+    FileSink(int fd, bool direct) :
+        fd(fd),
+        direct(direct),
+        pending(0),
+        failed(false)
+    {
+        for (auto &b : buffers) freeBuffers.push_back(&b);
+        if (direct) tail = allocateAligned(ALIGNMENT);
+#ifdef USE_IO_URING
+        uring = std::make_unique<Uring>();
+        if (uring->init(BUFFERS_IN_FLIGHT + 1)) return;
+        uring.reset();
+#endif
+        worker = Processor::createThreadPool(1);
+    }
+
+    ~FileSink() {
+        flush();
+        worker.reset();
+#ifdef USE_IO_URING
+        uring.reset();
+#endif
+        close(fd);
+        for (auto &b : buffers) std::free(b.data);
+        std::free(tail);
+    }
+
+    void write(std::vector<char> &block) final {
+        if (block.empty()) return;
+        Buffer &b = freeBuffer();
+        const std::size_t n = tailSize + block.size();
+        const std::size_t size = direct ? (n + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT : n;
+        if (b.capacity < size) {
+            std::free(b.data);
+            b.capacity = std::max(size, 2 * b.capacity);
+            b.data = allocateAligned(b.capacity);
+            if (!b.data) {
+                b.capacity = 0;
+                fail("allocation", ENOMEM);
+                release(b);
+                block.clear();
+                return;
+            }
+        }
+        if (tailSize > 0) std::memcpy(b.data, tail, tailSize);
+        std::memcpy(b.data + tailSize, block.data(), block.size());
+        std::memset(b.data + n, 0, size - n);
+        b.size = size;
+        b.written = 0;
+        b.offset = fileSize - tailSize;
+        b.blockBytes = block.size();
+        // Rewriting the previous tail must wait until it has been written.
+        const bool drain = tailSize > 0;
+        fileSize += block.size();
+        if (direct) {
+            tailSize = n % ALIGNMENT;
+            std::memcpy(tail, b.data + n - tailSize, tailSize);
+        }
+        pending += block.size();
+        block.clear();
+        submit(b, drain);
+    }
+
+    void sync() final {
+#ifdef USE_IO_URING
+        while (uring && uringUnsupported) reap(true);
+        if (uring) {
+            if (syncing) {
+                syncAgain = true;
+                return;
+            }
+            inFlight++;
+            if (uring->sync(fd, SYNC_REQUEST)) {
+                syncing = true;
+                return;
+            }
+            inFlight--;
+            // Sync after the earlier blocks.
+            while (uring && inFlight > 0) reap(true);
+            syncNow();
+            return;
+        }
+#endif
+        worker->post([this]() { syncNow(); });
+    }
+
+    void flush() final {
+#ifdef USE_IO_URING
+        while (uring && inFlight > 0) reap(true);
+#endif
+        if (worker) worker->barrier().wait();
+        if (direct && ftruncate(fd, static_cast<off_t>(fileSize)) != 0) fail("ftruncate", errno);
+    }
+
+    std::size_t pendingBytes() const final {
+        return pending.load();
+    }
+};
+
+// Make the directory entry of a new file durable, which fdatasync() on the
+// file does not
+void syncDirectory(const std::string &path) {
+    const auto slash = path.rfind('/');
+    const std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    const int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || fsync(fd) != 0) {
+        log_warn("recorder: syncing directory %s failed: %s\n", dir.c_str(), std::strerror(errno));
+    }
+    if (fd >= 0) close(fd);
+}
+} // anonymous namespace
+
+std::unique_ptr<OutputSink> OutputSink::buildFile(const std::string &path, bool directIO, bool durable) {
+    const int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    int fd = -1;
+    if (directIO) {
+        fd = open(path.c_str(), flags | O_DIRECT, 0644);
+        // Not supported by all file systems, e.g., tmpfs
+        if (fd < 0 && errno == EINVAL) {
+            log_warn("recorder: O_DIRECT not supported for %s, using the page cache\n", path.c_str());
+            directIO = false;
+        }
+    }
+    if (fd < 0) fd = open(path.c_str(), flags, 0644);
+    if (fd < 0) return nullptr;
+    if (durable) syncDirectory(path);
+    return std::unique_ptr<OutputSink>(new FileSink(fd, directIO));
+}
+} // namespace recorder
+
+#else
+namespace recorder {
+std::unique_ptr<OutputSink> OutputSink::buildFile(const std::string &path, bool directIO, bool durable) {
+    (void)directIO;
+    (void)durable;
+    std::unique_ptr<std::ofstream> file(new std::ofstream(path, std::ios::out | std::ios::binary));
+    if (!file->is_open()) return nullptr;
+    return build(std::move(file));
+}
+} // namespace recorder
+#endif
@@ -1,57 +1,489 @@
 #include "jsonl_reader.hpp"
+#include "binary_format.hpp"
+#include "compression.hpp"
+#include "serializer.hpp"
+#include "time_index.hpp"
+#include "multithreading/future.hpp"
 
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <exception>
 #include <fstream>
 #include <limits>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <nlohmann/json.hpp>
 
+#ifdef _WIN32
+#include <iterator>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 using json = nlohmann::json;
 
-double JsonlReader::getSmallestTimestamp(std::string jsonlFilePath) {
-    std::ifstream dataFile;
-    dataFile.open(jsonlFilePath);
-    if (!dataFile.is_open()) {
-        assert(false && "JSONL file not found");
+namespace {
+bool contains(const char *begin, const char *end, const char *needle) {
+    const std::size_t n = std::strlen(needle);
+    while (static_cast<std::size_t>(end - begin) >= n) {
+        const char *p = static_cast<const char*>(std::memchr(begin, needle[0], end - begin - n + 1));
+        if (!p) return false;
+        if (std::memcmp(p, needle, n) == 0) return true;
+        begin = p + 1;
     }
+    return false;
+}
 
-    double t0 = std::numeric_limits<double>::infinity();
-    std::string line;
-    while (std::getline(dataFile, line)) {
-        json j = json::parse(line);
-        if (j.find("time") != j.end()) {
-            double t = j["time"].get<double>();
-            if (t < t0) t0 = t;
-        }
+// Kinds of lines, told apart by their type key. If a line has several, the
+// first one in this order counts.
+enum class Kind { SENSOR, FRAMES, GPS, ARKIT, GROUND_TRUTH, ODOMETRY_OUTPUT, DROPPED_FRAME, OTHER };
+
+// One probe of a top-level key. OTHER if it is not a type key.
+Kind kindOf(const std::string &key) {
+    switch (key.empty() ? '\0' : key[0]) {
+        case 's': return key == "sensor" ? Kind::SENSOR : Kind::OTHER;
+        case 'f': return key == "frames" ? Kind::FRAMES : Kind::OTHER;
+        case 'g': return key == "gps" ? Kind::GPS : key == "groundTruth" ? Kind::GROUND_TRUTH : Kind::OTHER;
+        case 'A': return key == "ARKit" ? Kind::ARKIT : Kind::OTHER;
+        case 'o': return key == "output" ? Kind::ODOMETRY_OUTPUT : Kind::OTHER;
+        case 'd': return key == "droppedFrame" ? Kind::DROPPED_FRAME : Kind::OTHER;
+        default: return Kind::OTHER;
     }
-    return t0;
 }
 
-void JsonlReader::read(std::string jsonlFilePath) {
-    std::ifstream dataFile;
-    dataFile.open(jsonlFilePath);
-    if (!dataFile.is_open()) {
-        assert(false && "JSONL file not found");
+unsigned bit(Kind kind) {
+    return kind == Kind::OTHER ? 0u : 1u << static_cast<unsigned>(kind);
+}
+
+Kind firstKind(unsigned kinds) {
+    for (unsigned k = 0; k < static_cast<unsigned>(Kind::OTHER); ++k) {
+        if (kinds & (1u << k)) return static_cast<Kind>(k);
     }
+    return Kind::OTHER;
+}
+
+// The recorder does not write the orientation of these poses.
+const recorder::Quaternion NO_ORIENTATION = { NAN, NAN, NAN, NAN };
+
+// SAX handler picking the fields LineParser uses from one line without
+// building a DOM. Returns false from a callback (stopping the parse) when
+// the line turns out to be of no interest or has an unexpected shape, in
+// which case skip or fallback tells which.
+struct LineScanner {
+    enum class Context { ROOT, SENSOR, SENSOR_VALUES, FRAMES, FRAME, CAMERA_PARAMETERS, GPS, POSE, VECTOR, OTHER };
+    enum class Vector { POSITION, ORIENTATION, VELOCITY };
 
+    struct Frame {
+        int cameraInd;
+        bool hasCameraInd, hasFocalLength;
+        double focalLengthX, focalLengthY, principalPointX, principalPointY, focalLength;
+    };
+
+    const JsonlReader &reader;
+    std::vector<Context> stack;
+    std::string lastKey;
+    bool skip, fallback;
+
+    unsigned kinds;
+    bool hasTime, hasSensorType;
     double time;
-    std::string line;
-    std::array<double, 3> sensorValues;
-    std::map<int, FrameParameters> frames;
-    std::vector<FrameParameters> framesVec;
-    // int framesInd;
-    while (std::getline(dataFile, line)) {
-        // std::cout << "parsing " << line << std::endl;
-        json j = json::parse(line);
-        if (j.find("sensor") != j.end()) {
+    std::string sensorType;
+    std::size_t nValues;
+    std::array<double, 3> values;
+    std::vector<Frame> frames;
+    recorder::GpsData gps;
+    unsigned gpsFields;
+    recorder::Pose pose;
+    recorder::Vector3d velocity;
+    Vector vector;
+    // Bits of the x, y, z and w components seen of each Vector
+    std::array<unsigned, 3> components;
+
+    LineScanner(const JsonlReader &reader) : reader(reader) {}
+
+    void reset() {
+        stack.clear();
+        skip = fallback = false;
+        kinds = 0;
+        hasTime = hasSensorType = false;
+        nValues = 0;
+        frames.clear();
+        gpsFields = 0;
+        components.fill(0);
+    }
+
+    Context context() const {
+        return stack.empty() ? Context::OTHER : stack.back();
+    }
+
+    bool unexpected() {
+        fallback = true;
+        return false;
+    }
+
+    bool isVectorKey() const {
+        return lastKey == "position" || lastKey == "orientation" || lastKey == "velocity";
+    }
+
+    bool isGpsKey() const {
+        return lastKey == "latitude" || lastKey == "longitude" || lastKey == "accuracy" || lastKey == "altitude";
+    }
+
+    // Values of the keys handled in start_object and start_array must be
+    // objects or arrays.
+    bool rootValue() {
+        if (lastKey == "time") return unexpected();
+        const Kind kind = kindOf(lastKey);
+        return kind == Kind::OTHER || kind == Kind::DROPPED_FRAME ? true : unexpected();
+    }
+
+    bool number(double x) {
+        switch (context()) {
+            case Context::ROOT:
+                if (lastKey != "time") return rootValue();
+                time = x;
+                hasTime = true;
+                return true;
+            case Context::SENSOR_VALUES:
+                if (nValues < values.size()) values[nValues] = x;
+                nValues++;
+                return true;
+            case Context::FRAME:
+                if (lastKey == "cameraInd") {
+                    frames.back().cameraInd = static_cast<int>(x);
+                    frames.back().hasCameraInd = true;
+                }
+                return lastKey == "cameraParameters" ? unexpected() : true;
+            case Context::CAMERA_PARAMETERS: {
+                Frame &f = frames.back();
+                if (lastKey == "focalLengthX") f.focalLengthX = x;
+                else if (lastKey == "focalLengthY") f.focalLengthY = x;
+                else if (lastKey == "principalPointX") f.principalPointX = x;
+                else if (lastKey == "principalPointY") f.principalPointY = x;
+                else if (lastKey == "focalLength") {
+                    f.focalLength = x;
+                    f.hasFocalLength = true;
+                }
+                return true;
+            }
+            case Context::GPS:
+                if (lastKey == "latitude") gps.latitude = x, gpsFields |= 1;
+                else if (lastKey == "longitude") gps.longitude = x, gpsFields |= 2;
+                else if (lastKey == "accuracy") gps.accuracy = x, gpsFields |= 4;
+                else if (lastKey == "altitude") gps.altitude = x, gpsFields |= 8;
+                return true;
+            case Context::VECTOR: {
+                const char c = lastKey.size() == 1 ? lastKey[0] : '\0';
+                if (c != 'x' && c != 'y' && c != 'z' && c != 'w') return true;
+                const unsigned i = c == 'w' ? 3 : c - 'x';
+                if (vector == Vector::ORIENTATION) {
+                    double *q[] = { &pose.orientation.x, &pose.orientation.y, &pose.orientation.z, &pose.orientation.w };
+                    *q[i] = x;
+                } else if (i < 3) {
+                    recorder::Vector3d &v = vector == Vector::POSITION ? pose.position : velocity;
+                    double *p[] = { &v.x, &v.y, &v.z };
+                    *p[i] = x;
+                }
+                components[static_cast<std::size_t>(vector)] |= 1u << i;
+                return true;
+            }
+            case Context::SENSOR:
+                return lastKey == "type" ? unexpected() : true;
+            case Context::POSE:
+                return isVectorKey() ? unexpected() : true;
+            case Context::FRAMES:
+                return unexpected();
+            case Context::OTHER:
+                return true;
+        }
+        return true;
+    }
+
+    // Any value that is not a number or null
+    bool other() {
+        switch (context()) {
+            case Context::ROOT: return rootValue();
+            case Context::SENSOR: return lastKey == "type" ? unexpected() : true;
+            case Context::SENSOR_VALUES:
+            case Context::FRAMES: return unexpected();
+            case Context::FRAME: return lastKey == "cameraInd" || lastKey == "cameraParameters" ? unexpected() : true;
+            case Context::CAMERA_PARAMETERS:
+                return lastKey.compare(0, 11, "focalLength") == 0 || lastKey.compare(0, 14, "principalPoint") == 0
+                    ? unexpected() : true;
+            case Context::GPS: return isGpsKey() ? unexpected() : true;
+            case Context::POSE: return isVectorKey() ? unexpected() : true;
+            case Context::VECTOR: return lastKey.size() == 1 ? unexpected() : true;
+            default: return true;
+        }
+    }
+
+    // Null stands for non-finite numbers, which the DOM parser handles.
+    bool null() {
+        switch (context()) {
+            case Context::ROOT: return rootValue();
+            case Context::SENSOR: return lastKey == "type" ? unexpected() : true;
+            case Context::SENSOR_VALUES:
+            case Context::FRAMES: return unexpected();
+            case Context::FRAME: return lastKey == "cameraInd" ? unexpected() : true;
+            case Context::GPS: return isGpsKey() ? unexpected() : true;
+            case Context::POSE: return isVectorKey() ? unexpected() : true;
+            case Context::VECTOR: return lastKey.size() == 1 ? unexpected() : true;
+            default: return true;
+        }
+    }
+
+    bool boolean(bool) { return other(); }
+    bool number_integer(json::number_integer_t x) { return number(static_cast<double>(x)); }
+    bool number_unsigned(json::number_unsigned_t x) { return number(static_cast<double>(x)); }
+    bool number_float(json::number_float_t x, const json::string_t &) { return number(x); }
+    bool binary(json::binary_t &) { return other(); }
+
+    bool string(json::string_t &s) {
+        if (context() != Context::SENSOR || lastKey != "type") return other();
+        sensorType = s;
+        hasSensorType = true;
+        // Stop early on sensor lines nobody listens to. Sensor is the first
+        // kind, so nothing else in the line can matter.
+        const bool wanted = (s == "gyroscope" && reader.onGyroscope) || (s == "accelerometer" && reader.onAccelerometer);
+        if (!wanted) skip = true;
+        return wanted;
+    }
+
+    bool key(json::string_t &k) {
+        lastKey = k;
+        if (context() == Context::ROOT) kinds |= bit(kindOf(k));
+        return true;
+    }
+
+    bool start_object(std::size_t) {
+        const Context parent = context();
+        if (stack.empty()) {
+            stack.push_back(Context::ROOT);
+        } else if (parent == Context::ROOT && lastKey == "sensor") {
+            stack.push_back(Context::SENSOR);
+        } else if (parent == Context::ROOT && lastKey == "gps") {
+            stack.push_back(Context::GPS);
+        } else if (parent == Context::ROOT && (lastKey == "ARKit" || lastKey == "groundTruth" || lastKey == "output")) {
+            stack.push_back(Context::POSE);
+        } else if (parent == Context::POSE && isVectorKey()) {
+            vector = lastKey == "position" ? Vector::POSITION
+                : lastKey == "orientation" ? Vector::ORIENTATION : Vector::VELOCITY;
+            stack.push_back(Context::VECTOR);
+        } else if (parent == Context::FRAMES) {
+            Frame f = { 0, false, false, -1, -1, -1, -1, -1 };
+            frames.push_back(f);
+            stack.push_back(Context::FRAME);
+        } else if (parent == Context::FRAME && lastKey == "cameraParameters") {
+            stack.push_back(Context::CAMERA_PARAMETERS);
+        } else if (parent == Context::SENSOR_VALUES) {
+            return unexpected();
+        } else {
+            if (!other()) return false;
+            stack.push_back(Context::OTHER);
+        }
+        return true;
+    }
+
+    bool start_array(std::size_t) {
+        const Context parent = context();
+        if (stack.empty()) return unexpected();
+        if (parent == Context::ROOT && lastKey == "frames") {
+            stack.push_back(Context::FRAMES);
+        } else if (parent == Context::SENSOR && lastKey == "values") {
+            stack.push_back(Context::SENSOR_VALUES);
+        } else {
+            if (!other()) return false;
+            stack.push_back(Context::OTHER);
+        }
+        return true;
+    }
+
+    bool end_object() {
+        stack.pop_back();
+        return true;
+    }
+
+    bool end_array() {
+        stack.pop_back();
+        return true;
+    }
+
+    bool parse_error(std::size_t, const std::string &, const nlohmann::detail::exception &) {
+        fallback = true;
+        return false;
+    }
+
+    Kind kind() const {
+        return firstKind(kinds);
+    }
+
+    /** @return false if the line must be parsed with the DOM parser instead */
+    bool scan(const char *begin, const char *end) {
+        reset();
+        json::sax_parse(begin, end, this);
+        if (skip) return true;
+        if (fallback) return false;
+        // Let the DOM parser sort out lines of several kinds.
+        if (kinds & (kinds - 1)) return false;
+        switch (kind()) {
+            case Kind::SENSOR:
+                return hasTime && hasSensorType && nValues >= values.size();
+            case Kind::FRAMES:
+                if (!reader.onFrames) return true;
+                if (!hasTime) return false;
+                for (const Frame &f : frames) {
+                    if (!f.hasCameraInd) return false;
+                }
+                return true;
+            case Kind::GPS:
+                return hasTime && gpsFields == 0xf;
+            case Kind::ARKIT:
+            case Kind::GROUND_TRUTH:
+                return hasTime && components[0] == 0x7;
+            case Kind::ODOMETRY_OUTPUT:
+                return hasTime && components[0] == 0x7 && components[1] == 0xf && components[2] == 0x7;
+            case Kind::DROPPED_FRAME:
+                return hasTime;
+            case Kind::OTHER:
+                return true;
+        }
+        return true;
+    }
+};
+
+struct LineParser {
+    JsonlReader &reader;
+    std::map<int, JsonlReader::FrameParameters> frames;
+    std::vector<JsonlReader::FrameParameters> framesVec;
+    LineScanner scanner;
+
+    LineParser(JsonlReader &reader) : reader(reader), scanner(reader) {}
+
+    // Cheap necessary condition for the line to produce a callback
+    bool wanted(const char *begin, const char *end) const {
+        return reader.onOther
+            || (reader.onGyroscope && contains(begin, end, "\"gyroscope\""))
+            || (reader.onAccelerometer && contains(begin, end, "\"accelerometer\""))
+            || (reader.onFrames && contains(begin, end, "\"frames\""))
+            || (reader.onGps && contains(begin, end, "\"gps\""))
+            || (reader.onARKit && contains(begin, end, "\"ARKit\""))
+            || (reader.onGroundTruth && contains(begin, end, "\"groundTruth\""))
+            || (reader.onOdometryOutput && contains(begin, end, "\"output\""))
+            || (reader.onDroppedFrame && contains(begin, end, "\"droppedFrame\""));
+    }
+
+    void parse(const char *begin, const char *end) {
+        if (!wanted(begin, end)) return;
+        if (scanner.scan(begin, end)) {
+            emitScanned(begin, end);
+        } else {
+            parseDom(begin, end);
+        }
+    }
+
+    void emitScanned(const char *begin, const char *end) {
+        const LineScanner &s = scanner;
+        if (s.skip) return;
+        switch (s.kind()) {
+            case Kind::SENSOR:
+                if (s.sensorType == "gyroscope") {
+                    if (reader.onGyroscope) reader.onGyroscope(s.time, s.values[0], s.values[1], s.values[2]);
+                } else if (s.sensorType == "accelerometer") {
+                    if (reader.onAccelerometer) reader.onAccelerometer(s.time, s.values[0], s.values[1], s.values[2]);
+                }
+                break;
+            case Kind::FRAMES:
+                if (!reader.onFrames) break;
+                frames.clear();
+                for (const LineScanner::Frame &f : s.frames) {
+                    JsonlReader::FrameParameters frame = { s.time };
+                    frame.focalLengthX = f.focalLengthX;
+                    frame.focalLengthY = f.focalLengthY;
+                    frame.principalPointX = f.principalPointX;
+                    frame.principalPointY = f.principalPointY;
+                    bool hasDirFocal = frame.focalLengthX > 0.0 && frame.focalLengthY > 0.0;
+                    if (!hasDirFocal && f.hasFocalLength) {
+                        frame.focalLengthX = f.focalLength;
+                        frame.focalLengthY = f.focalLength;
+                    }
+                    frames.insert({f.cameraInd, frame});
+                }
+                emitFrames();
+                break;
+            case Kind::GPS:
+                if (reader.onGps) {
+                    recorder::GpsData d = s.gps;
+                    d.t = s.time;
+                    reader.onGps(d);
+                }
+                break;
+            case Kind::ARKIT:
+            case Kind::GROUND_TRUTH: {
+                const auto &callback = s.kind() == Kind::ARKIT ? reader.onARKit : reader.onGroundTruth;
+                if (callback) {
+                    recorder::Pose pose = { s.time, s.pose.position, NO_ORIENTATION };
+                    callback(pose);
+                }
+                break;
+            }
+            case Kind::ODOMETRY_OUTPUT:
+                if (reader.onOdometryOutput) {
+                    recorder::Pose pose = s.pose;
+                    pose.time = s.time;
+                    reader.onOdometryOutput(pose, s.velocity);
+                }
+                break;
+            case Kind::DROPPED_FRAME:
+                if (reader.onDroppedFrame) reader.onDroppedFrame(s.time);
+                break;
+            case Kind::OTHER:
+                if (reader.onOther) reader.onOther(s.hasTime ? s.time : NAN, begin, end - begin);
+                break;
+        }
+    }
+
+    // Non-finite numbers are written as null.
+    static double number(const json &j) {
+        return j.is_null() ? NAN : j.get<double>();
+    }
+
+    static double time(const json &j) {
+        const auto it = j.find("time");
+        return it == j.end() ? NAN : number(*it);
+    }
+
+    static recorder::Vector3d vector3(const json &j) {
+        return { number(j.at("x")), number(j.at("y")), number(j.at("z")) };
+    }
+
+    void parseDom(const char *begin, const char *end) {
+        using FrameParameters = JsonlReader::FrameParameters;
+        double time;
+        std::array<double, 3> sensorValues;
+        json j = json::parse(begin, end);
+        unsigned kinds = 0;
+        if (j.is_object()) {
+            for (auto it = j.begin(); it != j.end(); ++it) kinds |= bit(kindOf(it.key()));
+        }
+        const Kind kind = firstKind(kinds);
+        if (kind == Kind::SENSOR) {
             time = j["time"].get<double>();
             sensorValues = j["sensor"]["values"];
             std::string sensorType = j["sensor"]["type"];
             if (sensorType == "gyroscope") {
-                if (onGyroscope) onGyroscope(time, sensorValues[0], sensorValues[1], sensorValues[2]);
+                if (reader.onGyroscope) reader.onGyroscope(time, sensorValues[0], sensorValues[1], sensorValues[2]);
             } else if (sensorType == "accelerometer") {
-                if (onAccelerometer) onAccelerometer(time, sensorValues[0], sensorValues[1], sensorValues[2]);
+                if (reader.onAccelerometer) reader.onAccelerometer(time, sensorValues[0], sensorValues[1], sensorValues[2]);
             }
-        } else if (onFrames && j.find("frames") != j.end()) {
+        } else if (reader.onFrames && kind == Kind::FRAMES) {
             frames.clear();
             time = j["time"].get<double>();
             json jFrames = j["frames"];
@@ -80,15 +512,806 @@ void JsonlReader::read(std::string jsonlFilePath) {
                 // Use map to allow any order of cameraInds in the JSON array.
                 frames.insert({cameraInd, frame});
             }
-            if (!frames.empty()) {
-                size_t n = frames.size();
-                framesVec.clear();
-                // Assumes the keys of `this->frames` are successive without gaps and start from zero.
-                for (size_t i = 0; i < n; ++i) {
-                    framesVec.push_back(frames.at(i));
-                }
-                onFrames(framesVec);
+            emitFrames();
+        } else if (reader.onGps && kind == Kind::GPS) {
+            const json &g = j["gps"];
+            recorder::GpsData d;
+            d.t = LineParser::time(j);
+            d.latitude = number(g.at("latitude"));
+            d.longitude = number(g.at("longitude"));
+            d.accuracy = number(g.at("accuracy"));
+            d.altitude = number(g.at("altitude"));
+            reader.onGps(d);
+        } else if (kind == Kind::ARKIT || kind == Kind::GROUND_TRUTH) {
+            const auto &callback = kind == Kind::ARKIT ? reader.onARKit : reader.onGroundTruth;
+            if (!callback) return;
+            const json &p = j[kind == Kind::ARKIT ? "ARKit" : "groundTruth"];
+            recorder::Pose pose = { LineParser::time(j), vector3(p.at("position")), NO_ORIENTATION };
+            callback(pose);
+        } else if (reader.onOdometryOutput && kind == Kind::ODOMETRY_OUTPUT) {
+            const json &o = j["output"];
+            const json &q = o.at("orientation");
+            recorder::Pose pose = {
+                LineParser::time(j),
+                vector3(o.at("position")),
+                { number(q.at("x")), number(q.at("y")), number(q.at("z")), number(q.at("w")) }
+            };
+            reader.onOdometryOutput(pose, vector3(o.at("velocity")));
+        } else if (reader.onDroppedFrame && kind == Kind::DROPPED_FRAME) {
+            reader.onDroppedFrame(LineParser::time(j));
+        } else if (reader.onOther && kind == Kind::OTHER) {
+            reader.onOther(j.is_object() ? LineParser::time(j) : NAN, begin, end - begin);
+        }
+    }
+
+    void emitFrames() {
+        if (!frames.empty()) {
+            size_t n = frames.size();
+            framesVec.clear();
+            // Assumes the keys of `this->frames` are successive without gaps and start from zero.
+            for (size_t i = 0; i < n; ++i) {
+                framesVec.push_back(frames.at(i));
+            }
+            reader.onFrames(framesVec);
+        }
+    }
+};
+
+// Calls the JsonlReader callbacks for a binary recording the same way
+// LineParser does for the equivalent JSONL.
+struct BinaryRecordParser : recorder::RecordHandler {
+    LineParser lineParser;
+    JsonlReader &reader;
+    std::string line;
+
+    BinaryRecordParser(JsonlReader &reader) : lineParser(reader), reader(reader) {}
+
+    void gyroscope(const recorder::GyroscopeData &d) final {
+        if (reader.onGyroscope) reader.onGyroscope(d.t, d.x, d.y, d.z);
+    }
+
+    void accelerometer(const recorder::AccelerometerData &d) final {
+        if (reader.onAccelerometer) reader.onAccelerometer(d.t, d.x, d.y, d.z);
+    }
+
+    void gps(const recorder::GpsData &d) final {
+        if (reader.onGps) reader.onGps(d);
+    }
+
+    void arkit(const recorder::Pose &pose) final {
+        if (reader.onARKit) reader.onARKit({ pose.time, pose.position, NO_ORIENTATION });
+    }
+
+    void groundTruth(const recorder::Pose &pose) final {
+        if (reader.onGroundTruth) reader.onGroundTruth({ pose.time, pose.position, NO_ORIENTATION });
+    }
+
+    void odometryOutput(const recorder::Pose &pose, const recorder::Vector3d &velocity) final {
+        if (reader.onOdometryOutput) reader.onOdometryOutput(pose, velocity);
+    }
+
+    void frameDrop(double t) final {
+        if (reader.onDroppedFrame) reader.onDroppedFrame(t);
+    }
+
+    void recordDrop(recorder::Stream stream, std::size_t count, double t) final {
+        if (!reader.onOther) return;
+        line.clear();
+        recorder::serializeRecordDrop(line, stream, count, t);
+        reader.onOther(t, line.data(), line.size());
+    }
+
+    void frameGroup(double t, int, const recorder::FrameData *frames, const int *, std::size_t n) final {
+        if (!reader.onFrames) return;
+        lineParser.frames.clear();
+        for (std::size_t i = 0; i < n; ++i) {
+            const recorder::FrameData &f = frames[i];
+            // Parameters that would be left out of the JSONL keep their defaults.
+            JsonlReader::FrameParameters frame = { t };
+            if (f.focalLengthX > 0.0) frame.focalLengthX = f.focalLengthX;
+            if (f.focalLengthY > 0.0) frame.focalLengthY = f.focalLengthY;
+            if (f.px > 0.0 && f.py > 0.0) {
+                frame.principalPointX = f.px;
+                frame.principalPointY = f.py;
+            }
+            lineParser.frames.insert({f.cameraInd, frame});
+        }
+        lineParser.emitFrames();
+    }
+
+    void json(const char *data, std::size_t n) final {
+        lineParser.parse(data, data + n);
+    }
+};
+
+// Accumulates JsonlReader::Summary from individual records
+struct SummaryBuilder {
+    JsonlReader::Summary summary;
+
+    void time(double t) {
+        if (std::isnan(t)) return;
+        summary.minTime = std::min(summary.minTime, t);
+        summary.maxTime = std::max(summary.maxTime, t);
+    }
+
+    void record(const std::string &stream, double t, std::size_t bytes) {
+        time(t);
+        JsonlReader::StreamSummary &s = summary.streams[stream];
+        s.count++;
+        s.bytes += bytes;
+        if (!std::isnan(t)) {
+            s.minTime = std::min(s.minTime, t);
+            s.maxTime = std::max(s.maxTime, t);
+        }
+    }
+
+    void recordDrop(const std::string &stream, std::size_t count, double t) {
+        time(t);
+        summary.streams[stream].dropped += count;
+    }
+
+    void frameDrop(double t) {
+        time(t);
+        summary.droppedFrames++;
+    }
+
+    // Summary of a part of the recording
+    void merge(const JsonlReader::Summary &other) {
+        time(other.minTime);
+        time(other.maxTime);
+        summary.droppedFrames += other.droppedFrames;
+        for (const auto &p : other.streams) {
+            JsonlReader::StreamSummary &s = summary.streams[p.first];
+            s.count += p.second.count;
+            s.dropped += p.second.dropped;
+            s.bytes += p.second.bytes;
+            s.minTime = std::min(s.minTime, p.second.minTime);
+            s.maxTime = std::max(s.maxTime, p.second.maxTime);
+        }
+    }
+
+    static double time(const json &j) {
+        const auto it = j.find("time");
+        return it != j.end() && it->is_number() ? it->get<double>() : NAN;
+    }
+
+    void line(const char *begin, const char *end) {
+        static const char *const NAMED[] = { "gps", "ARKit", "groundTruth", "output", "frames" };
+        const json j = json::parse(begin, end);
+        const double t = time(j);
+        const std::size_t bytes = end - begin + 1;
+        if (j.find("summary") != j.end()) return;
+        auto it = j.find("sensor");
+        if (it != j.end()) {
+            record(it->at("type").get<std::string>(), t, bytes);
+            return;
+        }
+        for (const char *name : NAMED) {
+            if (j.find(name) != j.end()) {
+                record(name, t, bytes);
+                return;
+            }
+        }
+        it = j.find("droppedRecords");
+        if (it != j.end()) {
+            recordDrop(it->at("stream").get<std::string>(), it->at("count").get<std::size_t>(), t);
+        } else if (j.find("droppedFrame") != j.end()) {
+            frameDrop(t);
+        } else {
+            record("json", t, bytes);
+        }
+    }
+
+    void lines(const char *begin, const char *end) {
+        while (begin < end) {
+            const char *eol = static_cast<const char*>(std::memchr(begin, '\n', end - begin));
+            if (!eol) eol = end;
+            if (eol > begin) line(begin, eol);
+            begin = eol == end ? end : eol + 1;
+        }
+    }
+};
+
+// Summary of a binary recording. Bytes are counted by encoding the records again.
+struct BinarySummary : recorder::RecordHandler {
+    SummaryBuilder builder;
+    std::string encoded;
+    std::unique_ptr<recorder::RecordHandler> encoder;
+
+    BinarySummary() : encoder(recorder::buildBinaryEncoder(encoded)) {}
+
+    void record(recorder::Stream stream, double t) {
+        builder.record(recorder::streamName(stream), t, encoded.size());
+        encoded.clear();
+    }
+
+    void gyroscope(const recorder::GyroscopeData &d) final {
+        encoder->gyroscope(d);
+        record(recorder::Stream::GYROSCOPE, d.t);
+    }
+
+    void accelerometer(const recorder::AccelerometerData &d) final {
+        encoder->accelerometer(d);
+        record(recorder::Stream::ACCELEROMETER, d.t);
+    }
+
+    void gps(const recorder::GpsData &d) final {
+        encoder->gps(d);
+        record(recorder::Stream::GPS, d.t);
+    }
+
+    void arkit(const recorder::Pose &pose) final {
+        encoder->arkit(pose);
+        record(recorder::Stream::ARKIT, pose.time);
+    }
+
+    void groundTruth(const recorder::Pose &pose) final {
+        encoder->groundTruth(pose);
+        record(recorder::Stream::GROUND_TRUTH, pose.time);
+    }
+
+    void odometryOutput(const recorder::Pose &pose, const recorder::Vector3d &velocity) final {
+        encoder->odometryOutput(pose, velocity);
+        record(recorder::Stream::ODOMETRY_OUTPUT, pose.time);
+    }
+
+    void frameGroup(double t, int groupNumber, const recorder::FrameData *frames, const int *frameNumbers, std::size_t n) final {
+        encoder->frameGroup(t, groupNumber, frames, frameNumbers, n);
+        record(recorder::Stream::FRAMES, t);
+    }
+
+    void frameDrop(double t) final {
+        builder.frameDrop(t);
+    }
+
+    void recordDrop(recorder::Stream stream, std::size_t count, double t) final {
+        builder.recordDrop(recorder::streamName(stream), count, t);
+    }
+
+    void json(const char *data, std::size_t n) final {
+        const auto j = nlohmann::json::parse(data, data + n);
+        if (j.find("summary") != j.end()) return;
+        encoder->json(data, n);
+        record(recorder::Stream::JSON, SummaryBuilder::time(j));
+    }
+};
+
+// Read-only view of a whole file, memory-mapped where supported. data is
+// nullptr if the file cannot be opened or is empty.
+class MappedFile {
+private:
+#ifdef _WIN32
+    std::vector<char> contents;
+#endif
+
+public:
+    const char *data = nullptr;
+    std::size_t size = 0;
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile &operator=(const MappedFile&) = delete;
+
+#ifdef _WIN32
+    MappedFile(const std::string &path) {
+        std::ifstream file(path, std::ios::binary);
+        contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        if (contents.empty()) return;
+        data = contents.data();
+        size = contents.size();
+    }
+#else
+    MappedFile(const std::string &path) {
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                ::madvise(p, st.st_size, MADV_SEQUENTIAL);
+                data = static_cast<const char*>(p);
+                size = st.st_size;
+            }
+        }
+        ::close(fd);
+    }
+
+    ~MappedFile() {
+        if (data) ::munmap(const_cast<char*>(data), size);
+    }
+#endif
+};
+
+// Whether a final line without a newline is an incomplete record
+bool isTorn(const char *begin, const char *end) {
+    return !json::accept(begin, end);
+}
+
+// End of the complete records: before the final line if it is torn
+const char *recordsEnd(const char *begin, const char *end) {
+    if (begin == end || end[-1] == '\n') return end;
+    const char *line = end;
+    while (line > begin && line[-1] != '\n') --line;
+    return isTorn(line, end) ? line : end;
+}
+
+constexpr std::size_t MIN_CHUNK_BYTES = 64 * 1024;
+constexpr std::size_t MAX_CHUNK_BYTES = 8 * 1024 * 1024;
+
+void parseLines(JsonlReader &reader, const char *begin, const char *end) {
+    LineParser parser(reader);
+    while (begin < end) {
+        const char *eol = static_cast<const char*>(std::memchr(begin, '\n', end - begin));
+        if (!eol) eol = end;
+        if (eol > begin) parser.parse(begin, eol);
+        begin = eol == end ? end : eol + 1;
+    }
+}
+
+// End of the chunk starting at begin: the first line end after n bytes
+const char *chunkEnd(const char *begin, const char *end, std::size_t n) {
+    if (static_cast<std::size_t>(end - begin) <= n) return end;
+    const char *eol = static_cast<const char*>(std::memchr(begin + n, '\n', end - begin - n));
+    return eol ? eol + 1 : end;
+}
+
+// Callbacks of one chunk, parsed on a worker thread and delivered in order
+// on the calling thread.
+struct Chunk {
+    struct Record {
+        enum class Type { GYROSCOPE, ACCELEROMETER, FRAMES, GPS, ARKIT, GROUND_TRUTH, ODOMETRY_OUTPUT, DROPPED_FRAME, OTHER } type;
+        double time, x, y, z;
+    };
+
+    const char *begin;
+    const char *end;
+    std::vector<Record> records;
+    // Payloads of the less frequent record types, in record order
+    std::vector< std::vector<JsonlReader::FrameParameters> > frames;
+    std::vector<recorder::GpsData> gps;
+    std::vector< std::pair<recorder::Pose, recorder::Vector3d> > poses;
+    // Lines in the mapped file
+    std::vector< std::pair<const char*, std::size_t> > others;
+    std::exception_ptr error;
+
+    void parse(const JsonlReader &reader) {
+        using Type = Record::Type;
+        JsonlReader collector;
+        if (reader.onGyroscope) collector.onGyroscope = [this](double t, double x, double y, double z) {
+            records.push_back({ Type::GYROSCOPE, t, x, y, z });
+        };
+        if (reader.onAccelerometer) collector.onAccelerometer = [this](double t, double x, double y, double z) {
+            records.push_back({ Type::ACCELEROMETER, t, x, y, z });
+        };
+        if (reader.onFrames) collector.onFrames = [this](std::vector<JsonlReader::FrameParameters> f) {
+            records.push_back({ Type::FRAMES, 0.0, 0.0, 0.0, 0.0 });
+            frames.push_back(std::move(f));
+        };
+        if (reader.onGps) collector.onGps = [this](const recorder::GpsData &d) {
+            records.push_back({ Type::GPS, 0.0, 0.0, 0.0, 0.0 });
+            gps.push_back(d);
+        };
+        const auto pose = [this](Type type) {
+            return [this, type](const recorder::Pose &p) {
+                records.push_back({ type, 0.0, 0.0, 0.0, 0.0 });
+                poses.push_back({ p, recorder::Vector3d {} });
+            };
+        };
+        if (reader.onARKit) collector.onARKit = pose(Type::ARKIT);
+        if (reader.onGroundTruth) collector.onGroundTruth = pose(Type::GROUND_TRUTH);
+        if (reader.onOdometryOutput) collector.onOdometryOutput = [this](const recorder::Pose &p, const recorder::Vector3d &v) {
+            records.push_back({ Type::ODOMETRY_OUTPUT, 0.0, 0.0, 0.0, 0.0 });
+            poses.push_back({ p, v });
+        };
+        if (reader.onDroppedFrame) collector.onDroppedFrame = [this](double t) {
+            records.push_back({ Type::DROPPED_FRAME, t, 0.0, 0.0, 0.0 });
+        };
+        if (reader.onOther) collector.onOther = [this](double t, const char *line, std::size_t n) {
+            records.push_back({ Type::OTHER, t, 0.0, 0.0, 0.0 });
+            others.push_back({ line, n });
+        };
+        try {
+            parseLines(collector, begin, end);
+        } catch (...) {
+            error = std::current_exception();
+        }
+    }
+
+    void deliver(const JsonlReader &reader) {
+        std::size_t frameInd = 0, gpsInd = 0, poseInd = 0, otherInd = 0;
+        for (const Record &r : records) {
+            switch (r.type) {
+                case Record::Type::GYROSCOPE:
+                    reader.onGyroscope(r.time, r.x, r.y, r.z);
+                    break;
+                case Record::Type::ACCELEROMETER:
+                    reader.onAccelerometer(r.time, r.x, r.y, r.z);
+                    break;
+                case Record::Type::FRAMES:
+                    reader.onFrames(std::move(frames[frameInd++]));
+                    break;
+                case Record::Type::GPS:
+                    reader.onGps(gps[gpsInd++]);
+                    break;
+                case Record::Type::ARKIT:
+                    reader.onARKit(poses[poseInd++].first);
+                    break;
+                case Record::Type::GROUND_TRUTH:
+                    reader.onGroundTruth(poses[poseInd++].first);
+                    break;
+                case Record::Type::ODOMETRY_OUTPUT:
+                    reader.onOdometryOutput(poses[poseInd].first, poses[poseInd].second);
+                    poseInd++;
+                    break;
+                case Record::Type::DROPPED_FRAME:
+                    reader.onDroppedFrame(r.time);
+                    break;
+                case Record::Type::OTHER:
+                    reader.onOther(r.time, others[otherInd].first, others[otherInd].second);
+                    otherInd++;
+                    break;
+            }
+        }
+        if (error) std::rethrow_exception(error);
+    }
+};
+
+void readOrdered(JsonlReader &reader, const char *begin, const char *end, recorder::Processor &pool, std::size_t chunkBytes) {
+    // Bounds the memory used by parsed records waiting for delivery.
+    const std::size_t maxChunksInFlight = 2 * reader.threads;
+    std::deque< std::pair<std::unique_ptr<Chunk>, recorder::Future> > inFlight;
+    const char *p = begin;
+    try {
+        while (p < end || !inFlight.empty()) {
+            if (p < end && inFlight.size() < maxChunksInFlight) {
+                std::unique_ptr<Chunk> chunk(new Chunk);
+                chunk->begin = p;
+                chunk->end = chunkEnd(p, end, chunkBytes);
+                p = chunk->end;
+                Chunk *c = chunk.get();
+                auto future = pool.enqueue([c, &reader]() { c->parse(reader); });
+                inFlight.emplace_back(std::move(chunk), future);
+                continue;
             }
+            inFlight.front().second.wait();
+            inFlight.front().first->deliver(reader);
+            inFlight.pop_front();
+        }
+    } catch (...) {
+        // Chunks still being parsed must outlive the workers using them.
+        pool.barrier().wait();
+        throw;
+    }
+}
+
+void readUnordered(JsonlReader &reader, const char *begin, const char *end, recorder::Processor &pool, std::size_t chunkBytes) {
+    std::mutex mutex;
+    std::exception_ptr error;
+    const char *p = begin;
+    while (p < end) {
+        const char *chunk = p;
+        p = chunkEnd(p, end, chunkBytes);
+        pool.post([&reader, &mutex, &error, chunk, p]() {
+            try {
+                parseLines(reader, chunk, p);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error) error = std::current_exception();
+            }
+        });
+    }
+    pool.barrier().wait();
+    if (error) std::rethrow_exception(error);
+}
+
+// Parse the JSONL lines in [begin, end) on reader.threads threads
+void parseBytes(JsonlReader &reader, const char *begin, const char *end) {
+    if (reader.threads <= 1) {
+        parseLines(reader, begin, end);
+        return;
+    }
+    const std::size_t size = end - begin;
+    const std::size_t chunkBytes = std::min(std::max(size / (4 * reader.threads), MIN_CHUNK_BYTES), MAX_CHUNK_BYTES);
+    auto pool = recorder::Processor::createThreadPool(static_cast<int>(reader.threads));
+    if (reader.ordered) {
+        readOrdered(reader, begin, end, *pool, chunkBytes);
+    } else {
+        readUnordered(reader, begin, end, *pool, chunkBytes);
+    }
+}
+
+// Bucket length of indices built by the reader
+constexpr double DEFAULT_INDEX_INTERVAL = 0.1;
+
+// Streams the reader has callbacks for, as a TimeIndex stream mask
+unsigned streamMask(const JsonlReader &reader) {
+    using recorder::Stream;
+    const auto bit = [](Stream s) { return 1u << static_cast<unsigned>(s); };
+    unsigned mask = 0;
+    if (reader.onGyroscope) mask |= bit(Stream::GYROSCOPE);
+    if (reader.onAccelerometer) mask |= bit(Stream::ACCELEROMETER);
+    if (reader.onFrames || reader.onDroppedFrame) mask |= bit(Stream::FRAMES);
+    if (reader.onGps) mask |= bit(Stream::GPS);
+    if (reader.onARKit) mask |= bit(Stream::ARKIT);
+    if (reader.onGroundTruth) mask |= bit(Stream::GROUND_TRUTH);
+    if (reader.onOdometryOutput) mask |= bit(Stream::ODOMETRY_OUTPUT);
+    if (reader.onOther) mask |= bit(Stream::JSON);
+    return mask;
+}
+
+// Copy of reader that only passes on records with t0 <= time < t1
+JsonlReader timeFiltered(const JsonlReader &reader, double t0, double t1) {
+    JsonlReader filtered = reader;
+    const auto inRange = [t0, t1](double t) { return t >= t0 && t < t1; };
+    if (reader.onGyroscope) filtered.onGyroscope = [&reader, inRange](double t, double x, double y, double z) {
+        if (inRange(t)) reader.onGyroscope(t, x, y, z);
+    };
+    if (reader.onAccelerometer) filtered.onAccelerometer = [&reader, inRange](double t, double x, double y, double z) {
+        if (inRange(t)) reader.onAccelerometer(t, x, y, z);
+    };
+    if (reader.onFrames) filtered.onFrames = [&reader, inRange](std::vector<JsonlReader::FrameParameters> frames) {
+        if (inRange(frames.front().time)) reader.onFrames(std::move(frames));
+    };
+    if (reader.onGps) filtered.onGps = [&reader, inRange](const recorder::GpsData &d) {
+        if (inRange(d.t)) reader.onGps(d);
+    };
+    if (reader.onARKit) filtered.onARKit = [&reader, inRange](const recorder::Pose &pose) {
+        if (inRange(pose.time)) reader.onARKit(pose);
+    };
+    if (reader.onGroundTruth) filtered.onGroundTruth = [&reader, inRange](const recorder::Pose &pose) {
+        if (inRange(pose.time)) reader.onGroundTruth(pose);
+    };
+    if (reader.onOdometryOutput) filtered.onOdometryOutput = [&reader, inRange](const recorder::Pose &pose, const recorder::Vector3d &v) {
+        if (inRange(pose.time)) reader.onOdometryOutput(pose, v);
+    };
+    if (reader.onDroppedFrame) filtered.onDroppedFrame = [&reader, inRange](double t) {
+        if (inRange(t)) reader.onDroppedFrame(t);
+    };
+    if (reader.onOther) filtered.onOther = [&reader, inRange](double t, const char *line, std::size_t n) {
+        if (inRange(t)) reader.onOther(t, line, n);
+    };
+    return filtered;
+}
+
+void buildIndex(recorder::TimeIndex &index, const MappedFile &file) {
+    using recorder::Stream;
+    std::uint64_t begin = 0, end = 0;
+    const auto add = [&](Stream stream, double t) { index.add(stream, t, begin, end); };
+    JsonlReader collector;
+    collector.onGyroscope = [&](double t, double, double, double) { add(Stream::GYROSCOPE, t); };
+    collector.onAccelerometer = [&](double t, double, double, double) { add(Stream::ACCELEROMETER, t); };
+    collector.onFrames = [&](std::vector<JsonlReader::FrameParameters> frames) {
+        add(Stream::FRAMES, frames.front().time);
+    };
+    collector.onGps = [&](const recorder::GpsData &d) { add(Stream::GPS, d.t); };
+    collector.onARKit = [&](const recorder::Pose &pose) { add(Stream::ARKIT, pose.time); };
+    collector.onGroundTruth = [&](const recorder::Pose &pose) { add(Stream::GROUND_TRUTH, pose.time); };
+    collector.onOdometryOutput = [&](const recorder::Pose &pose, const recorder::Vector3d &) {
+        add(Stream::ODOMETRY_OUTPUT, pose.time);
+    };
+    collector.onDroppedFrame = [&](double t) { add(Stream::FRAMES, t); };
+    collector.onOther = [&](double t, const char *, std::size_t) { add(Stream::JSON, t); };
+    LineParser parser(collector);
+    const std::uint64_t size = recordsEnd(file.data, file.data + file.size) - file.data;
+    while (begin < size) {
+        const char *line = file.data + begin;
+        const char *eol = static_cast<const char*>(std::memchr(line, '\n', size - begin));
+        end = eol ? eol + 1 - file.data : size;
+        if (eol != line) parser.parse(line, eol ? eol : file.data + size);
+        begin = end;
+    }
+}
+
+// The index saved next to the recording, or a new one (also saved, if
+// possible) if it is missing or out of date.
+std::unique_ptr<recorder::TimeIndex> timeIndex(const std::string &path, const MappedFile &file) {
+    const std::string indexPath = recorder::timeIndexPath(path);
+    std::unique_ptr<recorder::TimeIndex> index(new recorder::TimeIndex(DEFAULT_INDEX_INTERVAL));
+    if (index->load(indexPath) && index->fileSize() == file.size) return index;
+    index.reset(new recorder::TimeIndex(DEFAULT_INDEX_INTERVAL));
+    buildIndex(*index, file);
+    index->save(indexPath, file.size);
+    return index;
+}
+
+double numberOr(const json &j, const char *key, double fallback) {
+    const auto it = j.find(key);
+    return it != j.end() && it->is_number() ? it->get<double>() : fallback;
+}
+
+// Parse the {"summary":{...}} record the recorder writes last
+JsonlReader::Summary parseSummary(const json &j) {
+    JsonlReader::Summary summary;
+    summary.droppedFrames = j.at("droppedFrames").get<std::size_t>();
+    summary.minTime = numberOr(j, "minTime", summary.minTime);
+    summary.maxTime = numberOr(j, "maxTime", summary.maxTime);
+    for (const auto &stream : j.at("streams").items()) {
+        JsonlReader::StreamSummary &s = summary.streams[stream.key()];
+        const json &js = stream.value();
+        s.count = js.at("count").get<std::size_t>();
+        s.dropped = js.at("dropped").get<std::size_t>();
+        s.bytes = js.at("bytes").get<std::uint64_t>();
+        s.minTime = numberOr(js, "minTime", s.minTime);
+        s.maxTime = numberOr(js, "maxTime", s.maxTime);
+    }
+    return summary;
+}
+
+// Find the summary record at the end of a JSONL or binary recording
+bool readSummaryRecord(const std::string &path, JsonlReader::Summary &summary) {
+    constexpr std::streamoff TAIL_BYTES = 16 * 1024;
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) return false;
+    const std::streamoff size = file.tellg();
+    const std::streamoff n = std::min(size, TAIL_BYTES);
+    if (n <= 0) return false;
+    std::string tail(n, '\0');
+    file.seekg(size - n);
+    if (!file.read(&tail[0], n)) return false;
+
+    const std::size_t pos = tail.rfind("{\"summary\":");
+    if (pos == std::string::npos) return false;
+    std::string text = tail.substr(pos);
+    if (!text.empty() && text.back() == '\n') text.pop_back();
+    // Must be a whole record: a JSONL line, or a length-prefixed binary one
+    bool whole = pos > 0 ? tail[pos - 1] == '\n' : n == size;
+    if (!whole && pos >= 4) {
+        std::uint32_t length = 0;
+        for (int i = 0; i < 4; ++i) length |= static_cast<std::uint32_t>(static_cast<unsigned char>(tail[pos - 4 + i])) << (8 * i);
+        whole = length == text.size();
+    }
+    if (!whole) return false;
+    try {
+        const json j = json::parse(text);
+        summary = parseSummary(j.at("summary"));
+    } catch (const json::exception &) {
+        return false;
+    }
+    return true;
+}
+
+JsonlReader::Summary scanSummary(const std::string &path, unsigned threads) {
+    MappedFile file(path);
+    if (file.data && file.data[0] == '{') {
+        SummaryBuilder total;
+        const char *end = recordsEnd(file.data, file.data + file.size);
+        if (threads <= 1) {
+            total.lines(file.data, end);
+            return total.summary;
         }
+        const std::size_t chunkBytes = std::min(std::max(file.size / (4 * threads), MIN_CHUNK_BYTES), MAX_CHUNK_BYTES);
+        auto pool = recorder::Processor::createThreadPool(static_cast<int>(threads));
+        std::mutex mutex;
+        std::exception_ptr error;
+        const char *p = file.data;
+        while (p < end) {
+            const char *chunk = p;
+            p = chunkEnd(p, end, chunkBytes);
+            pool->post([&total, &mutex, &error, chunk, p]() {
+                SummaryBuilder part;
+                std::exception_ptr partError;
+                try {
+                    part.lines(chunk, p);
+                } catch (...) {
+                    partError = std::current_exception();
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                total.merge(part.summary);
+                if (partError && !error) error = partError;
+            });
+        }
+        pool->barrier().wait();
+        if (error) std::rethrow_exception(error);
+        return total.summary;
+    }
+
+    auto input = recorder::openJsonlInput(path);
+    // Missing or unreadable, nothing to read
+    if (!input) return JsonlReader::Summary();
+    std::istream &dataFile = *input;
+    if (recorder::isBinaryRecording(dataFile)) {
+        BinarySummary binary;
+        recorder::decodeBinary(dataFile, binary);
+        return binary.builder.summary;
+    }
+    SummaryBuilder builder;
+    std::string line;
+    while (std::getline(dataFile, line)) {
+        if (dataFile.eof() && isTorn(line.data(), line.data() + line.size())) break;
+        builder.line(line.data(), line.data() + line.size());
+    }
+    return builder.summary;
+}
+} // anonymous namespace
+
+JsonlReader::Summary JsonlReader::getSummary(std::string jsonlFilePath) {
+    Summary summary;
+    if (readSummaryRecord(jsonlFilePath, summary)) return summary;
+    return scanSummary(jsonlFilePath, threads);
+}
+
+double JsonlReader::getSmallestTimestamp(std::string jsonlFilePath) {
+    return getSummary(jsonlFilePath).minTime;
+}
+
+void JsonlReader::read(std::string jsonlFilePath) {
+    if (threads > 1) {
+        MappedFile file(jsonlFilePath);
+        // Gzip and binary recordings are not split, JSONL always starts with an object.
+        if (file.data && file.data[0] == '{') {
+            parseBytes(*this, file.data, recordsEnd(file.data, file.data + file.size));
+            return;
+        }
+    }
+
+    auto input = recorder::openJsonlInput(jsonlFilePath);
+    // Missing or unreadable, nothing to read
+    if (!input) return;
+    std::istream &dataFile = *input;
+
+    if (recorder::isBinaryRecording(dataFile)) {
+        BinaryRecordParser parser(*this);
+        recorder::decodeBinary(dataFile, parser);
+        return;
+    }
+
+    LineParser parser(*this);
+    std::string line;
+    while (std::getline(dataFile, line)) {
+        if (dataFile.eof() && isTorn(line.data(), line.data() + line.size())) break;
+        parser.parse(line.data(), line.data() + line.size());
+    }
+}
+
+void JsonlReader::readRange(std::string jsonlFilePath, double t0, double t1) {
+    JsonlReader filtered = timeFiltered(*this, t0, t1);
+    MappedFile file(jsonlFilePath);
+    if (!file.data || file.data[0] != '{') {
+        // Not indexable, read everything.
+        filtered.read(jsonlFilePath);
+        return;
+    }
+    const unsigned mask = streamMask(*this);
+    if (!mask) return;
+    recorder::TimeIndex::Range range;
+    if (!timeIndex(jsonlFilePath, file)->find(mask, t0, t1, range)) return;
+    const std::size_t end = std::min<std::uint64_t>(range.end, recordsEnd(file.data, file.data + file.size) - file.data);
+    if (range.begin >= end) return;
+    parseBytes(filtered, file.data + range.begin, file.data + end);
+}
+
+std::size_t JsonlReader::seek(std::string jsonlFilePath, double t) {
+    MappedFile file(jsonlFilePath);
+    if (!file.data || file.data[0] != '{') return 0;
+    unsigned mask = streamMask(*this);
+    if (!mask) mask = ~0u;
+    recorder::TimeIndex::Range range;
+    if (!timeIndex(jsonlFilePath, file)->find(mask, t, std::numeric_limits<double>::infinity(), range)) {
+        return file.size;
+    }
+    return range.begin;
+}
+
+std::size_t JsonlReader::truncateTornRecord(std::string jsonlFilePath) {
+    std::size_t size, complete;
+#ifdef _WIN32
+    std::string kept;
+#endif
+    {
+        MappedFile file(jsonlFilePath);
+        // A torn record can also be all there is, as zeros.
+        if (!file.data || (file.data[0] != '{' && file.data[0] != '\0')) return 0;
+        size = file.size;
+        complete = recordsEnd(file.data, file.data + file.size) - file.data;
+#ifdef _WIN32
+        kept.assign(file.data, complete);
+#endif
     }
+    if (complete == size) return 0;
+#ifdef _WIN32
+    std::ofstream output(jsonlFilePath, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!output.write(kept.data(), kept.size())) return 0;
+#else
+    if (::truncate(jsonlFilePath.c_str(), static_cast<off_t>(complete)) != 0) return 0;
+#endif
+    return size - complete;
 }
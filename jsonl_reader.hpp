@@ -1,10 +1,16 @@
 #ifndef JSONL_READER_H
 #define JSONL_READER_H
 
-#include <string>
+#include <cstddef>
+#include <cstdint>
 #include <functional>
+#include <limits>
+#include <map>
+#include <string>
 #include <vector>
 
+#include "types.hpp"
+
 class JsonlReader {
 public:
     struct FrameParameters {
@@ -15,14 +21,92 @@ public:
         double principalPointY = -1;
     };
 
+    struct StreamSummary {
+        std::size_t count = 0;
+        /** Records the recorder dropped because its queue was full */
+        std::size_t dropped = 0;
+        /** Size in the recording, before compression */
+        std::uint64_t bytes = 0;
+        double minTime = std::numeric_limits<double>::infinity();
+        double maxTime = -std::numeric_limits<double>::infinity();
+    };
+
+    struct Summary {
+        /** By stream name in the recording, e.g. "gyroscope" or "frames" */
+        std::map<std::string, StreamSummary> streams;
+        std::size_t droppedFrames = 0;
+        /** Over all records with a time, including dropped frame and record notices */
+        double minTime = std::numeric_limits<double>::infinity();
+        double maxTime = -std::numeric_limits<double>::infinity();
+    };
+
+    /**
+     * Statistics of a recording. Read from the end of the file if the
+     * recorder wrote a summary (recorder::Settings::writeSummary), otherwise
+     * computed by scanning the whole file, on `threads` threads for plain
+     * JSONL.
+     */
+    Summary getSummary(std::string jsonlFilePath);
+    /** getSummary().minTime */
     double getSmallestTimestamp(std::string jsonlFilePath);
+    /**
+     * Call the callbacks for each record in the file. A final line that has
+     * no newline and is not valid JSON, e.g. cut short by a crash or left as
+     * zeros after a power loss, is a torn record and is skipped, here and in
+     * the other methods. A file that cannot be opened has no records.
+     */
     void read(std::string jsonlFilePath);
+    /**
+     * Like read(), but only for records with t0 <= time < t1. Only the part
+     * of the file that can contain them is parsed, using the time index next
+     * to the recording (see recorder::Settings::indexInterval). If the index
+     * is missing or out of date, it is built and saved first. Gzip compressed
+     * and binary recordings are read in full and filtered.
+     */
+    void readRange(std::string jsonlFilePath, double t0, double t1);
+    /**
+     * Byte offset in the file from which on are all the records with
+     * time >= t that have a callback set (any record if none is set).
+     * Uses the time index like readRange(). 0 for unindexable recordings.
+     */
+    std::size_t seek(std::string jsonlFilePath, double t);
+    /**
+     * Remove a torn final record (see read()) from a plain JSONL file, e.g.
+     * before appending to a recording recovered after a crash.
+     *
+     * @return Bytes removed, 0 if there was none or the file is not plain JSONL
+     */
+    static std::size_t truncateTornRecord(std::string jsonlFilePath);
+
+    /**
+     * Number of threads parsing the file in read(). With more than one, a
+     * plain JSONL file is memory-mapped and parsed in newline-aligned chunks.
+     * Gzip compressed and binary recordings are always read on one thread.
+     */
+    unsigned threads = 1;
+    /**
+     * With threads > 1, call the callbacks on the calling thread in file
+     * order. If false, they are called directly from the parser threads,
+     * concurrently and in no particular order across chunks.
+     */
+    bool ordered = true;
 
     std::function<void(double time, double x, double y, double z)> onGyroscope;
     std::function<void(double time, double x, double y, double z)> onAccelerometer;
-    // TODO: Add support
-    // std::function<void(double time, double x, double y, double z)> onGroundTruth;
     std::function<void(std::vector<FrameParameters>)> onFrames;
+    std::function<void(const recorder::GpsData &gps)> onGps;
+    /** Orientation is not recorded and is NaN */
+    std::function<void(const recorder::Pose &pose)> onARKit;
+    /** Orientation is not recorded and is NaN */
+    std::function<void(const recorder::Pose &pose)> onGroundTruth;
+    std::function<void(const recorder::Pose &pose, const recorder::Vector3d &velocity)> onOdometryOutput;
+    std::function<void(double time)> onDroppedFrame;
+    /**
+     * Any other line, such as those from Recorder::addJson(), without the
+     * newline. The data is only valid during the call. time is NaN if the
+     * line has none.
+     */
+    std::function<void(double time, const char *line, std::size_t size)> onOther;
 };
 
 #endif // JSONL_READER_H
@@ -1,73 +1,181 @@
 #ifndef IMAGE_ALLOCATOR
 #define IMAGE_ALLOCATOR
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
-#include <functional>
+#include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <new>
+#include <type_traits>
 
 namespace recorder {
 /**
- * A buffer and custom allocation mechanism for maintaining a buffer of
- * re-usable shared_ptr slots. Designed for image and texture storage in mind
- *  - enable pre-allocation of memory for a certain fixed capacity
+ * A pool of re-usable objects, e.g., buffers whose capacity is kept between
+ * uses so that a steady state needs no memory allocation
  *  - lazy initialization to automatically determine the capacity
- *  - if the initial cacacity is exceeded, allocates more memory and re-uses
- *  - reference counting using std::shared_ptr to check which slots are free
+ *  - if the capacity is exceeded, constructs more objects and re-uses those
+ *  - free objects are kept in a lock-free list, so acquire() and release()
+ *    are O(1) and thread safe
+ *  - if the pool is full, acquire() falls back to the heap
+ *
+ * Released objects are not reset: the user of acquire() should assign or
+ * clear() them.
  */
-template <class Img> class Allocator {
+template <class T> class Allocator {
+public:
+    struct Stats {
+        /** Objects constructed in the pool */
+        std::size_t capacity;
+        /** Objects acquired and not yet released, including heap ones */
+        std::size_t inUse;
+        /** Maximum of inUse so far */
+        std::size_t highWater;
+        /** Calls to acquire() */
+        std::size_t acquired;
+        /** Calls to acquire() that found the pool full and used the heap */
+        std::size_t overflows;
+    };
+
 private:
     static constexpr std::size_t DEFAULT_CAPACITY_INCREASE = 4;
+    typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type Storage;
+
     const std::size_t capacityIncrease;
     const std::size_t maxCapacity;
+    // Room for maxCapacity objects, of which the first `allocated` are
+    // constructed. Untouched pages of a large pool cost no physical memory.
+    const std::unique_ptr<Storage[]> storage;
+    // Index + 1 of the next free object of each free object, 0 for none
+    const std::unique_ptr<std::atomic<std::uint32_t>[]> nextFree;
+    std::atomic<std::size_t> allocated{0};
+    // Index + 1 of the first free object in the low bits, and a counter
+    // in the high bits so that a stale compare-and-swap fails (ABA).
+    std::atomic<std::uint64_t> freeHead{0};
+    std::atomic<std::size_t> inUse{0};
+    std::atomic<std::size_t> highWater{0};
+    std::atomic<std::size_t> acquired{0};
+    std::atomic<std::size_t> overflows{0};
 
-    const std::function< std::unique_ptr<Img>() > allocator;
-    std::vector< std::shared_ptr<Img> > buf;
-    std::size_t counter = 0;
-
-    bool increaseCapacity() {
-        auto n0 = buf.size();
-        if (n0 == maxCapacity)
-            return false;
-        n0 = std::min(n0 + capacityIncrease, maxCapacity);
-        while (buf.size() < n0) {
-            buf.emplace_back(allocator());
+    T *item(std::size_t i) const {
+        return reinterpret_cast<T*>(&storage[i]);
+    }
+
+    bool owns(const T *p) const {
+        const auto begin = reinterpret_cast<std::uintptr_t>(storage.get());
+        const auto end = reinterpret_cast<std::uintptr_t>(storage.get() + maxCapacity);
+        const auto q = reinterpret_cast<std::uintptr_t>(p);
+        return q >= begin && q < end;
+    }
+
+    void push(std::size_t i) {
+        std::uint64_t head = freeHead.load();
+        std::uint64_t next;
+        do {
+            nextFree[i].store(static_cast<std::uint32_t>(head), std::memory_order_relaxed);
+            next = ((head >> 32) + 1) << 32 | (i + 1);
+        } while (!freeHead.compare_exchange_weak(head, next));
+    }
+
+    T *pop() {
+        std::uint64_t head = freeHead.load();
+        while (true) {
+            const std::uint32_t first = static_cast<std::uint32_t>(head);
+            if (first == 0) return nullptr;
+            const std::uint64_t next = ((head >> 32) + 1) << 32 | nextFree[first - 1].load(std::memory_order_relaxed);
+            if (freeHead.compare_exchange_weak(head, next)) return item(first - 1);
         }
-        return true;
+    }
+
+    // Construct up to capacityIncrease new objects, put all but one of them
+    // in the free list and return that one
+    T *grow() {
+        std::size_t n = allocated.load();
+        std::size_t n1;
+        do {
+            if (n == maxCapacity) return nullptr;
+            n1 = std::min(n + std::max<std::size_t>(capacityIncrease, 1), maxCapacity);
+        } while (!allocated.compare_exchange_weak(n, n1));
+        for (std::size_t i = n; i < n1; ++i) {
+            new (&storage[i]) T();
+            if (i > n) push(i);
+        }
+        return item(n);
     }
 
 public:
-    Allocator(const std::function< std::unique_ptr<Img>() > &allocator,
+    /**
+     * @param initialCapacity Objects constructed right away
+     * @param capacityIncrease Objects constructed at a time after that
+     * @param maxCapacity Maximum number of objects in the pool
+     */
+    Allocator(
         std::size_t initialCapacity = 0,
         std::size_t capacityIncrease = DEFAULT_CAPACITY_INCREASE,
         std::size_t maxCapacity = DEFAULT_CAPACITY_INCREASE * 5)
     :
         capacityIncrease(capacityIncrease),
         maxCapacity(maxCapacity),
-        allocator(allocator)
+        storage(new Storage[maxCapacity]),
+        nextFree(new std::atomic<std::uint32_t>[maxCapacity])
     {
-        assert(allocator);
-        while (buf.size() < initialCapacity) buf.emplace_back(allocator());
+        assert(maxCapacity < UINT32_MAX);
+        initialCapacity = std::min(initialCapacity, maxCapacity);
+        for (std::size_t i = 0; i < initialCapacity; ++i) {
+            new (&storage[i]) T();
+            push(i);
+        }
+        allocated = initialCapacity;
+    }
+
+    Allocator(const Allocator&) = delete;
+    Allocator &operator=(const Allocator&) = delete;
+
+    /** Every acquired object must have been released */
+    ~Allocator() {
+        assert(inUse.load() == 0);
+        for (std::size_t i = 0; i < allocated.load(); ++i) item(i)->~T();
     }
 
     /**
-     * Return a shared pointer to an free slot. If Allocator is full, pointer is empty.
-    */
-    std::shared_ptr<Img> next() {
-        if (buf.empty()) increaseCapacity();
-        for (std::size_t failures = 0; failures < buf.size(); failures++) {
-            // note: this part should be OK without extra syncronization as
-            // each thread that may use the object referred to by this ptr
-            // does that through its own std::shared_ptr. I.e., we don't use
-            // access the same "shared_ptr&", from multiple threads.
-            auto &shared = buf.at((counter = (counter+1) % buf.size()));
-            if (shared.unique()) return shared;
+     * Return a free object from the pool, or a new one from the heap if the
+     * pool is full. Never null.
+     */
+    T *acquire() {
+        T *p = pop();
+        if (!p) p = grow();
+        if (!p) {
+            overflows++;
+            p = new T();
         }
-        if (increaseCapacity()) {
-            return next();
+        acquired++;
+        const std::size_t n = ++inUse;
+        std::size_t h = highWater.load();
+        while (n > h && !highWater.compare_exchange_weak(h, n)) {}
+        return p;
+    }
+
+    /** Return an object from acquire() to the pool */
+    void release(T *p) {
+        if (!p) return;
+        inUse--;
+        if (owns(p)) {
+            push(static_cast<std::size_t>(reinterpret_cast<Storage*>(p) - storage.get()));
         } else {
-            return std::shared_ptr<Img>(nullptr);
+            delete p;
         }
     }
+
+    Stats stats() const {
+        return Stats {
+            allocated.load(),
+            inUse.load(),
+            highWater.load(),
+            acquired.load(),
+            overflows.load()
+        };
+    }
 };
 
 }
@@ -1,66 +1,276 @@
 #ifndef RECORDER_FRAME_BUFFER
 #define RECORDER_FRAME_BUFFER
 
-#include <iostream>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
 #include <opencv2/core.hpp>
 
 namespace recorder {
 /**
  * A buffer and custom allocation mechanism for OpenCV frames. Features
+ *  - a separate pool for each frame shape (rows, cols, type)
  *  - lazy initialization to automatically determine the capacity
- *  - if the cacacity is exceeded, allocates more memory and re-uses that
- *  - automatic reference counting (using OpenCV Mat internal refcounter) to
- *    check which slots are free
+ *  - if the capacity is exceeded, allocates more memory and re-uses that
+ *  - a slot returns to a lock-free free list of its pool when the last
+ *    cv::Mat referring to it is released, so next() is O(1)
+ *
+ * next() and stats() are thread safe. The frames may outlive the FrameBuffer.
  */
 class FrameBuffer {
+public:
+    struct Stats {
+        int rows, cols, type;
+        /** Slots allocated */
+        std::size_t capacity;
+        /** Slots currently handed out */
+        std::size_t inUse;
+        /** Maximum of inUse so far */
+        std::size_t highWater;
+        /** Calls to next() that found the pool full */
+        std::size_t failures;
+    };
+
 private:
     static constexpr std::size_t DEFAULT_CAPACITY_INCREASE = 4;
-    const std::size_t capacityIncrease;
-    const std::size_t maxCapacity;
-
-    std::vector<cv::Mat> buf;
-    std::size_t counter = 0;
-
-    bool increaseCapacity(int rows, int cols, int type) {
-        auto n0 = buf.size();
-        if (n0 == maxCapacity)
-            return false;
-        n0 = std::min(n0 + capacityIncrease, maxCapacity);
-        while (buf.size() < n0) {
-            buf.emplace_back(cv::Mat(rows, cols, type));
+    // Different frame shapes supported at a time
+    static constexpr std::size_t MAX_SIZE_CLASSES = 16;
+
+#if CV_VERSION_MAJOR >= 4
+    typedef cv::AccessFlag AccessFlags;
+#else
+    typedef int AccessFlags;
+#endif
+
+    struct SizeClass;
+    struct Slot {
+        SizeClass *owner;
+        std::uint32_t index;
+        cv::UMatData *u = nullptr;
+        std::atomic<std::uint32_t> next{0};
+    };
+
+    struct SizeClass {
+        const int rows, cols, type;
+        std::unique_ptr<Slot[]> slots;
+        std::atomic<std::size_t> allocated{0};
+        // Index + 1 of the first free slot in the low bits, and a counter
+        // in the high bits so that a stale compare-and-swap fails (ABA).
+        std::atomic<std::uint64_t> freeHead{0};
+        std::atomic<std::size_t> inUse{0};
+        std::atomic<std::size_t> highWater{0};
+        std::atomic<std::size_t> failures{0};
+
+        SizeClass(int rows, int cols, int type, std::size_t maxCapacity) :
+            rows(rows), cols(cols), type(type), slots(new Slot[maxCapacity])
+        {
+            for (std::size_t i = 0; i < maxCapacity; ++i) {
+                slots[i].owner = this;
+                slots[i].index = static_cast<std::uint32_t>(i);
+            }
         }
-        return true;
-    }
+
+        void push(Slot &slot) {
+            std::uint64_t head = freeHead.load();
+            std::uint64_t next;
+            do {
+                slot.next.store(static_cast<std::uint32_t>(head), std::memory_order_relaxed);
+                next = ((head >> 32) + 1) << 32 | (slot.index + 1);
+            } while (!freeHead.compare_exchange_weak(head, next));
+        }
+
+        Slot *pop() {
+            std::uint64_t head = freeHead.load();
+            while (true) {
+                const std::uint32_t first = static_cast<std::uint32_t>(head);
+                if (first == 0) return nullptr;
+                Slot &slot = slots[first - 1];
+                const std::uint64_t next = ((head >> 32) + 1) << 32 | slot.next.load(std::memory_order_relaxed);
+                if (freeHead.compare_exchange_weak(head, next)) return &slot;
+            }
+        }
+    };
+
+    // The pools and the allocator OpenCV calls back when a slot is no
+    // longer referenced. Deleted once the FrameBuffer and all frames are gone.
+    class Pool : public cv::MatAllocator {
+    public:
+        const std::size_t capacityIncrease;
+        const std::size_t maxCapacity;
+        std::array<std::unique_ptr<SizeClass>, MAX_SIZE_CLASSES> classes;
+        std::atomic<std::size_t> classCount{0};
+        std::mutex classMutex;
+        // Frames handed out, plus one while the FrameBuffer exists
+        mutable std::atomic<std::size_t> references{1};
+        std::atomic<bool> closed{false};
+
+        Pool(std::size_t capacityIncrease, std::size_t maxCapacity) :
+            capacityIncrease(capacityIncrease), maxCapacity(maxCapacity) {}
+
+        ~Pool() {
+            freeUnused();
+        }
+
+        void freeUnused() {
+            for (std::size_t i = 0; i < classCount.load(); ++i) {
+                while (Slot *slot = classes[i]->pop()) freeSlot(*slot);
+            }
+        }
+
+        static void freeSlot(Slot &slot) {
+            slot.u->currAllocator = cv::Mat::getStdAllocator();
+            slot.u->userdata = nullptr;
+            cv::Mat::getStdAllocator()->deallocate(slot.u);
+            slot.u = nullptr;
+        }
+
+        void release() const {
+            if (references.fetch_sub(1) == 1) delete this;
+        }
+
+        SizeClass *sizeClass(int rows, int cols, int type) {
+            const auto find = [&](std::size_t begin, std::size_t end) -> SizeClass* {
+                for (std::size_t i = begin; i < end; ++i) {
+                    SizeClass *c = classes[i].get();
+                    if (c->rows == rows && c->cols == cols && c->type == type) return c;
+                }
+                return nullptr;
+            };
+            // Classes are only ever added, so no lock is needed to find one.
+            const std::size_t n = classCount.load();
+            if (SizeClass *c = find(0, n)) return c;
+            std::lock_guard<std::mutex> lock(classMutex);
+            const std::size_t m = classCount.load();
+            if (SizeClass *c = find(n, m)) return c;
+            if (m == MAX_SIZE_CLASSES) return nullptr;
+            classes[m].reset(new SizeClass(rows, cols, type, maxCapacity));
+            classCount.store(m + 1);
+            return classes[m].get();
+        }
+
+        // Allocate up to capacityIncrease new slots, put all but one of them
+        // in the free list and return that one
+        Slot *grow(SizeClass &c) {
+            std::size_t n = c.allocated.load();
+            std::size_t n1;
+            do {
+                if (n == maxCapacity) return nullptr;
+                n1 = std::min(n + std::max<std::size_t>(capacityIncrease, 1), maxCapacity);
+            } while (!c.allocated.compare_exchange_weak(n, n1));
+            for (std::size_t i = n; i < n1; ++i) {
+                Slot &slot = c.slots[i];
+                // Allocated normally, but released to this allocator
+                cv::Mat m(c.rows, c.cols, c.type);
+                slot.u = m.u;
+                slot.u->userdata = &slot;
+                slot.u->currAllocator = this;
+                // Detach m from the data, which is not referenced while free.
+                m.u = nullptr;
+                CV_XADD(&slot.u->refcount, -1);
+                if (i > n) c.push(slot);
+            }
+            return &c.slots[n];
+        }
+
+        std::unique_ptr<cv::Mat> next(int rows, int cols, int type) {
+            SizeClass *c = sizeClass(rows, cols, type);
+            if (!c) return nullptr;
+            Slot *slot = c->pop();
+            if (!slot) slot = grow(*c);
+            if (!slot) {
+                c->failures++;
+                return nullptr;
+            }
+            const std::size_t inUse = ++c->inUse;
+            std::size_t highWater = c->highWater.load();
+            while (inUse > highWater && !c->highWater.compare_exchange_weak(highWater, inUse)) {}
+            references++;
+
+            // A header for the slot's data that counts as a reference to it,
+            // like one from cv::Mat::create().
+            auto m = std::make_unique<cv::Mat>(rows, cols, type, slot->u->data);
+            m->u = slot->u;
+            CV_XADD(&slot->u->refcount, 1);
+            return m;
+        }
+
+        // Called by OpenCV when the last cv::Mat referring to a slot is
+        // released
+        void deallocate(cv::UMatData *u) const final {
+            if (!u) return;
+            Slot *slot = static_cast<Slot*>(u->userdata);
+            if (!slot) {
+                cv::Mat::getStdAllocator()->deallocate(u);
+                return;
+            }
+            SizeClass &c = *slot->owner;
+            c.inUse--;
+            if (closed.load()) {
+                freeSlot(*slot);
+            } else {
+                c.push(*slot);
+            }
+            release();
+        }
+
+        cv::UMatData *allocate(int dims, const int *sizes, int type, void *data, size_t *step, AccessFlags flags, cv::UMatUsageFlags usageFlags) const final {
+            return cv::Mat::getStdAllocator()->allocate(dims, sizes, type, data, step, flags, usageFlags);
+        }
+
+        bool allocate(cv::UMatData *data, AccessFlags accessFlags, cv::UMatUsageFlags usageFlags) const final {
+            return cv::Mat::getStdAllocator()->allocate(data, accessFlags, usageFlags);
+        }
+    };
+
+    Pool *pool;
 
 public:
+    /**
+     * @param capacityIncrease Slots allocated at a time
+     * @param maxCapacity Maximum number of slots for each frame shape
+     */
     FrameBuffer(
         std::size_t capacityIncrease = DEFAULT_CAPACITY_INCREASE,
         std::size_t maxCapacity = DEFAULT_CAPACITY_INCREASE * 5)
     :
-        capacityIncrease(capacityIncrease),
-        maxCapacity(maxCapacity) {}
+        pool(new Pool(capacityIncrease, maxCapacity)) {}
+
+    FrameBuffer(const FrameBuffer&) = delete;
+    FrameBuffer &operator=(const FrameBuffer&) = delete;
+
+    ~FrameBuffer() {
+        // Slots still in use are freed when released.
+        pool->closed = true;
+        pool->freeUnused();
+        pool->release();
+    }
 
     /**
      * Return a uniq pointer to an free slot. If FrameBuffer is full, pointer is empty.
     */
     std::unique_ptr<cv::Mat> next(int rows, int cols, int type) {
-        if (buf.empty()) increaseCapacity(rows, cols, type);
-        for (std::size_t failures = 0; failures < buf.size(); failures++) {
-            auto &m = buf[(counter = (counter + 1) % buf.size())];
-            assert(m.u && "u missing");
-            // NOTE: this is not part of the OpenCV public API so use with care
-            // This version should be thread-safe
-            const auto refcount = CV_XADD(&m.u->refcount, 0);
-            assert(refcount >= 1);
-            if (refcount == 1) {
-                return std::make_unique<cv::Mat>(m);
-            }
-        }
-        if (increaseCapacity(rows, cols, type)) {
-            return next(rows, cols, type);
-        } else {
-            return std::unique_ptr<cv::Mat>(nullptr);
+        return pool->next(rows, cols, type);
+    }
+
+    /** Occupancy of the pool of each frame shape seen so far */
+    std::vector<Stats> stats() const {
+        std::vector<Stats> result;
+        for (std::size_t i = 0; i < pool->classCount.load(); ++i) {
+            const SizeClass &c = *pool->classes[i];
+            result.push_back({
+                c.rows, c.cols, c.type,
+                c.allocated.load(),
+                c.inUse.load(),
+                c.highWater.load(),
+                c.failures.load()
+            });
         }
+        return result;
     }
 };
 
@@ -37,6 +37,12 @@ struct Processor {
     virtual ~Processor();
     virtual Future enqueue(const std::function<void()> &op) = 0;
 
+    // Fire-and-forget version of enqueue: no completion state is allocated
+    virtual void post(const std::function<void()> &op) = 0;
+
+    // Resolves once all operations enqueued or posted before it have finished
+    virtual Future barrier() = 0;
+
     static std::unique_ptr<Processor> createInstant();
     static std::unique_ptr<Processor> createThreadPool(int nThreads);
     static std::unique_ptr<Queue> createQueue();
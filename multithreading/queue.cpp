@@ -1,4 +1,6 @@
+#include <algorithm>
 #include <condition_variable>
+#include <cstdint>
 #include <deque>
 #include <mutex>
 #include <thread>
@@ -17,16 +19,47 @@ struct BlockingQueue : Queue {
 class QueueImplementation : public BlockingQueue {
 private:
     struct Task {
-        std::unique_ptr<Promise> promise;
+        std::unique_ptr<Promise> promise; // empty if posted
         std::function<void()> func;
+        std::uint64_t seq;
+    };
+
+    struct Barrier {
+        std::unique_ptr<Promise> promise;
+        std::uint64_t seq; // resolves when all tasks before this are done
     };
 
     std::deque< Task > tasks;
+    std::vector< std::uint64_t > running;
+    std::deque< Barrier > barriers;
+    std::uint64_t nextSeq = 0;
     std::mutex mutex;
     std::condition_variable emptyCondition, subscribeCondition;
     bool shouldQuit = false;
     int nSubscribed = 0;
 
+    // Sequence number of the oldest task that has not finished yet
+    std::uint64_t oldestUnfinished() const {
+        std::uint64_t seq = tasks.empty() ? nextSeq : tasks.front().seq;
+        for (auto s : running) seq = std::min(seq, s);
+        return seq;
+    }
+
+    void resolveBarriers() {
+        const auto oldest = oldestUnfinished();
+        while (!barriers.empty() && barriers.front().seq <= oldest) {
+            barriers.front().promise->resolve();
+            barriers.pop_front();
+        }
+    }
+
+    void push(Task &&task) {
+        std::lock_guard<std::mutex> lock(mutex);
+        task.seq = nextSeq++;
+        tasks.emplace_back(std::move(task));
+        emptyCondition.notify_one();
+    }
+
     bool process(bool many, bool waitForData) {
         bool any = false;
         std::unique_lock<std::mutex> lock(mutex);
@@ -41,13 +74,16 @@ private:
             }
             auto task = std::move(tasks.front());
             tasks.pop_front();
+            running.push_back(task.seq);
             lock.unlock();
 
             task.func();
-            task.promise->resolve();
+            if (task.promise) task.promise->resolve();
             any = true;
 
             lock.lock();
+            running.erase(std::find(running.begin(), running.end(), task.seq));
+            resolveBarriers();
         } while (many);
 
         nSubscribed--;
@@ -71,12 +107,24 @@ public:
         task.promise = Promise::create();
         auto future = task.promise->getFuture();
         task.func = op;
+        push(std::move(task));
+        return future;
+    }
 
-        {
-            std::lock_guard<std::mutex> lock(mutex);
-            tasks.emplace_back(std::move(task));
-            emptyCondition.notify_one();
-        }
+    void post(const std::function<void()> &op) final {
+        Task task;
+        task.func = op;
+        push(std::move(task));
+    }
+
+    Future barrier() final {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (oldestUnfinished() == nextSeq) return Future::instantlyResolved();
+        Barrier b;
+        b.promise = Promise::create();
+        b.seq = nextSeq;
+        auto future = b.promise->getFuture();
+        barriers.emplace_back(std::move(b));
         return future;
     }
 
@@ -120,6 +168,14 @@ public:
     Future enqueue(const std::function<void()> &op) final {
         return queue->enqueue(op);
     }
+
+    void post(const std::function<void()> &op) final {
+        queue->post(op);
+    }
+
+    Future barrier() final {
+        return queue->barrier();
+    }
 };
 
 struct InstantProcessor : Processor {
@@ -127,6 +183,14 @@ struct InstantProcessor : Processor {
         op();
         return Future::instantlyResolved();
     }
+
+    void post(const std::function<void()> &op) final {
+        op();
+    }
+
+    Future barrier() final {
+        return Future::instantlyResolved();
+    }
 };
 }
 
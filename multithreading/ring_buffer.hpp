@@ -0,0 +1,172 @@
+#ifndef RECORDER_RING_BUFFER
+#define RECORDER_RING_BUFFER
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace recorder {
+/**
+ * Bounded lock-free multi-producer multi-consumer queue (D. Vyukov's
+ * algorithm). All memory is allocated in the constructor, so push() and pop()
+ * never allocate or block: a full buffer makes push() fail instead.
+ *
+ * T should be cheap to copy, e.g., a POD record.
+ */
+template <class T> class RingBuffer {
+private:
+    struct Cell {
+        std::atomic<std::size_t> sequence;
+        T data;
+    };
+
+    static std::size_t roundUpToPowerOfTwo(std::size_t n) {
+        std::size_t p = 2;
+        while (p < n) p *= 2;
+        return p;
+    }
+
+    const std::size_t mask;
+    const std::unique_ptr<Cell[]> buf;
+    // Keep the producer and consumer positions on separate cache lines.
+    char pad0[64];
+    std::atomic<std::size_t> enqueuePos;
+    char pad1[64];
+    std::atomic<std::size_t> dequeuePos;
+    char pad2[64];
+
+public:
+    /** @param capacity Rounded up to a power of two */
+    RingBuffer(std::size_t capacity) :
+        mask(roundUpToPowerOfTwo(capacity) - 1),
+        buf(new Cell[mask + 1]),
+        enqueuePos(0),
+        dequeuePos(0)
+    {
+        for (std::size_t i = 0; i <= mask; ++i) {
+            buf[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    /** Returns false if the buffer is full */
+    bool push(const T &value) {
+        Cell *cell;
+        std::size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        for (;;) {
+            cell = &buf[pos & mask];
+            const std::size_t seq = cell->sequence.load(std::memory_order_acquire);
+            const std::intptr_t dif = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+            if (dif == 0) {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        cell->data = value;
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Push up to n elements with a single reservation, constructing them in
+     * place with fill(i, element). Returns the number of elements pushed,
+     * which is less than n if the buffer does not have room for all of them.
+     */
+    template <class Fill> std::size_t pushMany(std::size_t n, const Fill &fill) {
+        std::size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        std::size_t count;
+        for (;;) {
+            // Count free cells starting from pos. They cannot be taken by
+            // anyone else without moving enqueuePos, which the CAS checks.
+            bool stale = false;
+            for (count = 0; count < n; ++count) {
+                const std::size_t seq = buf[(pos + count) & mask].sequence.load(std::memory_order_acquire);
+                const std::intptr_t dif = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos + count);
+                if (dif < 0) break;
+                if (dif > 0) {
+                    stale = true;
+                    break;
+                }
+            }
+            if (stale) {
+                pos = enqueuePos.load(std::memory_order_relaxed);
+                continue;
+            }
+            if (count == 0) return 0;
+            if (enqueuePos.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed)) break;
+        }
+        for (std::size_t i = 0; i < count; ++i) {
+            Cell &cell = buf[(pos + i) & mask];
+            fill(i, cell.data);
+            cell.sequence.store(pos + i + 1, std::memory_order_release);
+        }
+        return count;
+    }
+
+    /** Returns false if the buffer is empty */
+    bool pop(T &value) {
+        Cell *cell;
+        std::size_t pos = dequeuePos.load(std::memory_order_relaxed);
+        for (;;) {
+            cell = &buf[pos & mask];
+            const std::size_t seq = cell->sequence.load(std::memory_order_acquire);
+            const std::intptr_t dif = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos + 1);
+            if (dif == 0) {
+                if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+        value = cell->data;
+        cell->sequence.store(pos + mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Pop the oldest element only if pred(element) is true. Returns false if
+     * the buffer is empty or pred is false. The element is examined before
+     * it is taken, so no other thread may push at the same time, e.g., the
+     * caller is the only producer.
+     */
+    template <class Pred> bool popIf(T &value, const Pred &pred) {
+        Cell *cell;
+        std::size_t pos = dequeuePos.load(std::memory_order_relaxed);
+        for (;;) {
+            cell = &buf[pos & mask];
+            const std::size_t seq = cell->sequence.load(std::memory_order_acquire);
+            const std::intptr_t dif = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos + 1);
+            if (dif == 0) {
+                if (!pred(static_cast<const T&>(cell->data))) return false;
+                if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+        value = cell->data;
+        cell->sequence.store(pos + mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    /** Approximate number of queued elements */
+    std::size_t size() const {
+        const std::size_t d = dequeuePos.load(std::memory_order_relaxed);
+        const std::size_t e = enqueuePos.load(std::memory_order_relaxed);
+        return e > d ? e - d : 0;
+    }
+
+    std::size_t capacity() const {
+        return mask + 1;
+    }
+};
+
+} // namespace recorder
+
+#endif
@@ -0,0 +1,168 @@
+#ifndef RECORDER_STAGING_QUEUE
+#define RECORDER_STAGING_QUEUE
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "ring_buffer.hpp"
+
+namespace recorder {
+/**
+ * Bounded multi-producer single-consumer queue made of a RingBuffer per
+ * producer thread, so that producers never touch each other's cache lines.
+ * Up to MAX_PRODUCERS threads get their own buffer, any further ones share
+ * one more.
+ *
+ * The consumer merges the buffers in the order of a key, e.g., the time an
+ * element was pushed, which each producer must push in non-decreasing order.
+ * An element pushed before another one in the happens-before sense, e.g.,
+ * before a flush request on another thread, is popped first.
+ *
+ * A producer may also pop the oldest elements of its own buffer, and
+ * examine them first unless the buffer is shared().
+ */
+template <class T> class StagingQueue {
+public:
+    static constexpr std::size_t MAX_PRODUCERS = 8;
+
+private:
+    // Elements the consumer takes from a buffer at a time
+    static constexpr std::size_t BATCH = 64;
+
+    struct Slot {
+        std::thread::id owner;
+        std::unique_ptr<RingBuffer<T> > buffer;
+    };
+
+    // Elements taken from a buffer but not yet popped, consumer only
+    struct Pending {
+        std::array<T, BATCH> items;
+        std::size_t begin = 0, end = 0;
+    };
+
+    const std::size_t bufferCapacity;
+    const std::uint64_t id;
+    // The buffers of the first slotCount slots are set and never change.
+    std::array<Slot, MAX_PRODUCERS + 1> slots;
+    std::atomic<std::size_t> slotCount{0};
+    std::mutex slotMutex;
+    std::unique_ptr<Pending[]> pending;
+
+    static std::uint64_t nextId() {
+        static std::atomic<std::uint64_t> counter{0};
+        return ++counter;
+    }
+
+    RingBuffer<T> &registerThread() {
+        const std::thread::id self = std::this_thread::get_id();
+        std::lock_guard<std::mutex> lock(slotMutex);
+        const std::size_t n = slotCount.load();
+        for (std::size_t i = 0; i < n; ++i) {
+            if (slots[i].owner == self) return *slots[i].buffer;
+        }
+        // The last slot is shared by the threads after MAX_PRODUCERS.
+        if (n == MAX_PRODUCERS + 1) return *slots[MAX_PRODUCERS].buffer;
+        slots[n].owner = self;
+        slots[n].buffer.reset(new RingBuffer<T>(bufferCapacity));
+        slotCount.store(n + 1, std::memory_order_release);
+        return *slots[n].buffer;
+    }
+
+public:
+    /** @param capacity Of each buffer, rounded up to a power of two */
+    StagingQueue(std::size_t capacity) :
+        bufferCapacity(capacity),
+        id(nextId()),
+        pending(new Pending[MAX_PRODUCERS + 1])
+    {}
+
+    StagingQueue(const StagingQueue&) = delete;
+    StagingQueue &operator=(const StagingQueue&) = delete;
+
+    /** The buffer of the calling thread, created on first use */
+    RingBuffer<T> &local() {
+        // The buffers of the queues this thread pushed to last
+        struct Cached {
+            std::uint64_t queue = 0;
+            RingBuffer<T> *buffer = nullptr;
+        };
+        static constexpr std::size_t CACHE_SIZE = 4;
+        thread_local std::array<Cached, CACHE_SIZE> cache;
+        thread_local std::size_t nextEntry = 0;
+        for (const Cached &c : cache) {
+            if (c.queue == id) return *c.buffer;
+        }
+        RingBuffer<T> &buffer = registerThread();
+        cache[nextEntry] = Cached { id, &buffer };
+        nextEntry = (nextEntry + 1) % CACHE_SIZE;
+        return buffer;
+    }
+
+    /** True for the buffer of the threads after MAX_PRODUCERS */
+    bool shared(const RingBuffer<T> &buffer) const {
+        return slotCount.load(std::memory_order_acquire) == MAX_PRODUCERS + 1
+            && &buffer == slots[MAX_PRODUCERS].buffer.get();
+    }
+
+    /**
+     * Pop the element with the smallest key(element) among the oldest ones
+     * of each buffer. Consumer only. Returns false if all buffers are empty.
+     */
+    template <class Key> bool pop(T &value, const Key &key) {
+        // Refill the empty batches until a pass finds nothing new, so that
+        // every buffer has been checked after the candidates were taken.
+        bool anyEmpty;
+        bool taken;
+        std::size_t n;
+        do {
+            anyEmpty = false;
+            taken = false;
+            n = slotCount.load(std::memory_order_acquire);
+            for (std::size_t i = 0; i < n; ++i) {
+                Pending &p = pending[i];
+                if (p.begin != p.end) continue;
+                p.begin = p.end = 0;
+                while (p.end < BATCH && slots[i].buffer->pop(p.items[p.end])) p.end++;
+                if (p.end > 0) {
+                    taken = true;
+                } else {
+                    anyEmpty = true;
+                }
+            }
+        } while (taken && anyEmpty);
+
+        Pending *first = nullptr;
+        for (std::size_t i = 0; i < n; ++i) {
+            Pending &p = pending[i];
+            if (p.begin == p.end) continue;
+            if (!first || key(p.items[p.begin]) < key(first->items[first->begin])) first = &p;
+        }
+        if (!first) return false;
+        value = first->items[first->begin++];
+        return true;
+    }
+
+    /** Approximate number of elements in the buffers, not counting those the consumer has taken */
+    std::size_t size() const {
+        std::size_t total = 0;
+        const std::size_t n = slotCount.load(std::memory_order_acquire);
+        for (std::size_t i = 0; i < n; ++i) total += slots[i].buffer->size();
+        return total;
+    }
+
+    /** Of each buffer */
+    std::size_t capacity() const {
+        std::size_t c = 2;
+        while (c < bufferCapacity) c *= 2;
+        return c;
+    }
+};
+
+} // namespace recorder
+
+#endif
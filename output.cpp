@@ -0,0 +1,124 @@
+#include "output.hpp"
+
+namespace recorder {
+namespace {
+class StreamSink : public OutputSink {
+private:
+    std::unique_ptr<std::ostream> owned;
+    std::ostream &output;
+
+public:
+    StreamSink(std::ostream &output) : output(output) {}
+    StreamSink(std::unique_ptr<std::ostream> output) : owned(std::move(output)), output(*owned) {}
+
+    void write(std::vector<char> &block) final {
+        output.write(block.data(), block.size());
+        output.flush();
+        block.clear();
+    }
+
+    void flush() final {
+        output.flush();
+    }
+};
+} // anonymous namespace
+
+OutputSink::~OutputSink() = default;
+
+std::size_t OutputSink::pendingBytes() const {
+    return 0;
+}
+
+void OutputSink::sync() {}
+
+std::unique_ptr<OutputSink> OutputSink::build(std::ostream &output) {
+    return std::unique_ptr<OutputSink>(new StreamSink(output));
+}
+
+std::unique_ptr<OutputSink> OutputSink::build(std::unique_ptr<std::ostream> output) {
+    return std::unique_ptr<OutputSink>(new StreamSink(std::move(output)));
+}
+
+OutputBuffer::OutputBuffer(std::unique_ptr<OutputSink> sink, const FlushPolicy &policy) :
+    sink(std::move(sink)),
+    policy(policy),
+    unflushed(0),
+    lastSync(std::chrono::steady_clock::now())
+{
+    buf.reserve(policy.maxBytes);
+}
+
+OutputBuffer::~OutputBuffer() {
+    flush();
+}
+
+void OutputBuffer::write(const char *data, std::size_t n) {
+    if (buf.empty()) oldestUnflushed = std::chrono::steady_clock::now();
+    buf.insert(buf.end(), data, data + n);
+    commit();
+}
+
+void OutputBuffer::commit() {
+    unflushed.store(buf.size(), std::memory_order_relaxed);
+    if (buf.size() >= policy.maxBytes) {
+        writeBlock();
+    } else {
+        poll();
+    }
+}
+
+void OutputBuffer::poll() {
+    const bool flushing = !buf.empty() && policy.maxDelaySeconds > 0.0;
+    const bool syncing = policy.syncIntervalSeconds > 0.0;
+    if (!flushing && !(syncing && unsynced)) return;
+    const auto now = std::chrono::steady_clock::now();
+    if (flushing) {
+        const std::chrono::duration<double> age = now - oldestUnflushed;
+        if (age.count() >= policy.maxDelaySeconds) writeBlock();
+    }
+    if (syncing && unsynced) {
+        const std::chrono::duration<double> age = now - lastSync;
+        if (age.count() >= policy.syncIntervalSeconds) {
+            sink->sync();
+            syncs++;
+            unsynced = false;
+            lastSync = now;
+        }
+    }
+}
+
+void OutputBuffer::writeBlock() {
+    if (!buf.empty()) {
+        sink->write(buf);
+        blocks++;
+        unsynced = true;
+    }
+    unflushed.store(0, std::memory_order_relaxed);
+}
+
+void OutputBuffer::flush() {
+    writeBlock();
+    if (policy.syncIntervalSeconds > 0.0 && unsynced) {
+        sink->sync();
+        syncs++;
+        unsynced = false;
+        lastSync = std::chrono::steady_clock::now();
+    }
+    sink->flush();
+}
+
+std::unique_ptr<OutputSink> OutputBuffer::replaceSink(std::unique_ptr<OutputSink> next) {
+    writeBlock();
+    // The new sink has nothing to sync yet.
+    unsynced = false;
+    std::lock_guard<std::mutex> lock(sinkMutex);
+    sink.swap(next);
+    return next;
+}
+
+std::size_t OutputBuffer::unflushedBytes() const {
+    std::lock_guard<std::mutex> lock(sinkMutex);
+    return unflushed.load(std::memory_order_relaxed) + sink->pendingBytes();
+}
+
+} // namespace recorder
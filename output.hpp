@@ -0,0 +1,124 @@
+// private header file
+#ifndef JSONL_RECORDER_OUTPUT_HPP
+#define JSONL_RECORDER_OUTPUT_HPP
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "recorder.hpp"
+
+namespace recorder {
+/**
+ * Destination of the blocks written by OutputBuffer. Used from one thread
+ * at a time, except for pendingBytes().
+ */
+struct OutputSink {
+    virtual ~OutputSink();
+
+    /**
+     * Consume the contents of block and leave it empty, possibly with a
+     * different capacity. The data should reach the OS eventually even
+     * without calling flush().
+     */
+    virtual void write(std::vector<char> &block) = 0;
+
+    /** Block until everything written so far has reached the OS */
+    virtual void flush() = 0;
+
+    /**
+     * Start syncing everything written so far to the storage device
+     * without waiting for it, flush() waits. Does nothing by default.
+     */
+    virtual void sync();
+
+    /** Bytes accepted by write() but not yet written out */
+    virtual std::size_t pendingBytes() const;
+
+    static std::unique_ptr<OutputSink> build(std::ostream &output);
+    /** Like build(std::ostream&), but owns the stream and closes it when destroyed */
+    static std::unique_ptr<OutputSink> build(std::unique_ptr<std::ostream> output);
+
+    /**
+     * Write the blocks to a new file asynchronously, a few at a time, with
+     * io_uring where available and otherwise on a worker thread, see
+     * FileBackend::ASYNC. Defined in file_output.cpp.
+     *
+     * @param directIO Bypass the page cache with O_DIRECT, if the file system supports it
+     * @param durable Sync the directory entry of the new file, for sync() to be of use
+     * @return nullptr if the file cannot be opened
+     */
+    static std::unique_ptr<OutputSink> buildFile(const std::string &path, bool directIO, bool durable = false);
+
+    /**
+     * Compress each block into an independent gzip member on a worker
+     * thread and pass the results to sink in order. Defined in compression.cpp.
+     */
+    static std::unique_ptr<OutputSink> buildCompressing(std::unique_ptr<OutputSink> sink, int level);
+};
+
+/**
+ * Group-commit buffer between the JSONL serializer and the output sink.
+ * Serialized lines are collected in memory and handed to the sink as one
+ * block when the FlushPolicy says so, instead of flushing every record.
+ *
+ * Not thread safe, except for unflushedBytes(): use from the writer thread only.
+ */
+class OutputBuffer {
+private:
+    std::unique_ptr<OutputSink> sink;
+    // Held by unflushedBytes() and when replacing the sink
+    mutable std::mutex sinkMutex;
+    const FlushPolicy policy;
+    std::vector<char> buf;
+    std::chrono::steady_clock::time_point oldestUnflushed;
+    std::atomic<std::size_t> unflushed;
+    // Whether blocks were written since the last sync
+    bool unsynced = false;
+    std::chrono::steady_clock::time_point lastSync;
+    std::uint64_t blocks = 0;
+    std::uint64_t syncs = 0;
+
+    void commit();
+    void writeBlock();
+
+public:
+    OutputBuffer(std::unique_ptr<OutputSink> sink, const FlushPolicy &policy);
+    ~OutputBuffer();
+
+    /** Should contain whole lines, so that a block never splits one */
+    void write(const char *data, std::size_t n);
+
+    /**
+     * Hand buffered data to the sink if it is older than the policy allows,
+     * and start syncing the sink if it is due
+     */
+    void poll();
+    /**
+     * Hand buffered data to the sink and wait until it has been written,
+     * and synced if the policy says so
+     */
+    void flush();
+
+    /** Blocks handed to the sinks so far */
+    std::uint64_t blockCount() const { return blocks; }
+    /** Syncs started so far */
+    std::uint64_t syncCount() const { return syncs; }
+
+    /**
+     * Hand buffered data to the current sink and continue with next. The
+     * returned sink has not been flushed, so that it can be done on another
+     * thread.
+     */
+    std::unique_ptr<OutputSink> replaceSink(std::unique_ptr<OutputSink> next);
+
+    std::size_t unflushedBytes() const;
+};
+} // namespace recorder
+
+#endif
@@ -0,0 +1,172 @@
+// private header file
+#ifndef JSONL_RECORDER_RECORD_HPP
+#define JSONL_RECORDER_RECORD_HPP
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "multithreading/allocator.hpp"
+#include "recorder.hpp"
+#include "types.hpp"
+
+namespace recorder {
+struct Promise;
+
+constexpr std::size_t STREAM_COUNT = static_cast<std::size_t>(Stream::JSON) + 1;
+
+/**
+ * Pools of the variable size payloads of records. After a warm-up, records
+ * reuse the buffers of earlier ones instead of allocating.
+ */
+struct RecordPayloads {
+    Allocator<std::vector<FrameData> > frameGroups;
+    /** Serialized JSON of JSON and JSON_STRING records */
+    Allocator<std::string> strings;
+
+    /** @param capacity Payloads of each kind kept in the pools */
+    RecordPayloads(std::size_t capacity) :
+        frameGroups(0, PAYLOAD_CAPACITY_INCREASE, capacity),
+        strings(0, PAYLOAD_CAPACITY_INCREASE, capacity)
+    {}
+
+private:
+    static constexpr std::size_t PAYLOAD_CAPACITY_INCREASE = 64;
+};
+
+/**
+ * Fixed-size tagged record passed from the producer threads to the JSONL
+ * writer thread. Trivially copyable so it can live in a RingBuffer. Variable
+ * size payloads come from RecordPayloads, and are owned by the record:
+ * whoever consumes (or drops) it must call release().
+ */
+struct Record {
+    enum class Type {
+        GYROSCOPE,
+        ACCELEROMETER,
+        GPS,
+        ARKIT,
+        GROUND_TRUTH,
+        ODOMETRY_OUTPUT,
+        FRAME,
+        FRAME_GROUP,
+        FRAME_DROP,
+        JSON,
+        JSON_STRING,
+        // Not a record: resolves the promise once everything before it is
+        // written and flushed, after finishing the output if close is set
+        FLUSH
+    };
+
+    struct PoseAndVelocity {
+        Pose pose;
+        Vector3d velocity;
+    };
+
+    struct FrameGroup {
+        double t;
+        std::vector<FrameData> *frames;
+    };
+
+    struct Flush {
+        Promise *promise;
+        bool close;
+    };
+
+    struct Json {
+        // NaN if not known, as for JSON_STRING that is parsed by the writer
+        double t;
+        std::string *text;
+    };
+
+    Type type;
+    // Video segment of FRAME and FRAME_GROUP records with segmented output
+    int segment = 0;
+    // When the record was queued, for RecorderStats::queueLatency
+    std::chrono::steady_clock::time_point queued;
+    union {
+        GyroscopeData gyroscope;
+        AccelerometerData accelerometer;
+        GpsData gps;
+        PoseAndVelocity pose;
+        FrameData frame;
+        FrameGroup frameGroup;
+        double time;
+        Json json;
+        Flush flush;
+    };
+
+    Record() : type(Type::FLUSH), flush{ nullptr, false } {}
+
+    /** Not meaningful for FLUSH */
+    Stream stream() const {
+        switch (type) {
+            case Type::GYROSCOPE: return Stream::GYROSCOPE;
+            case Type::ACCELEROMETER: return Stream::ACCELEROMETER;
+            case Type::GPS: return Stream::GPS;
+            case Type::ARKIT: return Stream::ARKIT;
+            case Type::GROUND_TRUTH: return Stream::GROUND_TRUTH;
+            case Type::ODOMETRY_OUTPUT: return Stream::ODOMETRY_OUTPUT;
+            case Type::FRAME:
+            case Type::FRAME_GROUP:
+            case Type::FRAME_DROP: return Stream::FRAMES;
+            default: return Stream::JSON;
+        }
+    }
+
+    /** Record time, NaN if not known without parsing */
+    double timestamp() const {
+        switch (type) {
+            case Type::GYROSCOPE: return gyroscope.t;
+            case Type::ACCELEROMETER: return accelerometer.t;
+            case Type::GPS: return gps.t;
+            case Type::ARKIT:
+            case Type::GROUND_TRUTH:
+            case Type::ODOMETRY_OUTPUT: return pose.pose.time;
+            case Type::FRAME: return frame.t;
+            case Type::FRAME_GROUP: return frameGroup.t;
+            case Type::FRAME_DROP: return time;
+            case Type::JSON: return json.t;
+            default: return NAN;
+        }
+    }
+
+    /** Return the payload, if any, to the pools it came from */
+    void release(RecordPayloads &payloads) {
+        switch (type) {
+            case Type::FRAME_GROUP: payloads.frameGroups.release(frameGroup.frames); break;
+            case Type::JSON:
+            case Type::JSON_STRING: payloads.strings.release(json.text); break;
+            default: break;
+        }
+    }
+};
+
+/**
+ * Consumer of the records that end up in a recording, in one call per
+ * record. Implemented by the output format encoders, and by readers of the
+ * binary format.
+ */
+struct RecordHandler {
+    virtual ~RecordHandler() = default;
+    virtual void gyroscope(const GyroscopeData &d) = 0;
+    virtual void accelerometer(const AccelerometerData &d) = 0;
+    virtual void gps(const GpsData &d) = 0;
+    /** Position only, orientation is not recorded */
+    virtual void arkit(const Pose &pose) = 0;
+    /** Position only, orientation is not recorded */
+    virtual void groundTruth(const Pose &pose) = 0;
+    virtual void odometryOutput(const Pose &pose, const Vector3d &velocity) = 0;
+    /**
+     * @param frameNumbers Per-camera frame number of each of the n frames
+     */
+    virtual void frameGroup(double t, int groupNumber, const FrameData *frames, const int *frameNumbers, std::size_t n) = 0;
+    virtual void frameDrop(double t) = 0;
+    virtual void recordDrop(Stream stream, std::size_t count, double t) = 0;
+    /** Arbitrary JSON object serialized on a single line, without a newline */
+    virtual void json(const char *data, std::size_t n) = 0;
+};
+} // namespace recorder
+
+#endif
@@ -1,7 +1,24 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <cstdio>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
 #include "recorder.hpp"
+#include "output.hpp"
+#include "binary_format.hpp"
+#include "record.hpp"
+#include "serializer.hpp"
+#include "time_index.hpp"
 #include "video.hpp"
 #include "multithreading/future.hpp"
+#include "multithreading/staging_queue.hpp"
 
 #ifdef USE_OPENCV_VIDEO_RECORDING
 #include "multithreading/framebuffer.hpp"
@@ -14,143 +31,1078 @@ namespace {
 using namespace recorder;
 using json = nlohmann::json;
 
+const std::chrono::milliseconds JSONL_DRAIN_INTERVAL(10);
+// Dropped records are logged at most this often, with the totals since
+const std::chrono::seconds DROP_LOG_INTERVAL(1);
+
+typedef std::chrono::steady_clock Clock;
+
+double seconds(Clock::duration d) {
+    return std::chrono::duration<double>(d).count();
+}
+
+// Order in which the JSONL thread merges the records of different threads
+Clock::time_point queuedTime(const Record &r) {
+    return r.queued;
+}
+
+json histogramJson(const LatencyHistogram &h) {
+    return {
+        { "count", h.count },
+        { "max", h.maxSeconds },
+        { "mean", h.meanSeconds() },
+        { "p50", h.quantileSeconds(0.5) },
+        { "p99", h.quantileSeconds(0.99) }
+    };
+}
+
+json histogramsJson(const std::map<Stream, LatencyHistogram> &histograms) {
+    json j = json::object();
+    for (const auto &p : histograms) j[streamName(p.first)] = histogramJson(p.second);
+    return j;
+}
+
+// Contents of the {"recorderStats":{...}} record, latencies in seconds
+json statsJson(const RecorderStats &s) {
+    json framePools = json::array();
+    for (const auto &p : s.framePools) {
+        framePools.push_back({
+            { "capacity", p.capacity },
+            { "cols", p.cols },
+            { "failures", p.failures },
+            { "highWater", p.highWater },
+            { "inUse", p.inUse },
+            { "rows", p.rows },
+            { "type", p.type }
+        });
+    }
+    json lateRecords = json::object();
+    for (const auto &p : s.lateRecords) lateRecords[streamName(p.first)] = p.second;
+    json video = json::object();
+    for (const auto &p : s.video) {
+        video[std::to_string(p.first)] = {
+            { "fps", p.second.fps },
+            { "frames", p.second.frames },
+            { "latency", histogramJson(p.second.latency) },
+            { "pending", p.second.pending }
+        };
+    }
+    return {
+        { "blocks", s.blocks },
+        { "bytes", s.bytes },
+        { "droppedFrames", {
+            { "framePoolFull", s.droppedFrames.framePoolFull },
+            { "imagesPending", s.droppedFrames.imagesPending }
+        }},
+        { "flushes", s.flushes },
+        { "framePools", framePools },
+        { "lateRecords", lateRecords },
+        { "outputTime", histogramJson(s.outputTime) },
+        { "pendingImages", s.pendingImages },
+        { "queue", {
+            { "capacity", s.queueCapacity },
+            { "depth", s.queueDepth },
+            { "highWater", s.queueHighWater }
+        }},
+        { "queueLatency", histogramsJson(s.queueLatency) },
+        { "records", s.records },
+        { "serializationTime", histogramsJson(s.serializationTime) },
+        { "syncs", s.syncs },
+        { "unflushedBytes", s.unflushedBytes },
+        { "video", video }
+    };
+}
+
+std::ios::openmode fileMode(const Settings &settings) {
+    if (settings.format == Format::BINARY || settings.compression != Compression::NONE) {
+        return std::ios::out | std::ios::binary;
+    }
+    return std::ios::out;
+}
+
+bool isSegmented(const Settings &settings) {
+    return settings.segmentPolicy.maxBytes > 0 || settings.segmentPolicy.maxDurationSeconds > 0.0;
+}
+
+bool reorders(const Settings &settings) {
+    return settings.reorderWindow.maxSpanSeconds > 0.0 || settings.reorderWindow.maxRecords > 0;
+}
+
+bool isDurable(const Settings &settings) {
+    return settings.flushPolicy.syncIntervalSeconds > 0.0;
+}
+
+// Whether the constructor opens fileOutput, or init() an output sink
+bool opensStream(const Settings &settings) {
+    return !isSegmented(settings) && !isDurable(settings) && settings.fileBackend == FileBackend::STREAM;
+}
+
+/** @return nullptr if the file cannot be opened */
+std::unique_ptr<OutputSink> openFile(const std::string &path, const Settings &settings) {
+    // Syncing needs the file descriptor.
+    if (settings.fileBackend == FileBackend::ASYNC || isDurable(settings)) {
+        return OutputSink::buildFile(path, settings.directIO, isDurable(settings));
+    }
+    std::unique_ptr<std::ofstream> file(new std::ofstream(path, fileMode(settings)));
+    if (!file->is_open()) return nullptr;
+    return OutputSink::build(std::move(file));
+}
+
 struct RecorderImplementation : public Recorder {
     std::ofstream fileOutput;
     std::ostream &output;
+    std::string outputPath;
+    Settings settings;
     std::string videoOutputPrefix;
     int frameNumberGroup = 0;
     std::map<int, int> frameNumbers = {};
     std::map<int, std::unique_ptr<VideoWriter> > videoWriters;
     std::map<int, std::unique_ptr<Processor> > videoProcessors;
+    std::map<int, std::size_t> videoFramesPosted;
     float fps = 30;
-    std::unique_ptr<Processor> jsonlProcessor;
+    int videoEncoderThreads = 1;
+    std::unique_ptr<OutputBuffer> out;
+
+    // Producers push records without locking or allocating, each thread to
+    // its own buffer; the JSONL thread wakes up every JSONL_DRAIN_INTERVAL (or
+    // earlier if a buffer fills up) and writes everything queued, merged in
+    // the order the records were queued.
+    std::unique_ptr<StagingQueue<Record> > records;
+    std::unique_ptr<RecordPayloads> payloads;
+    unsigned decimationFactor = 2;
+    // NaN until a record with a time has been written
+    double lastWrittenTime = NAN;
+
+    struct StreamState {
+        OverflowPolicy policy = OverflowPolicy::BLOCK;
+        std::atomic<unsigned> decimationCounter{0};
+        std::atomic<std::size_t> dropped{0};
+        std::atomic<double> lastDropTime{NAN};
+        std::size_t reportedDropped = 0; // JSONL thread only
+        std::size_t unloggedDropped = 0; // JSONL thread only
+        // Of unloggedDropped, those older than Settings::reorderWindow
+        std::size_t unloggedLate = 0; // JSONL thread only
+    };
+    std::array<StreamState, STREAM_COUNT> streams;
+    std::thread jsonlThread;
+    std::mutex wakeMutex;
+    std::condition_variable wakeCondition;
+    std::atomic<bool> writerSleeping{false};
+    std::atomic<bool> shouldQuit{false};
 
     #ifdef USE_OPENCV_VIDEO_RECORDING
     std::unique_ptr<recorder::FrameBuffer> frameStore;
     std::vector<cv::Mat> allocatedFrames;
+    // Caller-owned images of addFrame(f, ImageBuffer) not yet encoded,
+    // limited like the frames of frameStore
+    std::atomic<std::size_t> imageBuffersPending{0};
     #endif
 
 
-    // Preallocate.
-    struct Workspace {
-        json jGyroscope = R"({
-            "time": 0.0,
-            "sensor": {
-                "type": "gyroscope",
-                "values": [0.0, 0.0, 0.0],
-                "temperature": 0.0
-            }
-        })"_json;
-        json jAccelerometer = R"({
-            "time": 0.0,
-            "sensor": {
-                "type": "accelerometer",
-                "values": [0.0, 0.0, 0.0],
-                "temperature": 0.0
-            }
-        })"_json;
-        json jGps = R"({
-            "time": 0.0,
-            "gps": {
-                "latitude": 0.0,
-                "longitude": 0.0,
-                "accuracy": 0.0,
-                "altitude": 0.0
-            }
-        })"_json;
-        json jOutput = R"({
-            "time": 0.0,
-            "output": {
-                "position": { "x": 0.0, "y": 0.0, "z": 0.0 },
-                "orientation": { "w": 0.0, "x": 0.0, "y": 0.0, "z": 0.0 },
-                "velocity": { "x": 0.0, "y": 0.0, "z": 0.0 }
-            }
-        })"_json;
-        json jGroundTruth = R"({
-            "time": 0.0,
-            "groundTruth": {
-                "position": { "x": 0.0, "y": 0.0, "z": 0.0 },
-                "orientation": { "w": 0.0, "x": 0.0, "y": 0.0, "z": 0.0 }
-            }
-        })"_json;
-        json jARKit = R"({
-            "time": 0.0,
-            "ARKit": {
-                "position": { "x": 0.0, "y": 0.0, "z": 0.0 },
-                "orientation": { "w": 0.0, "x": 0.0, "y": 0.0, "z": 0.0 }
-            }
-        })"_json;
-        json jFrame = R"({
-            "time": 0.0,
-            "cameraInd": 0,
-            "number": 0,
-            "cameraParameters": {
-                "focalLength": 0.0,
-                "principalPointX": 0.0,
-                "principalPointY": 0.0
-            }
-        })"_json;
-        json jFrameGroup = R"({
-            "time": 0.0,
-            "number": 0,
-            "frames": []
-        })"_json;
-        json jFrameDrop = R"({
-            "time": 0.0,
-            "droppedFrame": true
-        })"_json;
-    } workspace;
-
-    RecorderImplementation(std::ostream &output) :
+    // Lines serialized since the last hand-over to the OutputBuffer. Only
+    // touched by the JSONL thread, reused to avoid allocation.
+    std::string lines;
+    // Appends records to lines in the output format
+    std::unique_ptr<RecordHandler> encoder;
+    std::size_t commitThreshold = 0;
+    std::vector<int> lineFrameNumbers;
+    // Scratch for JSON serialized by the JSONL thread
+    std::string jsonBuffer;
+    // Bytes handed to the OutputBuffer so far, the file offset of lines
+    std::uint64_t committedBytes = 0;
+    std::string indexPath;
+    std::unique_ptr<TimeIndex> index;
+
+    // Running statistics for the summary record, JSONL thread only
+    struct StreamStats {
+        std::size_t count = 0;
+        std::uint64_t bytes = 0;
+        std::size_t dropped = 0;
+        double minTime = INFINITY;
+        double maxTime = -INFINITY;
+    };
+    bool summary = false;
+    std::array<StreamStats, STREAM_COUNT> streamStats;
+    std::size_t droppedFrames = 0;
+    double minTime = INFINITY;
+    double maxTime = -INFINITY;
+
+    // Records held for Settings::reorderWindow, JSONL thread only. Equal
+    // times keep the order the records arrived in.
+    struct Held {
+        double t;
+        std::uint64_t order;
+        Record record;
+    };
+    struct HeldLater {
+        bool operator()(const Held &a, const Held &b) const {
+            return a.t > b.t || (a.t == b.t && a.order > b.order);
+        }
+    };
+    bool reorder = false;
+    std::priority_queue<Held, std::vector<Held>, HeldLater> held;
+    std::uint64_t heldCount = 0;
+    // Newest time of the records added to the window so far
+    double newestHeldTime = -INFINITY;
+    // Records older than the last one written are dropped.
+    double lastReleasedTime = -INFINITY;
+    // Largest position in the window given to a frame record so far
+    double lastFrameTime = -INFINITY;
+
+    // Segmented output, JSONL thread only unless noted. The current segment
+    // number, 0 if the output is not segmented.
+    int segment = 0;
+    double segmentStartTime = NAN;
+    // With video recording, the JSONL thread asks the producer of frames to
+    // start the next segment, and does so itself once it sees the first
+    // frame record of that segment.
+    bool segmentPending = false;
+    std::atomic<bool> segmentRequested{false};
+    int videoSegment = 0; // frame producer only
+    // Opens the next segment ahead of time and finishes the previous one
+    std::unique_ptr<Processor> segmentWorker;
+    std::unique_ptr<OutputSink> nextSegmentFile;
+    Future nextSegmentOpened = Future::instantlyResolved();
+
+    // Runtime statistics, see Recorder::stats(). The JSONL thread collects
+    // its part in batchStats and merges them into writerStats after each
+    // batch of records.
+    struct WriterStats {
+        std::array<LatencyHistogram, STREAM_COUNT> queueLatency;
+        std::array<LatencyHistogram, STREAM_COUNT> serializationTime;
+        LatencyHistogram outputTime;
+        std::uint64_t records = 0;
+        std::uint64_t bytes = 0;
+        std::uint64_t flushes = 0;
+        std::uint64_t blocks = 0;
+        std::uint64_t syncs = 0;
+        std::array<std::uint64_t, STREAM_COUNT> lateRecords = {};
+    };
+    WriterStats batchStats;
+    Clock::time_point lastStatsRecord;
+    Clock::time_point lastDropLog;
+    struct VideoState {
+        RecorderStats::Video stats;
+        std::uint64_t posted = 0;
+        // Frames encoded since windowStart, for the frame rate
+        Clock::time_point windowStart;
+        std::uint64_t windowFrames = 0;
+    };
+    mutable std::mutex statsMutex;
+    WriterStats writerStats;
+    std::map<int, VideoState> videoStats;
+    std::atomic<std::size_t> queueHighWater{0};
+    std::atomic<std::size_t> framesDroppedPoolFull{0};
+    std::atomic<std::size_t> framesDroppedImagesPending{0};
+
+    RecorderImplementation(std::ostream &output, const Settings &settings) :
         fileOutput(),
         output(output)
     {
-        init();
+        init(settings);
     }
 
-    RecorderImplementation(const std::string &outputPath) :
-            fileOutput(outputPath),
-            output(this->fileOutput)
+    RecorderImplementation(const std::string &outputPath, const Settings &settings) :
+            fileOutput(),
+            output(this->fileOutput),
+            outputPath(outputPath)
     {
-        init();
+        if (opensStream(settings)) fileOutput.open(outputPath, fileMode(settings));
+        init(settings);
     }
 
-    RecorderImplementation(const std::string &outputPath, const std::string &videoOutputPrefix) :
-            fileOutput(outputPath),
+    RecorderImplementation(const std::string &outputPath, const std::string &videoOutputPrefix, const Settings &settings) :
+            fileOutput(),
             output(this->fileOutput),
+            outputPath(outputPath),
             videoOutputPrefix(videoOutputPrefix)
     {
-        init();
+        if (opensStream(settings)) fileOutput.open(outputPath, fileMode(settings));
+        init(settings);
     }
 
-    void init() {
+    ~RecorderImplementation() {
+        // Write out everything still queued before the members go away.
+        waitForVideo();
+        flush();
+        shouldQuit = true;
+        wakeWriter();
+        jsonlThread.join();
+        saveIndex();
+        if (segmentWorker) {
+            // Finish the previous segments and remove the unused next one.
+            segmentWorker->barrier().wait();
+            nextSegmentOpened.wait();
+            nextSegmentFile.reset();
+            std::remove(segmentPath(outputPath, segment + 1).c_str());
+        }
+    }
+
+    void init(const Settings &settings) {
+        this->settings = settings;
         output.precision(10);
-        jsonlProcessor = Processor::createThreadPool(1);
+        std::unique_ptr<OutputSink> sink;
+        if (isSegmented(settings) && !outputPath.empty()) {
+            segmentWorker = Processor::createThreadPool(1);
+            openNextSegment();
+            sink = nextSegmentSink();
+            videoSegment = segment;
+        } else if (!outputPath.empty() && !opensStream(settings)) {
+            sink = openFile(outputPath, settings);
+            if (!sink) {
+                log_warn("recorder: could not open %s\n", outputPath.c_str());
+                sink = OutputSink::build(output);
+            }
+            sink = compressed(std::move(sink));
+        } else {
+            if (isSegmented(settings)) {
+                log_warn("recorder: segments need output to a file path, not splitting the recording\n");
+            }
+            if (isDurable(settings)) {
+                log_warn("recorder: syncing needs output to a file path, not syncing the recording\n");
+            }
+            sink = compressed(OutputSink::build(output));
+        }
+        if (!outputPath.empty()) {
+            indexPath = timeIndexPath(segment > 0 ? segmentPath(outputPath, segment) : outputPath);
+        }
+        out = std::make_unique<OutputBuffer>(std::move(sink), settings.flushPolicy);
+        commitThreshold = std::min<std::size_t>(settings.flushPolicy.maxBytes, 64 * 1024);
+        lines.reserve(commitThreshold + 1024);
+        if (settings.format == Format::BINARY) {
+            encoder = buildBinaryEncoder(lines);
+            writeBinaryHeader(lines);
+        } else {
+            encoder = buildJsonlEncoder(lines);
+        }
+        if (settings.indexInterval > 0.0) {
+            if (indexPath.empty() || settings.format != Format::JSONL || this->settings.compression != Compression::NONE) {
+                log_warn("recorder: time index needs uncompressed JSONL output to a file, not writing one\n");
+            } else {
+                index = std::make_unique<TimeIndex>(settings.indexInterval);
+            }
+        }
+        summary = settings.writeSummary;
+        reorder = reorders(settings);
+        videoEncoderThreads = static_cast<int>(settings.videoEncoderThreads);
+        if (videoEncoderThreads <= 0) {
+            videoEncoderThreads = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+        }
+        records = std::make_unique<StagingQueue<Record> >(settings.queueCapacity);
+        // One payload per record of a full buffer, and a few being written or
+        // pushed. More producers fall back to the heap if needed.
+        payloads = std::make_unique<RecordPayloads>(records->capacity() + 64);
+        decimationFactor = std::max(settings.decimationFactor, 1u);
+        for (auto &stream : streams) stream.policy = settings.overflowPolicy;
+        for (const auto &p : settings.streamOverflowPolicies) {
+            streams.at(static_cast<std::size_t>(p.first)).policy = p.second;
+        }
+        // The video frames of frame records are already written, so dropping
+        // the record would shift the frame numbers of the following ones.
+        streamState(Stream::FRAMES).policy = OverflowPolicy::BLOCK;
         #ifdef USE_OPENCV_VIDEO_RECORDING
         constexpr std::size_t CAPACITY_INCREASE = 4;
-        // Shared between stereo, i.e. MAX_CAPACITY mono frames, or MAX_CAPACITY/2 stereo pairs can
-        // be buffered in memory before frame skipping occurs if video encoding cannot keep up
-        constexpr std::size_t MAX_CAPACITY = 20;
         frameStore = std::make_unique<recorder::FrameBuffer>(
-            CAPACITY_INCREASE, MAX_CAPACITY
+            CAPACITY_INCREASE, VIDEO_FRAME_CAPACITY
         );
         #endif
+        // Last, the writer reads the above in stats().
+        lastStatsRecord = Clock::now();
+        jsonlThread = std::thread([this]() { writeLoop(); });
+    }
+
+    // The first call is from init(), which a build without zlib makes fall
+    // back to uncompressed output for the whole recording.
+    std::unique_ptr<OutputSink> compressed(std::unique_ptr<OutputSink> sink) {
+        if (settings.compression != Compression::GZIP) return sink;
+        #ifdef USE_ZLIB_COMPRESSION
+        return OutputSink::buildCompressing(std::move(sink), settings.compressionLevel);
+        #else
+        log_warn("recorder: not built with compression support, writing uncompressed output\n");
+        settings.compression = Compression::NONE;
+        return sink;
+        #endif
+    }
+
+    void openNextSegment() {
+        const std::string path = segmentPath(outputPath, segment + 1);
+        nextSegmentOpened = segmentWorker->enqueue([this, path]() {
+            nextSegmentFile = openFile(path, settings);
+        });
+    }
+
+    // Advance to the file opened by openNextSegment() and open the one after it
+    std::unique_ptr<OutputSink> nextSegmentSink() {
+        nextSegmentOpened.wait();
+        segment++;
+        std::unique_ptr<OutputSink> file = std::move(nextSegmentFile);
+        if (!file) {
+            log_warn("recorder: could not open %s\n", segmentPath(outputPath, segment).c_str());
+            // Writes to the closed stream are ignored.
+            file = OutputSink::build(std::unique_ptr<std::ostream>(new std::ofstream()));
+        }
+        openNextSegment();
+        segmentStartTime = NAN;
+        return compressed(std::move(file));
+    }
+
+    bool segmentFull(double t) const {
+        const SegmentPolicy &policy = settings.segmentPolicy;
+        if (policy.maxBytes > 0 && committedBytes + lines.size() >= policy.maxBytes) return true;
+        return policy.maxDurationSeconds > 0.0 && t - segmentStartTime >= policy.maxDurationSeconds;
+    }
+
+    void startNextSegment() {
+        if (summary) writeSummary();
+        commit();
+        // The previous segment is flushed, closed and indexed in the background.
+        std::shared_ptr<OutputSink> finished = out->replaceSink(nextSegmentSink());
+        std::shared_ptr<TimeIndex> finishedIndex = std::move(index);
+        const std::string finishedIndexPath = indexPath;
+        const std::uint64_t finishedSize = committedBytes;
+        const bool durable = isDurable(settings);
+        segmentWorker->post([finished, finishedIndex, finishedIndexPath, finishedSize, durable]() {
+            if (durable) finished->sync();
+            finished->flush();
+            if (finishedIndex && !finishedIndex->save(finishedIndexPath, finishedSize)) {
+                log_warn("recorder: could not write time index %s\n", finishedIndexPath.c_str());
+            }
+        });
+
+        committedBytes = 0;
+        indexPath = timeIndexPath(segmentPath(outputPath, segment));
+        if (finishedIndex) index = std::make_unique<TimeIndex>(settings.indexInterval);
+        streamStats.fill(StreamStats());
+        droppedFrames = 0;
+        minTime = INFINITY;
+        maxTime = -INFINITY;
+        if (settings.format == Format::BINARY) writeBinaryHeader(lines);
+    }
+
+    // Called by the JSONL thread before writing a record with time t
+    void checkSegment(const Record &r, double t) {
+        const bool frame = r.type == Record::Type::FRAME || r.type == Record::Type::FRAME_GROUP;
+        if (segmentPending && frame && r.segment > segment) {
+            segmentPending = false;
+            startNextSegment();
+            // Frame numbers index the video files of the segment.
+            frameNumbers.clear();
+            frameNumberGroup = 0;
+        }
+        if (segmentPending || !segmentFull(t)) {
+            if (std::isnan(segmentStartTime)) segmentStartTime = t;
+            return;
+        }
+        if (videoOutputPrefix.empty()) {
+            startNextSegment();
+            segmentStartTime = t;
+        } else {
+            segmentPending = true;
+            segmentRequested = true;
+        }
+    }
+
+    // Called by the producer of frames. With video recording, segments of
+    // the JSONL and video output start at the same frame.
+    void startRequestedSegment() {
+        if (!segmentRequested.load() || !segmentRequested.exchange(false)) return;
+        videoSegment++;
+        #ifdef USE_OPENCV_VIDEO_RECORDING
+        for (auto &writer : videoWriters) {
+            writer.second->startSegment(videoFramesPosted.at(writer.first), videoSegment);
+        }
+        #endif
+    }
+
+    void waitForVideo() {
+        for (auto &processor : videoProcessors) {
+            processor.second->barrier().wait();
+        }
     }
 
     void closeOutputFile() final {
+        waitForVideo();
+        flush(true);
         fileOutput.close();
     }
 
-    void addGyroscope(const GyroscopeData &d) final {
-        jsonlProcessor->enqueue([this, d]() {
-            workspace.jGyroscope["time"] = d.t;
-            workspace.jGyroscope["sensor"]["values"] = { d.x, d.y, d.z };
-            workspace.jGyroscope["sensor"].erase("temperature");
-            if (d.temperature > 0.0) {
-            workspace.jGyroscope["sensor"]["temperature"] = d.temperature;
+    void flush() final {
+        flush(false);
+    }
+
+    // With close, also write the summary and time index of unsegmented output
+    void flush(bool close) {
+        auto promise = Promise::create();
+        auto future = promise->getFuture();
+        Record r;
+        r.type = Record::Type::FLUSH;
+        r.flush = { promise.get(), close };
+        // Merged after everything queued before it by any thread
+        r.queued = Clock::now();
+        RingBuffer<Record> &buffer = records->local();
+        // Never dropped, unlike actual records.
+        while (!buffer.push(r)) std::this_thread::yield();
+        wakeWriter();
+        future.wait();
+    }
+
+    StreamState &streamState(Stream stream) {
+        return streams[static_cast<std::size_t>(stream)];
+    }
+
+    void countDropped(Stream stream, std::size_t count, double lastTime) {
+        auto &state = streamState(stream);
+        if (!std::isnan(lastTime)) state.lastDropTime = lastTime;
+        state.dropped += count;
+    }
+
+    void drop(const Record &r) {
+        countDropped(r.stream(), 1, r.timestamp());
+        Record dropped = r;
+        dropped.release(*payloads);
+    }
+
+    // Of the calling thread's buffer. Waits for the writer if the oldest
+    // record is one that must not be dropped.
+    void dropOldest(RingBuffer<Record> &buffer) {
+        Record oldest;
+        const auto droppable = [](const Record &r) {
+            return r.type != Record::Type::FLUSH && r.stream() != Stream::FRAMES;
+        };
+        if (buffer.popIf(oldest, droppable)) {
+            drop(oldest);
+        } else {
+            wakeWriter();
+            std::this_thread::yield();
+        }
+    }
+
+    void noteQueueDepth(std::size_t depth) {
+        depth = std::min(depth, records->capacity());
+        std::size_t highWater = queueHighWater.load(std::memory_order_relaxed);
+        while (depth > highWater && !queueHighWater.compare_exchange_weak(highWater, depth)) {}
+    }
+
+    void push(Record &r) {
+        r.queued = Clock::now();
+        auto &state = streamState(r.stream());
+        RingBuffer<Record> &buffer = records->local();
+        const std::size_t depth = buffer.size();
+        const bool halfFull = depth >= buffer.capacity() / 2;
+        noteQueueDepth(depth + 1);
+        switch (state.policy) {
+            case OverflowPolicy::DECIMATE:
+                if (halfFull && state.decimationCounter++ % decimationFactor != 0) {
+                    drop(r);
+                    return;
+                }
+                // fall through
+            case OverflowPolicy::DROP_NEWEST:
+                if (!buffer.push(r)) {
+                    drop(r);
+                    return;
+                }
+                break;
+            case OverflowPolicy::BLOCK:
+                while (!buffer.push(r)) {
+                    wakeWriter();
+                    std::this_thread::yield();
+                }
+                break;
+            case OverflowPolicy::DROP_OLDEST:
+                // Others may push to a shared buffer while its oldest
+                // record is examined, so drop the new one there.
+                if (records->shared(buffer)) {
+                    if (!buffer.push(r)) {
+                        drop(r);
+                        return;
+                    }
+                    break;
+                }
+                while (!buffer.push(r)) dropOldest(buffer);
+                break;
+        }
+        if (halfFull) wakeWriter();
+    }
+
+    // Like push() for n samples of the same stream, but reserving space for
+    // them all at once.
+    template <class T> void pushBatch(Record::Type type, T Record::*member, const T *samples, std::size_t n) {
+        if (n == 0) return;
+        Record model;
+        model.type = type;
+        const Stream stream = model.stream();
+        auto &state = streamState(stream);
+        RingBuffer<Record> &buffer = records->local();
+        const bool halfFull = buffer.size() >= buffer.capacity() / 2;
+
+        // Samples [first, first + step * n) are pushed, others dropped.
+        std::size_t first = 0, step = 1;
+        if (state.policy == OverflowPolicy::DECIMATE && halfFull) {
+            const std::size_t counter = state.decimationCounter.fetch_add(static_cast<unsigned>(n));
+            step = decimationFactor;
+            first = (step - counter % step) % step;
+            const std::size_t kept = first < n ? (n - 1 - first) / step + 1 : 0;
+            if (kept < n) countDropped(stream, n - kept, samples[n - 1].t);
+            n = kept;
+        }
+
+        const Clock::time_point queued = Clock::now();
+        noteQueueDepth(buffer.size() + n);
+        std::size_t pushed = 0;
+        while (pushed < n) {
+            const std::size_t offset = first + step * pushed;
+            pushed += buffer.pushMany(n - pushed, [&](std::size_t i, Record &r) {
+                r.type = type;
+                r.queued = queued;
+                r.*member = samples[offset + step * i];
+            });
+            if (pushed == n) break;
+            if (state.policy == OverflowPolicy::BLOCK) {
+                wakeWriter();
+                std::this_thread::yield();
+            } else if (state.policy == OverflowPolicy::DROP_OLDEST) {
+                dropOldest(buffer);
+            } else {
+                countDropped(stream, n - pushed, samples[first + step * (n - 1)].t);
+                break;
             }
-            output << workspace.jGyroscope.dump() << std::endl;
-        });
+        }
+        if (halfFull || buffer.size() >= buffer.capacity() / 2) wakeWriter();
+    }
+
+    void wakeWriter() {
+        if (writerSleeping.load()) {
+            std::lock_guard<std::mutex> lock(wakeMutex);
+            wakeCondition.notify_one();
+        }
+    }
+
+    void writeLoop() {
+        Record r;
+        while (true) {
+            while (records->pop(r, queuedTime)) reorderOrWrite(r);
+            writeRecordDrops();
+            // Producers are done once shouldQuit is set, nothing can follow.
+            const bool quit = shouldQuit.load();
+            logDrops(quit);
+            if (quit) releaseHeld(held.size());
+            if (statsRecordDue()) writeStatsRecord();
+            if (quit && summary) writeSummary();
+            commit();
+            timeOutput([this]() { out->poll(); });
+            publishStats();
+            if (quit) break;
+
+            std::unique_lock<std::mutex> lock(wakeMutex);
+            writerSleeping = true;
+            if (records->size() == 0) wakeCondition.wait_for(lock, JSONL_DRAIN_INTERVAL);
+            writerSleeping = false;
+        }
+    }
+
+    void writeRecordDrops() {
+        for (std::size_t i = 0; i < STREAM_COUNT; ++i) {
+            auto &state = streams[i];
+            const std::size_t dropped = state.dropped.load();
+            if (dropped == state.reportedDropped) continue;
+            const std::size_t count = dropped - state.reportedDropped;
+            state.reportedDropped = dropped;
+            double t = state.lastDropTime.load();
+            // Records held for reordering may be older than the dropped ones.
+            // Before any record is written, the line has no time and is
+            // neither indexed nor in the time range.
+            if (std::isnan(t) || reorder) t = lastWrittenTime;
+            state.unloggedDropped += count;
+            const std::size_t begin = lines.size();
+            encoder->recordDrop(static_cast<Stream>(i), count, t);
+            // JsonlReader passes these to onOther()
+            if (index) index->add(Stream::JSON, t, committedBytes + begin, committedBytes + lines.size());
+            updateTimeRange(t);
+            streamStats[i].dropped += count;
+            batchStats.records++;
+        }
+    }
+
+    // Print the drops since the last call, at most every DROP_LOG_INTERVAL
+    // unless forced
+    void logDrops(bool force) {
+        const Clock::time_point now = Clock::now();
+        if (!force && now - lastDropLog < DROP_LOG_INTERVAL) return;
+        lastDropLog = now;
+        for (std::size_t i = 0; i < STREAM_COUNT; ++i) {
+            auto &state = streams[i];
+            if (state.unloggedDropped == 0) continue;
+            const char *name = streamName(static_cast<Stream>(i));
+            // Late records are counted before writeRecordDrops() reports them.
+            const std::size_t late = std::min(state.unloggedLate, state.unloggedDropped);
+            const std::size_t overflow = state.unloggedDropped - late;
+            if (late > 0) {
+                log_warn("recorder: dropped %zu %s records older than the reorder window\n", late, name);
+            }
+            if (overflow > 0 && state.policy == OverflowPolicy::DECIMATE) {
+                log_warn("recorder: JSONL queue over half full, decimated %s, dropped %zu records\n", name, overflow);
+            } else if (overflow > 0) {
+                log_warn("recorder: JSONL queue full, dropped %zu %s records\n", overflow, name);
+            }
+            state.unloggedDropped = 0;
+            state.unloggedLate -= late;
+        }
+    }
+
+    // Write r, or with a reorder window, hold it until it is due
+    void reorderOrWrite(Record &r) {
+        if (!reorder) {
+            write(r);
+            return;
+        }
+        if (r.type == Record::Type::FLUSH) {
+            releaseHeld(held.size());
+            write(r);
+            return;
+        }
+        // Its time is needed now.
+        if (r.type == Record::Type::JSON_STRING && !parseJsonString(r)) {
+            r.release(*payloads);
+            return;
+        }
+        const double time = r.timestamp();
+        const bool frame = r.stream() == Stream::FRAMES;
+        double t = time;
+        if (std::isnan(t)) {
+            t = newestHeldTime;
+        } else if (t < lastReleasedTime) {
+            const Stream stream = r.stream();
+            batchStats.lateRecords[static_cast<std::size_t>(stream)]++;
+            if (!frame) {
+                countDropped(stream, 1, time);
+                streamState(stream).unloggedLate++;
+                r.release(*payloads);
+                return;
+            }
+            // Never dropped, like in the queue: written out of order instead
+            t = lastReleasedTime;
+        } else {
+            newestHeldTime = std::max(newestHeldTime, t);
+        }
+        if (frame) {
+            // Frame numbers follow the order the video frames were written in.
+            t = std::max(t, lastFrameTime);
+            lastFrameTime = t;
+        }
+        held.push(Held { t, heldCount++, r });
+
+        const ReorderWindow &window = settings.reorderWindow;
+        std::size_t due = 0;
+        if (window.maxRecords > 0 && held.size() > window.maxRecords) due = held.size() - window.maxRecords;
+        releaseHeld(due);
+        if (window.maxSpanSeconds > 0.0) {
+            while (!held.empty() && newestHeldTime - held.top().t >= window.maxSpanSeconds) releaseHeld(1);
+        }
+    }
+
+    // Write the n oldest held records
+    void releaseHeld(std::size_t n) {
+        for (; n > 0 && !held.empty(); --n) {
+            Record r = held.top().record;
+            held.pop();
+            const double t = r.timestamp();
+            if (!std::isnan(t)) lastReleasedTime = std::max(lastReleasedTime, t);
+            write(r);
+        }
+    }
+
+    // Called by the JSONL thread to make batchStats visible to stats()
+    void publishStats() {
+        WriterStats &w = writerStats;
+        batchStats.blocks = out->blockCount();
+        batchStats.syncs = out->syncCount();
+        std::lock_guard<std::mutex> lock(statsMutex);
+        for (std::size_t i = 0; i < STREAM_COUNT; ++i) {
+            w.queueLatency[i].merge(batchStats.queueLatency[i]);
+            w.serializationTime[i].merge(batchStats.serializationTime[i]);
+        }
+        w.outputTime.merge(batchStats.outputTime);
+        w.records += batchStats.records;
+        w.bytes += batchStats.bytes;
+        w.flushes += batchStats.flushes;
+        w.blocks = batchStats.blocks;
+        w.syncs = batchStats.syncs;
+        for (std::size_t i = 0; i < STREAM_COUNT; ++i) w.lateRecords[i] += batchStats.lateRecords[i];
+        batchStats = WriterStats();
+    }
+
+    // Call f, which may hand a block to the output, and time it if it does
+    template <class F> void timeOutput(const F &f) {
+        const std::uint64_t blocks = out->blockCount();
+        const Clock::time_point start = Clock::now();
+        f();
+        if (out->blockCount() != blocks) batchStats.outputTime.add(seconds(Clock::now() - start));
+    }
+
+    bool statsRecordDue() const {
+        if (settings.statsIntervalSeconds <= 0.0) return false;
+        return seconds(Clock::now() - lastStatsRecord) >= settings.statsIntervalSeconds;
+    }
+
+    void writeStatsRecord() {
+        publishStats();
+        lastStatsRecord = Clock::now();
+        const double t = lastWrittenTime;
+        json j = { { "recorderStats", statsJson(stats()) } };
+        // Without a time before the first record, so it does not count as
+        // the start of the recording. Neither indexed nor in the time range.
+        if (!std::isnan(t)) j["time"] = t;
+        jsonBuffer.clear();
+        serializeJson(jsonBuffer, j);
+        const std::size_t begin = lines.size();
+        encoder->json(jsonBuffer.data(), jsonBuffer.size());
+        if (index) index->add(Stream::JSON, t, committedBytes + begin, committedBytes + lines.size());
+        if (summary) {
+            Record r;
+            r.type = Record::Type::JSON;
+            updateStats(r, t, lines.size() - begin);
+        }
+        batchStats.records++;
+    }
+
+    RecorderStats stats() const final {
+        RecorderStats s;
+        s.queueDepth = records->size();
+        s.queueHighWater = queueHighWater.load();
+        s.queueCapacity = records->capacity();
+        s.unflushedBytes = unflushedBytes();
+        #ifdef USE_OPENCV_VIDEO_RECORDING
+        for (const auto &p : frameStore->stats()) {
+            s.framePools.push_back({ p.rows, p.cols, p.type, p.capacity, p.inUse, p.highWater, p.failures });
+        }
+        s.pendingImages = imageBuffersPending.load();
+        #endif
+        s.droppedFrames.framePoolFull = framesDroppedPoolFull.load();
+        s.droppedFrames.imagesPending = framesDroppedImagesPending.load();
+
+        std::lock_guard<std::mutex> lock(statsMutex);
+        const WriterStats &w = writerStats;
+        for (std::size_t i = 0; i < STREAM_COUNT; ++i) {
+            const Stream stream = static_cast<Stream>(i);
+            if (w.queueLatency[i].count > 0) s.queueLatency[stream] = w.queueLatency[i];
+            if (w.serializationTime[i].count > 0) s.serializationTime[stream] = w.serializationTime[i];
+            if (w.lateRecords[i] > 0) s.lateRecords[stream] = w.lateRecords[i];
+        }
+        s.outputTime = w.outputTime;
+        s.records = w.records;
+        s.bytes = w.bytes;
+        s.blocks = w.blocks;
+        s.flushes = w.flushes;
+        s.syncs = w.syncs;
+        for (const auto &p : videoStats) {
+            RecorderStats::Video &video = s.video[p.first];
+            video = p.second.stats;
+            video.pending = static_cast<std::size_t>(p.second.posted - video.frames);
+        }
+        return s;
+    }
+
+    void updateTimeRange(double t) {
+        if (std::isnan(t)) return;
+        minTime = std::min(minTime, t);
+        maxTime = std::max(maxTime, t);
+    }
+
+    void updateStats(const Record &r, double t, std::size_t bytes) {
+        updateTimeRange(t);
+        if (r.type == Record::Type::FRAME_DROP) {
+            droppedFrames++;
+            return;
+        }
+        StreamStats &s = streamStats[static_cast<std::size_t>(r.stream())];
+        s.count++;
+        s.bytes += bytes;
+        if (!std::isnan(t)) {
+            s.minTime = std::min(s.minTime, t);
+            s.maxTime = std::max(s.maxTime, t);
+        }
+    }
+
+    // Of the output so far. Not written again after that.
+    void saveIndex() {
+        if (index && !index->save(indexPath, committedBytes)) {
+            log_warn("recorder: could not write time index %s\n", indexPath.c_str());
+        }
+        index.reset();
+    }
+
+    void writeSummary() {
+        // Non-finite times are written as null.
+        json jStreams = json::object();
+        for (std::size_t i = 0; i < STREAM_COUNT; ++i) {
+            const StreamStats &s = streamStats[i];
+            if (s.count == 0 && s.dropped == 0) continue;
+            jStreams[streamName(static_cast<Stream>(i))] = {
+                { "bytes", s.bytes },
+                { "count", s.count },
+                { "dropped", s.dropped },
+                { "maxTime", s.maxTime },
+                { "minTime", s.minTime }
+            };
+        }
+        const json j = {
+            { "summary", {
+                { "droppedFrames", droppedFrames },
+                { "maxTime", maxTime },
+                { "minTime", minTime },
+                { "streams", jStreams }
+            }}
+        };
+        jsonBuffer.clear();
+        serializeJson(jsonBuffer, j);
+        encoder->json(jsonBuffer.data(), jsonBuffer.size());
+        batchStats.records++;
+    }
+
+    void commit() {
+        if (lines.empty()) return;
+        timeOutput([this]() { out->write(lines.data(), lines.size()); });
+        committedBytes += lines.size();
+        batchStats.bytes += lines.size();
+        lines.clear();
+    }
+
+    static double jsonTime(const json &j) {
+        const auto it = j.find("time");
+        return it != j.end() && it->is_number() ? it->get<double>() : NAN;
+    }
+
+    void write(Record &r) {
+        double t = r.timestamp();
+        if (!std::isnan(t)) lastWrittenTime = t;
+        if (segment > 0 && r.type != Record::Type::FLUSH) checkSegment(r, t);
+        const std::size_t begin = lines.size();
+        const Clock::time_point start = Clock::now();
+        switch (r.type) {
+            case Record::Type::GYROSCOPE:
+                encoder->gyroscope(r.gyroscope);
+                break;
+            case Record::Type::ACCELEROMETER:
+                encoder->accelerometer(r.accelerometer);
+                break;
+            case Record::Type::GPS:
+                encoder->gps(r.gps);
+                break;
+            case Record::Type::ARKIT:
+                encoder->arkit(r.pose.pose);
+                break;
+            case Record::Type::GROUND_TRUTH:
+                encoder->groundTruth(r.pose.pose);
+                break;
+            case Record::Type::ODOMETRY_OUTPUT:
+                encoder->odometryOutput(r.pose.pose, r.pose.velocity);
+                break;
+            case Record::Type::FRAME:
+                encoder->frameGroup(r.frame.t, frameNumberGroup, &r.frame, &frameNumberGroup, 1);
+                frameNumberGroup++;
+                break;
+            case Record::Type::FRAME_GROUP:
+                writeFrameGroup(r.frameGroup.t, *r.frameGroup.frames);
+                break;
+            case Record::Type::FRAME_DROP:
+                encoder->frameDrop(r.time);
+                break;
+            case Record::Type::JSON:
+                encoder->json(r.json.text->data(), r.json.text->size());
+                break;
+            case Record::Type::JSON_STRING:
+                if (!parseJsonString(r)) {
+                    r.release(*payloads);
+                    return;
+                }
+                t = r.json.t;
+                encoder->json(r.json.text->data(), r.json.text->size());
+                break;
+            case Record::Type::FLUSH: {
+                // Including the drops before the flush() call
+                writeRecordDrops();
+                const bool finish = r.flush.close && segment == 0;
+                if (finish && summary) {
+                    writeSummary();
+                    summary = false;
+                }
+                commit();
+                timeOutput([this]() { out->flush(); });
+                if (finish) saveIndex();
+                batchStats.flushes++;
+                publishStats();
+                r.flush.promise->resolve();
+                return;
+            }
+        }
+        const Clock::time_point end = Clock::now();
+        const std::size_t stream = static_cast<std::size_t>(r.stream());
+        batchStats.serializationTime[stream].add(seconds(end - start));
+        batchStats.queueLatency[stream].add(seconds(end - r.queued));
+        batchStats.records++;
+        if (index) index->add(r.stream(), t, committedBytes + begin, committedBytes + lines.size());
+        if (summary) updateStats(r, t, lines.size() - begin);
+        r.release(*payloads);
+        if (lines.size() >= commitThreshold) commit();
+    }
+
+    void writeFrameGroup(double t, const std::vector<FrameData> &frames) {
+        lineFrameNumbers.clear();
+        for (const auto &f : frames) { // f.frameData pointer no longer valid
+            // Track frame numbers of each camera because some frame groups
+            // may only contain output from some of the cameras (happens on iOS).
+            try {
+                frameNumbers.at(f.cameraInd)++;
+            } catch (const std::out_of_range &e) {
+                frameNumbers[f.cameraInd] = 0;
+            }
+            lineFrameNumbers.push_back(frameNumbers[f.cameraInd]);
+        }
+        encoder->frameGroup(t, frameNumberGroup, frames.data(), lineFrameNumbers.data(), frames.size());
+        frameNumberGroup++;
+    }
+
+    // Turn a JSON_STRING record into a JSON record of one line, with its
+    // time. False if the string is not valid JSON.
+    bool parseJsonString(Record &r) {
+        std::string &jsonString = *r.json.text;
+        json j;
+        try {
+            j = json::parse(jsonString);
+        } catch (const nlohmann::detail::parse_error &e) {
+            log_warn("recorder addLine(): Skipping invalid JSON: %s", jsonString.c_str());
+            return false;
+        }
+        r.type = Record::Type::JSON;
+        r.json.t = jsonTime(j);
+
+        // Make sure output is exactly one line.
+        const size_t n = jsonString.find('\n');
+        if (n == std::string::npos) return true;
+        if (n + 1 < jsonString.size()) {
+            // Re-serialize multiline input.
+            jsonString.clear();
+            serializeJson(jsonString, j);
+        } else {
+            jsonString.resize(n);
+        }
+        return true;
+    }
+
+    std::size_t unflushedBytes() const final {
+        return out->unflushedBytes();
+    }
+
+    std::size_t droppedRecords(Stream stream) const final {
+        return streams.at(static_cast<std::size_t>(stream)).dropped.load();
+    }
+
+    void addGyroscope(const GyroscopeData &d) final {
+        Record r;
+        r.type = Record::Type::GYROSCOPE;
+        r.gyroscope = d;
+        push(r);
     }
 
     void addGyroscope(double t, double x, double y, double z) final {
@@ -165,15 +1117,18 @@ struct RecorderImplementation : public Recorder {
     }
 
     void addAccelerometer(const AccelerometerData &d) final {
-        jsonlProcessor->enqueue([this, d]() {
-            workspace.jAccelerometer["time"] = d.t;
-            workspace.jAccelerometer["sensor"]["values"] = { d.x, d.y, d.z };
-            workspace.jAccelerometer["sensor"].erase("temperature");
-            if (d.temperature > 0.0) {
-            workspace.jAccelerometer["sensor"]["temperature"] = d.temperature;
-            }
-            output << workspace.jAccelerometer.dump() << std::endl;
-        });
+        Record r;
+        r.type = Record::Type::ACCELEROMETER;
+        r.accelerometer = d;
+        push(r);
+    }
+
+    void addGyroscopeBatch(const GyroscopeData *samples, std::size_t n) final {
+        pushBatch(Record::Type::GYROSCOPE, &Record::gyroscope, samples, n);
+    }
+
+    void addAccelerometerBatch(const AccelerometerData *samples, std::size_t n) final {
+        pushBatch(Record::Type::ACCELEROMETER, &Record::accelerometer, samples, n);
     }
 
     void addAccelerometer(double t, double x, double y, double z) final {
@@ -187,28 +1142,11 @@ struct RecorderImplementation : public Recorder {
         addAccelerometer(d);
     }
 
-    void setFrame(const FrameData &f) {
-        workspace.jFrame["time"] = f.t;
-        workspace.jFrame["cameraInd"] = f.cameraInd;
-
-        workspace.jFrame.erase("cameraParameters");
-        if (f.focalLengthX > 0.0) {
-            workspace.jFrame["cameraParameters"]["focalLengthX"] = f.focalLengthX;
-        }
-        if (f.focalLengthY > 0.0) {
-            workspace.jFrame["cameraParameters"]["focalLengthY"] = f.focalLengthY;
-        }
-        if (f.px > 0.0 && f.py > 0.0) {
-            workspace.jFrame["cameraParameters"]["principalPointX"] = f.px;
-            workspace.jFrame["cameraParameters"]["principalPointY"] = f.py;
-        }
-    }
-
     void frameDrop(double time) {
-        jsonlProcessor->enqueue([this, time]() {
-            workspace.jFrameDrop["time"] = time;
-            output << workspace.jFrameDrop.dump() << std::endl;
-        });
+        Record r;
+        r.type = Record::Type::FRAME_DROP;
+        r.time = time;
+        push(r);
     }
 
     #ifdef USE_OPENCV_VIDEO_RECORDING
@@ -217,6 +1155,7 @@ struct RecorderImplementation : public Recorder {
         for (size_t i = 0; i < number; i++) {
             auto frame = frameStore->next(height, width, type);
             if (!frame) {
+                framesDroppedPoolFull++;
                 frameDrop(time);
                 out.clear(); // Free already allocated frames
                 return false;
@@ -226,13 +1165,20 @@ struct RecorderImplementation : public Recorder {
         return true;
     }
 
+    // Shared between stereo, i.e. VIDEO_FRAME_CAPACITY mono frames, or half as many stereo pairs can
+    // be buffered in memory before frame skipping occurs if video encoding cannot keep up
+    static constexpr std::size_t VIDEO_FRAME_CAPACITY = 20;
+
     bool allocateAndWriteVideo(const std::vector<FrameData> &frames, bool cloneImage) {
         allocatedFrames.clear();
         // Allocate all frames, so if we don't have space for second frame of stereo, drop both
         for (auto f : frames) {
             if (f.frameData == nullptr) continue;
             auto frameUniqPtr = frameStore->next(f.frameData->rows, f.frameData->cols, f.frameData->type());
-            if (!frameUniqPtr) return false;
+            if (!frameUniqPtr) {
+                framesDroppedPoolFull++;
+                return false;
+            }
             cv::Mat allocatedFrameData = *frameUniqPtr.get();
             if (cloneImage)
                 f.frameData->copyTo(allocatedFrameData);
@@ -240,23 +1186,110 @@ struct RecorderImplementation : public Recorder {
                 allocatedFrameData = *f.frameData; // Doesn't copy data, cv::Mat as smart pointer
             allocatedFrames.push_back(allocatedFrameData);
         }
+        std::size_t allocated = 0;
         for (size_t i = 0; i < frames.size(); i++) {
             if (frames[i].frameData == nullptr) continue;
-            cv::Mat allocatedFrameData = allocatedFrames[i];
-            int cameraInd = frames[i].cameraInd;
-            if (!videoWriters.count(cameraInd)) {
-                videoWriters[cameraInd] = VideoWriter::build(videoOutputPrefix, cameraInd, fps, allocatedFrameData);
-                videoProcessors[cameraInd] = Processor::createThreadPool(1);
-            }
-            videoProcessors.at(cameraInd)->enqueue([this, cameraInd, allocatedFrameData]() {
-                videoWriters.at(cameraInd)->write(allocatedFrameData);
-            });
+            writeVideo(frames[i].cameraInd, allocatedFrames[allocated++], nullptr);
         }
         return true;
     }
+
+    // Post the frame to the video encoders, calling done once it is written
+    void writeVideo(int cameraInd, const cv::Mat &frame, const std::function<void()> &done) {
+        if (!videoWriters.count(cameraInd)) {
+            videoWriters[cameraInd] = VideoWriter::build(videoOutputPrefix, cameraInd, fps, frame, settings.videoFormat, videoSegment);
+            // Raw frames need no encoding and are written in order.
+            const bool raw = settings.videoFormat == VideoFormat::RAW;
+            videoProcessors[cameraInd] = Processor::createThreadPool(raw ? 1 : videoEncoderThreads);
+            videoFramesPosted[cameraInd] = 0;
+        }
+        // Frames are encoded in parallel and written in order of number.
+        VideoWriter *writer = videoWriters.at(cameraInd).get();
+        const std::size_t number = videoFramesPosted.at(cameraInd)++;
+        const Clock::time_point posted = Clock::now();
+        {
+            std::lock_guard<std::mutex> lock(statsMutex);
+            VideoState &video = videoStats[cameraInd];
+            if (video.posted++ == 0) video.windowStart = posted;
+        }
+        videoProcessors.at(cameraInd)->post([this, writer, number, frame, done, cameraInd, posted]() {
+            writer->write(number, frame);
+            frameEncoded(cameraInd, posted);
+            if (done) done();
+        });
+    }
+
+    void frameEncoded(int cameraInd, Clock::time_point posted) {
+        const Clock::time_point now = Clock::now();
+        std::lock_guard<std::mutex> lock(statsMutex);
+        VideoState &video = videoStats[cameraInd];
+        video.stats.frames++;
+        video.stats.latency.add(seconds(now - posted));
+        video.windowFrames++;
+        const double window = seconds(now - video.windowStart);
+        if (window >= 1.0) {
+            video.stats.fps = video.windowFrames / window;
+            video.windowStart = now;
+            video.windowFrames = 0;
+        }
+    }
+
+    static int matType(PixelFormat format) {
+        switch (format) {
+            case PixelFormat::GRAY8: return CV_8UC1;
+            case PixelFormat::BGR24: return CV_8UC3;
+            case PixelFormat::BGRA32: return CV_8UC4;
+        }
+        return CV_8UC1;
+    }
     #endif
 
+    // Encode caller-owned images without copying them. All or none of the
+    // images of a frame group are recorded.
+    bool writeImageBuffers(const FrameData *frames, const ImageBuffer *images, std::size_t n) {
+        #ifdef USE_OPENCV_VIDEO_RECORDING
+        if (!videoOutputPrefix.empty()) {
+            std::size_t count = 0;
+            for (std::size_t i = 0; i < n; ++i) {
+                if (images[i].data) count++;
+            }
+            if (imageBuffersPending.fetch_add(count) + count > VIDEO_FRAME_CAPACITY) {
+                imageBuffersPending -= count;
+                framesDroppedImagesPending++;
+                releaseImageBuffers(images, n);
+                return false;
+            }
+            for (std::size_t i = 0; i < n; ++i) {
+                const ImageBuffer &image = images[i];
+                if (!image.data) {
+                    if (image.release) image.release();
+                    continue;
+                }
+                // A header for the caller's memory, no copy
+                const cv::Mat frame(image.height, image.width, matType(image.format), const_cast<void*>(image.data), image.stride);
+                const std::function<void()> release = image.release;
+                writeVideo(frames[i].cameraInd, frame, [this, release]() {
+                    imageBuffersPending--;
+                    if (release) release();
+                });
+            }
+            return true;
+        }
+        #else
+        (void)frames;
+        #endif
+        releaseImageBuffers(images, n);
+        return true;
+    }
+
+    static void releaseImageBuffers(const ImageBuffer *images, std::size_t n) {
+        for (std::size_t i = 0; i < n; ++i) {
+            if (images[i].release) images[i].release();
+        }
+    }
+
     bool addFrame(const FrameData &f, bool cloneImage) final {
+        if (!videoOutputPrefix.empty()) startRequestedSegment();
         #ifdef USE_OPENCV_VIDEO_RECORDING
         if (!videoOutputPrefix.empty()) {
             const std::vector<FrameData> &frames{f};
@@ -266,21 +1299,31 @@ struct RecorderImplementation : public Recorder {
             }
         }
         #endif
+        pushFrame(f);
+        return true;
+    }
 
-        jsonlProcessor->enqueue([this, f]() { // f.frameData pointer no longer valid
-            setFrame(f);
-            workspace.jFrame["number"] = frameNumberGroup;
-            workspace.jFrameGroup["time"] = f.t;
-            workspace.jFrameGroup["number"] = frameNumberGroup;
-            workspace.jFrameGroup["frames"] = {};
-            workspace.jFrameGroup["frames"].push_back(workspace.jFrame);
-            output << workspace.jFrameGroup.dump() << std::endl;
-            frameNumberGroup++;
-        });
+    bool addFrame(const FrameData &f, const ImageBuffer &image) final {
+        if (!videoOutputPrefix.empty()) startRequestedSegment();
+        if (!writeImageBuffers(&f, &image, 1)) {
+            frameDrop(f.t);
+            return false;
+        }
+        pushFrame(f);
         return true;
     }
 
+    void pushFrame(const FrameData &f) {
+        Record r;
+        r.type = Record::Type::FRAME;
+        r.segment = videoSegment;
+        r.frame = f;
+        r.frame.frameData = nullptr; // not valid after this call
+        push(r);
+    }
+
     bool addFrameGroup(double t, const std::vector<FrameData> &frames, bool cloneImage) final {
+        if (!videoOutputPrefix.empty()) startRequestedSegment();
         #ifdef USE_OPENCV_VIDEO_RECORDING
         if (!videoOutputPrefix.empty()) {
             if (!allocateAndWriteVideo(frames, cloneImage)) {
@@ -289,66 +1332,49 @@ struct RecorderImplementation : public Recorder {
             }
         }
         #endif
+        pushFrameGroup(t, frames);
+        return true;
+    }
 
-        jsonlProcessor->enqueue([this, t, frames]() {
-            workspace.jFrameGroup["time"] = t;
-            workspace.jFrameGroup["number"] = frameNumberGroup;
-            workspace.jFrameGroup["frames"] = {};
-            for (auto f : frames) { // f.frameData pointer no longer valid
-                // Track frame numbers of each camera because some frame groups
-                // may only contain output from some of the cameras (happens on iOS).
-                try {
-                    frameNumbers.at(f.cameraInd)++;
-                } catch (const std::out_of_range &e) {
-                    frameNumbers[f.cameraInd] = 0;
-                }
-                setFrame(f);
-                workspace.jFrame["number"] = frameNumbers[f.cameraInd];
-                workspace.jFrameGroup["frames"].push_back(workspace.jFrame);
-            }
-            output << workspace.jFrameGroup.dump() << std::endl;
-            frameNumberGroup++;
-        });
+    bool addFrameGroup(double t, const std::vector<FrameData> &frames, const std::vector<ImageBuffer> &images) final {
+        assert(images.size() == frames.size());
+        if (!videoOutputPrefix.empty()) startRequestedSegment();
+        if (!writeImageBuffers(frames.data(), images.data(), std::min(frames.size(), images.size()))) {
+            frameDrop(t);
+            return false;
+        }
+        pushFrameGroup(t, frames);
         return true;
     }
 
-    void setPose(const Pose &pose, json &j, const std::string &name, bool hasOrientation) {
-        j["time"] = pose.time;
-        j[name]["position"]["x"] = pose.position.x;
-        j[name]["position"]["y"] = pose.position.y;
-        j[name]["position"]["z"] = pose.position.z;
+    void pushFrameGroup(double t, const std::vector<FrameData> &frames) {
+        Record r;
+        r.type = Record::Type::FRAME_GROUP;
+        r.segment = videoSegment;
+        r.frameGroup.t = t;
+        r.frameGroup.frames = payloads->frameGroups.acquire();
+        r.frameGroup.frames->assign(frames.begin(), frames.end());
+        push(r);
+    }
 
-        j[name].erase("orientation");
-        if (hasOrientation) {
-            j[name]["orientation"]["w"] = pose.orientation.w;
-            j[name]["orientation"]["x"] = pose.orientation.x;
-            j[name]["orientation"]["y"] = pose.orientation.y;
-            j[name]["orientation"]["z"] = pose.orientation.z;
-        }
+    void addPose(Record::Type type, const Pose &pose, const Vector3d &velocity) {
+        Record r;
+        r.type = type;
+        r.pose.pose = pose;
+        r.pose.velocity = velocity;
+        push(r);
     }
 
     void addARKit(const Pose &pose) final {
-        jsonlProcessor->enqueue([this, pose]() {
-            setPose(pose, workspace.jARKit, "ARKit", false);
-            output << workspace.jARKit.dump() << std::endl;
-        });
+        addPose(Record::Type::ARKIT, pose, {});
     }
 
     void addGroundTruth(const Pose &pose) final {
-        jsonlProcessor->enqueue([this, pose]() {
-            setPose(pose, workspace.jGroundTruth, "groundTruth", false);
-            output << workspace.jGroundTruth.dump() << std::endl;
-        });
+        addPose(Record::Type::GROUND_TRUTH, pose, {});
     }
 
     void addOdometryOutput(const Pose &pose, const Vector3d &velocity) final {
-        jsonlProcessor->enqueue([this, pose, velocity]() {
-            setPose(pose, workspace.jOutput, "output", true);
-            workspace.jOutput["output"]["velocity"]["x"] = velocity.x;
-            workspace.jOutput["output"]["velocity"]["y"] = velocity.y;
-            workspace.jOutput["output"]["velocity"]["z"] = velocity.z;
-            output << workspace.jOutput.dump() << std::endl;
-        });
+        addPose(Record::Type::ODOMETRY_OUTPUT, pose, velocity);
     }
 
     void addGps(
@@ -358,44 +1384,42 @@ struct RecorderImplementation : public Recorder {
         double horizontalUncertainty,
         double altitude) final
     {
-        jsonlProcessor->enqueue([this, t, latitude, longitude, horizontalUncertainty, altitude]() {
-            workspace.jGps["time"] = t;
-            workspace.jGps["gps"]["latitude"] = latitude;
-            workspace.jGps["gps"]["longitude"] = longitude;
-            // We have no standard for what "accuracy" means.
-            workspace.jGps["gps"]["accuracy"] = horizontalUncertainty;
-            workspace.jGps["gps"]["altitude"] = altitude;
-            output << workspace.jGps.dump() << std::endl;
-        });
+        Record r;
+        r.type = Record::Type::GPS;
+        r.gps = GpsData {
+          /* .t = */ t,
+          /* .latitude = */ latitude,
+          /* .longitude = */ longitude,
+          // We have no standard for what "accuracy" means.
+          /* .accuracy = */ horizontalUncertainty,
+          /* .altitude = */ altitude
+        };
+        push(r);
     }
 
     void addJsonString(const std::string &line) final {
-        jsonlProcessor->enqueue([this, line]() {
-            json j;
-            try {
-                j = json::parse(line);
-            } catch (const nlohmann::detail::parse_error &e) {
-                log_warn("recorder addLine(): Skipping invalid JSON: %s", line.c_str());
-                return;
-            }
-
-            // Make sure output is exactly one line.
-            size_t n = line.find('\n');
-            if (n == std::string::npos) {
-                output << line << std::endl;
-            } else if (n + 1 < line.size()) {
-                // Re-serialize multiline input.
-                output << j.dump() << std::endl;
-            } else {
-                output << line;
-            }
-        });
+        Record r;
+        r.type = Record::Type::JSON_STRING;
+        r.json.t = NAN;
+        r.json.text = payloads->strings.acquire();
+        r.json.text->assign(line);
+        push(r);
     }
 
     void addJson(const json &j) final {
-        jsonlProcessor->enqueue([this, j]() {
-            output << j.dump() << std::endl;
-        });
+        Record r;
+        r.type = Record::Type::JSON;
+        r.json.t = jsonTime(j);
+        // Serialized here rather than copied, which would allocate every node.
+        r.json.text = payloads->strings.acquire();
+        r.json.text->clear();
+        try {
+            serializeJson(*r.json.text, j);
+        } catch (...) {
+            payloads->strings.release(r.json.text);
+            throw;
+        }
+        push(r);
     }
 
     void setVideoRecordingFps(float f) final {
@@ -408,23 +1432,79 @@ struct RecorderImplementation : public Recorder {
 namespace recorder {
 
 std::unique_ptr<Recorder> Recorder::build(const std::string &outputPath) {
-    return std::unique_ptr<Recorder>(new RecorderImplementation(outputPath));
+    return build(outputPath, Settings());
 }
 
 std::unique_ptr<Recorder> Recorder::build(const std::string &outputPath, const std::string &videoOutputPath) {
+    return build(outputPath, videoOutputPath, Settings());
+}
+
+std::unique_ptr<Recorder> Recorder::build(std::ostream &output) {
+    return build(output, Settings());
+}
+
+std::unique_ptr<Recorder> Recorder::build(const std::string &outputPath, const Settings &settings) {
+    return std::unique_ptr<Recorder>(new RecorderImplementation(outputPath, settings));
+}
+
+std::unique_ptr<Recorder> Recorder::build(const std::string &outputPath, const std::string &videoOutputPath, const Settings &settings) {
     std::string videoOutputPrefix = "";
     if (!videoOutputPath.empty()) {
         assert(videoOutputPath.size() >= 4);
         assert(videoOutputPath.substr(videoOutputPath.size() - 4) == ".avi");
         videoOutputPrefix = videoOutputPath.substr(0, videoOutputPath.size() - 4);
     }
-    return std::unique_ptr<Recorder>(new RecorderImplementation(outputPath, videoOutputPrefix));
+    return std::unique_ptr<Recorder>(new RecorderImplementation(outputPath, videoOutputPrefix, settings));
 }
 
-std::unique_ptr<Recorder> Recorder::build(std::ostream &output) {
-    return std::unique_ptr<Recorder>(new RecorderImplementation(output));
+std::unique_ptr<Recorder> Recorder::build(std::ostream &output, const Settings &settings) {
+    return std::unique_ptr<Recorder>(new RecorderImplementation(output, settings));
 }
 
 Recorder::~Recorder() = default;
 
+void LatencyHistogram::add(double seconds) {
+    std::uint64_t micros = seconds > 0.0 ? static_cast<std::uint64_t>(seconds * 1e6) : 0;
+    std::size_t bucket = 0;
+    while (micros > 0 && bucket + 1 < BUCKETS) {
+        micros >>= 1;
+        bucket++;
+    }
+    counts[bucket]++;
+    count++;
+    totalSeconds += seconds;
+    maxSeconds = std::max(maxSeconds, seconds);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other) {
+    for (std::size_t i = 0; i < BUCKETS; ++i) counts[i] += other.counts[i];
+    count += other.count;
+    totalSeconds += other.totalSeconds;
+    maxSeconds = std::max(maxSeconds, other.maxSeconds);
+}
+
+double LatencyHistogram::meanSeconds() const {
+    return count > 0 ? totalSeconds / count : 0.0;
+}
+
+double LatencyHistogram::quantileSeconds(double q) const {
+    if (count == 0) return 0.0;
+    const double rank = std::min(std::max(q, 0.0), 1.0) * count;
+    std::uint64_t below = 0;
+    for (std::size_t i = 0; i + 1 < BUCKETS; ++i) {
+        below += counts[i];
+        if (below > 0 && below >= rank) return std::min(std::ldexp(1e-6, static_cast<int>(i)), maxSeconds);
+    }
+    return maxSeconds;
+}
+
+std::string segmentPath(const std::string &path, int segment) {
+    char number[16];
+    std::snprintf(number, sizeof(number), ".%04d", segment);
+    const std::size_t slash = path.find_last_of("/\\");
+    std::size_t dot = path.rfind('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) dot = path.size();
+    return path.substr(0, dot) + number + path.substr(dot);
+}
+
 } // namespace recorder
@@ -1,7 +1,10 @@
 #ifndef RECORDER_H_
 #define RECORDER_H_
 
+#include <array>
+#include <cstdint>
 #include <fstream>
+#include <map>
 #include <memory>
 #include <string>
 #include <vector>
@@ -12,6 +15,308 @@
 #include "types.hpp"
 
 namespace recorder {
+/**
+ * Controls when buffered JSONL output is handed to the output stream. Data is
+ * flushed when either limit is reached, on Recorder::flush() and on close.
+ */
+struct FlushPolicy {
+    /** Flush once this many bytes are buffered. 0 flushes after every record. */
+    std::size_t maxBytes = 64 * 1024;
+    /** Flush once the oldest buffered record is this old. Non-positive disables. */
+    double maxDelaySeconds = 0.5;
+    /**
+     * If positive, also sync the flushed data to the storage device
+     * (fdatasync) in the background every this many seconds, and on
+     * Recorder::flush() and close, so that a power loss loses about
+     * maxDelaySeconds + syncIntervalSeconds of data at most. Only for output
+     * to a file path, which is then written like with FileBackend::ASYNC.
+     * See JsonlReader::truncateTornRecord() for recovering such a file.
+     */
+    double syncIntervalSeconds = 0.0;
+};
+
+/**
+ * Splits a recording written to a file path into numbered segments, see
+ * segmentPath(). A new segment starts with the first record after either
+ * limit is reached, or with video recording, the first frame after that, so
+ * that the JSONL and video segments contain the same frames. Each segment is
+ * a complete recording: frame numbers restart from zero with video recording,
+ * and the time index and summary are written per segment. Zero disables a limit.
+ */
+struct SegmentPolicy {
+    /** Maximum size of a segment in bytes before compression, roughly */
+    std::uint64_t maxBytes = 0;
+    /** Maximum time span of the records of a segment in seconds */
+    double maxDurationSeconds = 0.0;
+};
+
+/**
+ * Writes the records in the order of their time rather than the order they
+ * were added, so that the time of the output never decreases. Each record is
+ * held until one newer by maxSpanSeconds has been added, or more than
+ * maxRecords are held, whichever comes first. A record older than one already
+ * written is dropped, and reported like the records dropped from a full queue
+ * (see Recorder::droppedRecords()). Frame records are never dropped, nor
+ * reordered among themselves, as the video frames are written in the order
+ * they were added: a late one is written out of order. Records without a time
+ * keep their place among the records added around them.
+ * Recorder::flush() writes out all held records. Zero disables a limit, and
+ * both zero disables reordering.
+ */
+struct ReorderWindow {
+    /** In record time, e.g., how late a GPS fix may arrive after the IMU */
+    double maxSpanSeconds = 0.0;
+    std::size_t maxRecords = 0;
+};
+
+/** Kinds of records in the JSONL output, see the add*() methods of Recorder */
+enum class Stream {
+    GYROSCOPE,
+    ACCELEROMETER,
+    GPS,
+    ARKIT,
+    GROUND_TRUTH,
+    ODOMETRY_OUTPUT,
+    /** addFrame() and addFrameGroup() */
+    FRAMES,
+    /** addJson() and addJsonString() */
+    JSON
+};
+
+/**
+ * What to do with a record added while the JSONL queue is full. Frame records
+ * (Stream::FRAMES) always BLOCK, as their video frames are already written.
+ */
+enum class OverflowPolicy {
+    /** Wait until the writer thread makes room */
+    BLOCK,
+    /** Drop the record being added */
+    DROP_NEWEST,
+    /**
+     * Drop the oldest queued record of the calling thread, which may belong
+     * to another stream. Wait if it is a frame record. Threads beyond the
+     * first eight share a queue and drop the newest record instead.
+     */
+    DROP_OLDEST,
+    /**
+     * Once the queue is half full, keep only every Settings::decimationFactor'th
+     * record of the stream. Drop the newest record if the queue is full.
+     */
+    DECIMATE
+};
+
+enum class Compression {
+    NONE,
+    /**
+     * Each flushed block of JSONL is written as an independent gzip member,
+     * so the output can be read with zcat or JsonlReader, and a truncated file
+     * is readable up to the last complete block. Compression runs on its own
+     * thread. Requires building with -DUSE_ZLIB_COMPRESSION=ON.
+     */
+    GZIP
+};
+
+enum class Format {
+    JSONL,
+    /**
+     * Compact little-endian binary records, several times smaller and faster
+     * to write and read than JSONL. JsonlReader reads both formats, and
+     * convertBinaryToJsonl() turns a binary recording into the equivalent
+     * JSONL file.
+     */
+    BINARY
+};
+
+enum class VideoFormat {
+    /** Motion JPEG in .avi files */
+    MJPEG,
+    /**
+     * Uncompressed frames, lossless and cheap to write but large, in .raw
+     * files (named like the .avi files otherwise would be). Each has an index
+     * file with ".index" appended to its name, with a JSON line per frame
+     * giving its number (as in the JSONL "frames" records) and its location:
+     *     {"cols":640,"number":0,"offset":0,"rows":480,"size":921600,"type":16}
+     * Type is the OpenCV matrix type, and rows are stored without padding.
+     */
+    RAW
+};
+
+/** How a recording written to a file path reaches the disk */
+enum class FileBackend {
+    /** std::ofstream, written by the JSONL writer thread */
+    STREAM,
+    /**
+     * Blocks are written asynchronously with a few in flight, so that
+     * writeback stalls of the page cache do not hold up the writer thread,
+     * and through it the add*() calls. Uses io_uring on Linux when the
+     * kernel supports it, otherwise pwrite() on a dedicated thread. Same as
+     * STREAM on other platforms. The blocks are as large as
+     * FlushPolicy::maxBytes allows.
+     */
+    ASYNC
+};
+
+struct Settings {
+    FlushPolicy flushPolicy;
+    Format format = Format::JSONL;
+    Compression compression = Compression::NONE;
+    /** zlib compression level, 1 (fastest) to 9 (smallest) */
+    int compressionLevel = 6;
+    /**
+     * Maximum number of records buffered between the add*() calls of one
+     * thread and the JSONL writer thread, rounded up to a power of two. Each
+     * calling thread has its own buffer, up to 8 of them, and any further
+     * threads share one. What happens when a buffer is full is controlled by
+     * the overflow policies below. Each stream with dropped records gets a
+     * "droppedRecords" line in the output.
+     */
+    std::size_t queueCapacity = 8192;
+    /** BLOCK by default, so that no record is lost, at the cost of add*() calls waiting */
+    OverflowPolicy overflowPolicy = OverflowPolicy::BLOCK;
+    /** Per-stream exceptions to overflowPolicy */
+    std::map<Stream, OverflowPolicy> streamOverflowPolicies;
+    unsigned decimationFactor = 2;
+    /**
+     * If positive, write a time index with buckets of this many seconds next
+     * to the output file (outputPath + ".index") when the recording is
+     * closed, for JsonlReader::readRange(). Only for uncompressed JSONL
+     * written to a file path.
+     */
+    double indexInterval = 0.0;
+    /**
+     * End the recording with a {"summary":{...}} record holding per-stream
+     * record counts, bytes, dropped records and time range, so that
+     * JsonlReader::getSummary() and getSmallestTimestamp() only need to
+     * read the end of the file.
+     */
+    bool writeSummary = false;
+    /**
+     * Split the recording into segments, which are opened ahead of time and
+     * closed in the background, so starting one does not block the add*()
+     * calls. With segments, closeOutputFile() only flushes the current one.
+     */
+    SegmentPolicy segmentPolicy;
+    ReorderWindow reorderWindow;
+    /**
+     * Threads JPEG compressing the video of each camera in parallel. The
+     * frames are still written in order. 0 uses one per CPU core. Not used
+     * with VideoFormat::RAW, which needs no encoding.
+     */
+    unsigned videoEncoderThreads = 0;
+    VideoFormat videoFormat = VideoFormat::MJPEG;
+    FileBackend fileBackend = FileBackend::STREAM;
+    /**
+     * With FileBackend::ASYNC on Linux, write with O_DIRECT, bypassing the
+     * page cache, if the file system supports it.
+     */
+    bool directIO = false;
+    /**
+     * If positive, write a {"recorderStats":{...},"time":...} record with a
+     * snapshot of Recorder::stats() this often, timed with the last record
+     * written before it, or without a time if there is none. JsonlReader
+     * passes it to onOther().
+     */
+    double statsIntervalSeconds = 0.0;
+};
+
+/**
+ * Distribution of durations in buckets whose bounds grow by powers of two:
+ * counts[0] holds durations under 1 microsecond, counts[i] those from
+ * 2^(i-1) up to 2^i microseconds, and the last bucket everything longer.
+ */
+struct LatencyHistogram {
+    static constexpr std::size_t BUCKETS = 24;
+    std::array<std::uint64_t, BUCKETS> counts = {};
+    std::uint64_t count = 0;
+    double totalSeconds = 0.0;
+    double maxSeconds = 0.0;
+
+    void add(double seconds);
+    void merge(const LatencyHistogram &other);
+    /** 0 if empty */
+    double meanSeconds() const;
+    /**
+     * Upper bound of the bucket holding quantile q (0 to 1) of the
+     * durations, at most maxSeconds. 0 if empty.
+     */
+    double quantileSeconds(double q) const;
+};
+
+/** Runtime statistics of a recording, see Recorder::stats() */
+struct RecorderStats {
+    /** Records in the JSONL queue, summed over the buffers of all threads */
+    std::size_t queueDepth = 0;
+    /** Maximum depth of a single thread's buffer so far */
+    std::size_t queueHighWater = 0;
+    /** Of each thread's buffer, see Settings::queueCapacity */
+    std::size_t queueCapacity = 0;
+    /** Per stream, from the add*() call until the record was serialized */
+    std::map<Stream, LatencyHistogram> queueLatency;
+    /** Per stream, time spent serializing each record */
+    std::map<Stream, LatencyHistogram> serializationTime;
+    /**
+     * Time the writer thread spent handing serialized blocks to the output,
+     * i.e., waiting for the file, compression or the output stream
+     */
+    LatencyHistogram outputTime;
+    /**
+     * Per stream, records that arrived later than Settings::reorderWindow
+     * allows. Included in the dropped records, except frame records.
+     */
+    std::map<Stream, std::size_t> lateRecords;
+    /** Records (JSONL lines) written, including the dropped record and stats lines */
+    std::uint64_t records = 0;
+    /** Bytes written, before compression */
+    std::uint64_t bytes = 0;
+    /** Blocks handed to the output by the FlushPolicy, Recorder::flush() or segments */
+    std::uint64_t blocks = 0;
+    /** Completed Recorder::flush() calls */
+    std::uint64_t flushes = 0;
+    /** Syncs started, see FlushPolicy::syncIntervalSeconds */
+    std::uint64_t syncs = 0;
+    /** See Recorder::unflushedBytes() */
+    std::size_t unflushedBytes = 0;
+
+    /** Occupancy of the pool of frames for video encoding, per frame shape */
+    struct FramePool {
+        /** OpenCV frame shape */
+        int rows, cols, type;
+        /** Frames allocated */
+        std::size_t capacity;
+        /** Frames waiting for, or being, encoded */
+        std::size_t inUse;
+        /** Maximum of inUse so far */
+        std::size_t highWater;
+        /** Frames not available because the pool was full */
+        std::size_t failures;
+    };
+    std::vector<FramePool> framePools;
+    /** Caller images of addFrame*() with an ImageBuffer waiting to be encoded */
+    std::size_t pendingImages = 0;
+
+    struct Video {
+        /** Frames encoded and written */
+        std::uint64_t frames = 0;
+        /** Frames waiting for, or being, encoded */
+        std::size_t pending = 0;
+        /** Encoded frames per second, over the last full second of encoding */
+        double fps = 0.0;
+        /** From the add*() call until the frame was written */
+        LatencyHistogram latency;
+    };
+    /** Per camera index */
+    std::map<int, Video> video;
+
+    /** Frames not recorded, by reason */
+    struct DroppedFrames {
+        /** No free frame in the pool, as video encoding cannot keep up */
+        std::size_t framePoolFull = 0;
+        /** Too many caller images waiting to be encoded, see pendingImages */
+        std::size_t imagesPending = 0;
+    };
+    DroppedFrames droppedFrames;
+};
+
 class Recorder {
 public:
     /**
@@ -44,16 +349,55 @@ public:
      * @ param output Stream to which output will be written.
      */
     static std::unique_ptr<Recorder> build(std::ostream &output);
+
+    // Variants of the above with non-default settings.
+    static std::unique_ptr<Recorder> build(const std::string &outputPath, const Settings &settings);
+    static std::unique_ptr<Recorder> build(const std::string &outputPath, const std::string &videoOutputPath, const Settings &settings);
+    static std::unique_ptr<Recorder> build(std::ostream &output, const Settings &settings);
     virtual ~Recorder();
 
     /**
-     * Flush and close output file.
+     * Flush and close output file. Unless the output is segmented, its
+     * summary and time index are written first, and records added after
+     * this are not included in them.
      */
     virtual void closeOutputFile() = 0;
+
+    /**
+     * Write everything added so far to the output and flush it, regardless of
+     * the FlushPolicy. Blocks until done.
+     */
+    virtual void flush() = 0;
+
+    /**
+     * Number of bytes serialized but not yet flushed to the output.
+     */
+    virtual std::size_t unflushedBytes() const = 0;
+
+    /**
+     * Number of records of the given stream dropped because the JSONL queue
+     * was full, or as older than Settings::reorderWindow allows. Does not
+     * include frames dropped due to video encoding.
+     */
+    virtual std::size_t droppedRecords(Stream stream) const = 0;
+    /**
+     * Snapshot of the runtime statistics of the recording so far, e.g., to
+     * tell whether the disk, the serialization or video encoding is the
+     * bottleneck. Thread safe. Latencies from the writer thread are updated
+     * after each batch of records it writes.
+     */
+    virtual RecorderStats stats() const = 0;
     virtual void addGyroscope(const GyroscopeData &d) = 0;
     virtual void addGyroscope(double t, double x, double y, double z) = 0;
     virtual void addAccelerometer(const AccelerometerData &d) = 0;
     virtual void addAccelerometer(double t, double x, double y, double z) = 0;
+
+    /**
+     * Add n consecutive samples at once, e.g., a FIFO burst from an IMU
+     * driver. Equivalent to, but much cheaper than, adding them one by one.
+     */
+    virtual void addGyroscopeBatch(const GyroscopeData *samples, std::size_t n) = 0;
+    virtual void addAccelerometerBatch(const AccelerometerData *samples, std::size_t n) = 0;
     virtual void addARKit(const Pose &pose) = 0;
     virtual void addGroundTruth(const Pose &pose) = 0;
     virtual void addOdometryOutput(const Pose &pose, const Vector3d &velocity) = 0;
@@ -78,6 +422,18 @@ public:
     virtual bool addFrame(const FrameData &f, bool cloneImage = true) = 0;
     virtual bool addFrameGroup(double t, const std::vector<FrameData> &frames, bool cloneImage = true) = 0;
 
+    /**
+     * Add a frame whose image the video encoder reads directly from caller
+     * memory, without copying it. image.release is called once the image has
+     * been encoded, or right away if it is not recorded (no video output, or
+     * the frame is dropped because encoding cannot keep up, in which case
+     * false is returned as above). Needs no OpenCV in the caller. The
+     * frameData of f is not used.
+     */
+    virtual bool addFrame(const FrameData &f, const ImageBuffer &image) = 0;
+    /** Like addFrame(const FrameData&, const ImageBuffer&), images[i] is the image of frames[i] */
+    virtual bool addFrameGroup(double t, const std::vector<FrameData> &frames, const std::vector<ImageBuffer> &images) = 0;
+
     /**
      * Write arbitrary serialized JSON into the recording.
      *
@@ -100,6 +456,22 @@ public:
      */
     virtual void setVideoRecordingFps(float fps) = 0;
 };
+
+/**
+ * Path of segment number segment (starting from 1) of a recording split with
+ * Settings::segmentPolicy. The number goes before the extension, e.g.
+ * "out.jsonl" becomes "out.0001.jsonl", and "video2.avi" "video2.0001.avi".
+ */
+std::string segmentPath(const std::string &path, int segment);
+
+/**
+ * Write a Format::BINARY recording (optionally gzip compressed) as JSONL,
+ * byte-identical to what a Format::JSONL recording of the same data would
+ * contain. Returns false if the input is not a binary recording or is
+ * truncated, in which case the complete records before the problem are
+ * still written.
+ */
+bool convertBinaryToJsonl(const std::string &binaryPath, std::ostream &jsonlOutput);
 } // namespace recorder
 
 #endif // RECORDER_H_
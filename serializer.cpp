@@ -0,0 +1,282 @@
+#include "serializer.hpp"
+#include "record.hpp"
+
+#include <cmath>
+#include <nlohmann/json.hpp>
+
+namespace recorder {
+namespace {
+// Keys are written in the alphabetical order nlohmann::json uses for objects.
+
+template <std::size_t N> void raw(std::string &out, const char (&s)[N]) {
+    out.append(s, N - 1);
+}
+
+void number(std::string &out, double x) {
+    if (!std::isfinite(x)) {
+        raw(out, "null");
+        return;
+    }
+    // Grisu2, the shortest round-trip formatting nlohmann::json::dump() uses.
+    char buf[64];
+    const char *end = nlohmann::detail::to_chars(buf, buf + sizeof(buf), x);
+    out.append(buf, end - buf);
+}
+
+void number(std::string &out, unsigned long long u, bool negative) {
+    char buf[24];
+    char *p = buf + sizeof(buf);
+    do {
+        *--p = static_cast<char>('0' + u % 10);
+        u /= 10;
+    } while (u > 0);
+    if (negative) *--p = '-';
+    out.append(p, buf + sizeof(buf) - p);
+}
+
+void number(std::string &out, int x) {
+    number(out, x < 0 ? 0ull - static_cast<unsigned long long>(x) : static_cast<unsigned long long>(x), x < 0);
+}
+
+void number(std::string &out, std::size_t x) {
+    number(out, static_cast<unsigned long long>(x), false);
+}
+
+void xyz(std::string &out, double x, double y, double z) {
+    raw(out, "{\"x\":");
+    number(out, x);
+    raw(out, ",\"y\":");
+    number(out, y);
+    raw(out, ",\"z\":");
+    number(out, z);
+    out.push_back('}');
+}
+
+void sensor(std::string &out, const char *type, double t, double x, double y, double z, double temperature) {
+    raw(out, "{\"sensor\":{");
+    if (temperature > 0.0) {
+        raw(out, "\"temperature\":");
+        number(out, temperature);
+        out.push_back(',');
+    }
+    raw(out, "\"type\":\"");
+    out.append(type);
+    raw(out, "\",\"values\":[");
+    number(out, x);
+    out.push_back(',');
+    number(out, y);
+    out.push_back(',');
+    number(out, z);
+    raw(out, "]},\"time\":");
+    number(out, t);
+    out.push_back('}');
+}
+
+void frame(std::string &out, const FrameData &f, int frameNumber) {
+    raw(out, "{\"cameraInd\":");
+    number(out, f.cameraInd);
+    const bool hasPrincipalPoint = f.px > 0.0 && f.py > 0.0;
+    if (f.focalLengthX > 0.0 || f.focalLengthY > 0.0 || hasPrincipalPoint) {
+        raw(out, ",\"cameraParameters\":{");
+        bool first = true;
+        const auto field = [&out, &first](const char *key, double value) {
+            if (!first) out.push_back(',');
+            first = false;
+            out.push_back('"');
+            out.append(key);
+            raw(out, "\":");
+            number(out, value);
+        };
+        if (f.focalLengthX > 0.0) field("focalLengthX", f.focalLengthX);
+        if (f.focalLengthY > 0.0) field("focalLengthY", f.focalLengthY);
+        if (hasPrincipalPoint) {
+            field("principalPointX", f.px);
+            field("principalPointY", f.py);
+        }
+        out.push_back('}');
+    }
+    raw(out, ",\"number\":");
+    number(out, frameNumber);
+    raw(out, ",\"time\":");
+    number(out, f.t);
+    out.push_back('}');
+}
+
+struct JsonlEncoder : RecordHandler {
+    std::string &out;
+    JsonlEncoder(std::string &out) : out(out) {}
+
+    void gyroscope(const GyroscopeData &d) final {
+        serializeGyroscope(out, d);
+        out.push_back('\n');
+    }
+
+    void accelerometer(const AccelerometerData &d) final {
+        serializeAccelerometer(out, d);
+        out.push_back('\n');
+    }
+
+    void gps(const GpsData &d) final {
+        serializeGps(out, d);
+        out.push_back('\n');
+    }
+
+    void arkit(const Pose &pose) final {
+        serializePosition(out, "ARKit", pose);
+        out.push_back('\n');
+    }
+
+    void groundTruth(const Pose &pose) final {
+        serializePosition(out, "groundTruth", pose);
+        out.push_back('\n');
+    }
+
+    void odometryOutput(const Pose &pose, const Vector3d &velocity) final {
+        serializeOdometryOutput(out, pose, velocity);
+        out.push_back('\n');
+    }
+
+    void frameGroup(double t, int groupNumber, const FrameData *frames, const int *frameNumbers, std::size_t n) final {
+        serializeFrameGroup(out, t, groupNumber, frames, frameNumbers, n);
+        out.push_back('\n');
+    }
+
+    void frameDrop(double t) final {
+        serializeFrameDrop(out, t);
+        out.push_back('\n');
+    }
+
+    void recordDrop(Stream stream, std::size_t count, double t) final {
+        serializeRecordDrop(out, stream, count, t);
+        out.push_back('\n');
+    }
+
+    void json(const char *data, std::size_t n) final {
+        out.append(data, n);
+        out.push_back('\n');
+    }
+};
+
+// Output of nlohmann::json::dump() to a string that may change between calls
+struct StringOutput : nlohmann::detail::output_adapter_protocol<char> {
+    std::string *out = nullptr;
+
+    void write_character(char c) final {
+        out->push_back(c);
+    }
+
+    void write_characters(const char *s, std::size_t n) final {
+        out->append(s, n);
+    }
+};
+} // anonymous namespace
+
+void serializeJson(std::string &out, const nlohmann::json &j) {
+    // Building a serializer allocates, so each thread keeps its own.
+    thread_local const auto output = std::make_shared<StringOutput>();
+    thread_local nlohmann::detail::serializer<nlohmann::json> serializer(output, ' ');
+    output->out = &out;
+    serializer.dump(j, false, false, 0);
+}
+
+const char *streamName(Stream stream) {
+    switch (stream) {
+        case Stream::GYROSCOPE: return "gyroscope";
+        case Stream::ACCELEROMETER: return "accelerometer";
+        case Stream::GPS: return "gps";
+        case Stream::ARKIT: return "ARKit";
+        case Stream::GROUND_TRUTH: return "groundTruth";
+        case Stream::ODOMETRY_OUTPUT: return "output";
+        case Stream::FRAMES: return "frames";
+        case Stream::JSON: return "json";
+    }
+    return "";
+}
+
+std::unique_ptr<RecordHandler> buildJsonlEncoder(std::string &out) {
+    return std::unique_ptr<RecordHandler>(new JsonlEncoder(out));
+}
+
+void serializeGyroscope(std::string &out, const GyroscopeData &d) {
+    sensor(out, "gyroscope", d.t, d.x, d.y, d.z, d.temperature);
+}
+
+void serializeAccelerometer(std::string &out, const AccelerometerData &d) {
+    sensor(out, "accelerometer", d.t, d.x, d.y, d.z, d.temperature);
+}
+
+void serializeGps(std::string &out, const GpsData &d) {
+    raw(out, "{\"gps\":{\"accuracy\":");
+    number(out, d.accuracy);
+    raw(out, ",\"altitude\":");
+    number(out, d.altitude);
+    raw(out, ",\"latitude\":");
+    number(out, d.latitude);
+    raw(out, ",\"longitude\":");
+    number(out, d.longitude);
+    raw(out, "},\"time\":");
+    number(out, d.t);
+    out.push_back('}');
+}
+
+void serializePosition(std::string &out, const char *name, const Pose &pose) {
+    raw(out, "{\"");
+    out.append(name);
+    raw(out, "\":{\"position\":");
+    xyz(out, pose.position.x, pose.position.y, pose.position.z);
+    raw(out, "},\"time\":");
+    number(out, pose.time);
+    out.push_back('}');
+}
+
+void serializeOdometryOutput(std::string &out, const Pose &pose, const Vector3d &velocity) {
+    raw(out, "{\"output\":{\"orientation\":{\"w\":");
+    number(out, pose.orientation.w);
+    raw(out, ",\"x\":");
+    number(out, pose.orientation.x);
+    raw(out, ",\"y\":");
+    number(out, pose.orientation.y);
+    raw(out, ",\"z\":");
+    number(out, pose.orientation.z);
+    raw(out, "},\"position\":");
+    xyz(out, pose.position.x, pose.position.y, pose.position.z);
+    raw(out, ",\"velocity\":");
+    xyz(out, velocity.x, velocity.y, velocity.z);
+    raw(out, "},\"time\":");
+    number(out, pose.time);
+    out.push_back('}');
+}
+
+void serializeFrameGroup(std::string &out, double t, int groupNumber, const FrameData *frames, const int *frameNumbers, std::size_t n) {
+    raw(out, "{\"frames\":[");
+    for (std::size_t i = 0; i < n; ++i) {
+        if (i > 0) out.push_back(',');
+        frame(out, frames[i], frameNumbers[i]);
+    }
+    raw(out, "],\"number\":");
+    number(out, groupNumber);
+    raw(out, ",\"time\":");
+    number(out, t);
+    out.push_back('}');
+}
+
+void serializeFrameDrop(std::string &out, double t) {
+    raw(out, "{\"droppedFrame\":true,\"time\":");
+    number(out, t);
+    out.push_back('}');
+}
+
+void serializeRecordDrop(std::string &out, Stream stream, std::size_t count, double t) {
+    raw(out, "{\"droppedRecords\":{\"count\":");
+    number(out, count);
+    raw(out, ",\"stream\":\"");
+    out.append(streamName(stream));
+    raw(out, "\"}");
+    if (!std::isnan(t)) {
+        raw(out, ",\"time\":");
+        number(out, t);
+    }
+    out.push_back('}');
+}
+
+} // namespace recorder
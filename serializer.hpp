@@ -0,0 +1,43 @@
+// private header file
+#ifndef JSONL_RECORDER_SERIALIZER_HPP
+#define JSONL_RECORDER_SERIALIZER_HPP
+#include <cstddef>
+#include <memory>
+#include <string>
+
+#include <nlohmann/json_fwd.hpp>
+#include "recorder.hpp"
+#include "types.hpp"
+
+namespace recorder {
+// Serializers for the built-in record types. Each appends exactly one JSON
+// object (without the trailing newline) to `out`, producing the same bytes
+// nlohmann::json::dump() would for the equivalent object, but without
+// building a JSON tree. Reusing `out` between calls avoids all allocation
+// once it has grown to the longest line.
+void serializeGyroscope(std::string &out, const GyroscopeData &d);
+void serializeAccelerometer(std::string &out, const AccelerometerData &d);
+void serializeGps(std::string &out, const GpsData &d);
+/** Pose without orientation, e.g. "ARKit" or "groundTruth" */
+void serializePosition(std::string &out, const char *name, const Pose &pose);
+void serializeOdometryOutput(std::string &out, const Pose &pose, const Vector3d &velocity);
+/**
+ * @param frameNumbers Per-camera frame number of each of the n frames
+ */
+void serializeFrameGroup(std::string &out, double t, int groupNumber, const FrameData *frames, const int *frameNumbers, std::size_t n);
+void serializeFrameDrop(std::string &out, double t);
+/** Records of the stream dropped since the previous such line, without a time if t is NaN */
+void serializeRecordDrop(std::string &out, Stream stream, std::size_t count, double t);
+
+/** Append j.dump() to out, without allocating a temporary string */
+void serializeJson(std::string &out, const nlohmann::json &j);
+
+/** Name of the stream in the output, e.g. in "droppedRecords" lines */
+const char *streamName(Stream stream);
+
+struct RecordHandler;
+/** RecordHandler that appends each record as a JSONL line to out */
+std::unique_ptr<RecordHandler> buildJsonlEncoder(std::string &out);
+} // namespace recorder
+
+#endif
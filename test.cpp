@@ -2,9 +2,27 @@
 #define CATCH_CONFIG_MAIN
 
 #include <catch2/catch.hpp>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <set>
 #include <sstream>
+#include <thread>
 
+#include "jsonl_reader.hpp"
 #include "recorder.hpp"
+#include "video.hpp"
+#include "multithreading/allocator.hpp"
+#include "multithreading/future.hpp"
+#include "multithreading/ring_buffer.hpp"
+#include "multithreading/staging_queue.hpp"
 
 TEST_CASE( "recorder", "[jsonl-recorder]" ) {
     // Write to file:
@@ -19,6 +37,7 @@ TEST_CASE( "recorder", "[jsonl-recorder]" ) {
 
     r->addGyroscope(0.1, 0.2, 0.3, 0.4);
     r->addGyroscope(0.2, 0.3, 0.5, 0.5);
+    r->flush();
 
     REQUIRE( output.str().find("gyroscope") != std::string::npos );
 
@@ -57,3 +76,1241 @@ TEST_CASE( "recorder", "[jsonl-recorder]" ) {
 
     // std::cout << output.str() << std::endl;
 }
+
+TEST_CASE( "flush policy", "[jsonl-recorder]" ) {
+    std::ostringstream output;
+    recorder::Settings settings;
+    settings.flushPolicy.maxBytes = 1 << 20;
+    settings.flushPolicy.maxDelaySeconds = 0.0;
+    auto r = recorder::Recorder::build(output, settings);
+
+    r->addGyroscope(0.1, 0.2, 0.3, 0.4);
+    r->addAccelerometer(0.1, 0.2, 0.3, 9.81);
+    REQUIRE( output.str().empty() );
+
+    r->flush();
+    REQUIRE( r->unflushedBytes() == 0 );
+    REQUIRE( output.str().find("gyroscope") != std::string::npos );
+    REQUIRE( output.str().find("accelerometer") != std::string::npos );
+}
+
+TEST_CASE( "runtime statistics", "[jsonl-recorder]" ) {
+    SECTION( "latency histogram" ) {
+        recorder::LatencyHistogram h;
+        REQUIRE( h.quantileSeconds(0.5) == 0.0 );
+        for (int i = 0; i < 99; ++i) h.add(3e-6);
+        h.add(0.5);
+        REQUIRE( h.count == 100 );
+        // [2, 4) microseconds
+        REQUIRE( h.counts[2] == 99 );
+        REQUIRE( h.quantileSeconds(0.5) == Approx(4e-6) );
+        REQUIRE( h.quantileSeconds(1.0) == 0.5 );
+        REQUIRE( h.meanSeconds() == Approx((99 * 3e-6 + 0.5) / 100) );
+        recorder::LatencyHistogram h2;
+        h2.add(2.0);
+        h.merge(h2);
+        REQUIRE( h.count == 101 );
+        REQUIRE( h.maxSeconds == 2.0 );
+    }
+
+    std::ostringstream output;
+    recorder::Settings settings;
+    settings.overflowPolicy = recorder::OverflowPolicy::BLOCK;
+    settings.flushPolicy.maxBytes = 1000;
+
+    SECTION( "counters" ) {
+        auto r = recorder::Recorder::build(output, settings);
+        for (int i = 0; i < 1000; ++i) r->addGyroscope(0.01 * i, 0.1, 0.2, 0.3);
+        r->addJson({ { "time", 20.0 }, { "a", 1 } });
+        r->flush();
+        const recorder::RecorderStats s = r->stats();
+        REQUIRE( s.queueLatency.at(recorder::Stream::GYROSCOPE).count == 1000 );
+        REQUIRE( s.queueLatency.at(recorder::Stream::JSON).count == 1 );
+        REQUIRE( s.serializationTime.at(recorder::Stream::GYROSCOPE).count == 1000 );
+        REQUIRE( s.queueLatency.count(recorder::Stream::GPS) == 0 );
+        REQUIRE( s.queueDepth == 0 );
+        REQUIRE( s.queueHighWater >= 1 );
+        REQUIRE( s.queueHighWater <= s.queueCapacity );
+        const std::string text = output.str();
+        REQUIRE( s.records == static_cast<std::uint64_t>(std::count(text.begin(), text.end(), '\n')) );
+        REQUIRE( s.bytes == text.size() );
+        REQUIRE( s.blocks > 1 );
+        REQUIRE( s.outputTime.count == s.blocks );
+        REQUIRE( s.flushes == 1 );
+        REQUIRE( s.unflushedBytes == 0 );
+    }
+
+    SECTION( "stats records" ) {
+        settings.statsIntervalSeconds = 0.001;
+        {
+            auto r = recorder::Recorder::build(output, settings);
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            for (int i = 0; i < 10; ++i) {
+                r->addGyroscope(100 + 0.01 * i, 0.1, 0.2, 0.3);
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            }
+        }
+        std::istringstream lines(output.str());
+        std::string line;
+        int count = 0;
+        bool timed = false;
+        while (std::getline(lines, line)) {
+            const nlohmann::json j = nlohmann::json::parse(line);
+            if (!j.count("recorderStats")) {
+                timed = true;
+                continue;
+            }
+            count++;
+            // The time of the last record written, if any
+            if (timed) {
+                REQUIRE( j.at("time").get<double>() >= 100.0 );
+            } else {
+                REQUIRE( j.count("time") == 0 );
+            }
+            REQUIRE( j.at("recorderStats").at("queue").at("capacity").get<std::size_t>() == 8192 );
+        }
+        REQUIRE( count > 0 );
+
+        const std::string path = "test_output.txt";
+        std::ofstream(path) << output.str();
+        JsonlReader reader;
+        REQUIRE( reader.getSmallestTimestamp(path) == 100.0 );
+    }
+}
+
+TEST_CASE( "serialized records match nlohmann::json", "[jsonl-recorder]" ) {
+    using json = nlohmann::json;
+    std::ostringstream output;
+    auto r = recorder::Recorder::build(output);
+
+    recorder::GyroscopeData g { 0.1, 1e-7, -0.3, 12345.678 };
+    g.temperature = 31.5;
+    r->addGyroscope(g);
+    r->addAccelerometer(2.0, 0.0, -9.81, 1.0 / 3.0);
+    r->addGps(3.25, 60.1867, 24.8277, 4.5, 12.0);
+    recorder::Pose pose { 4.0, { 1.0, 2.0, 3.0 }, { 0.0, 0.1, 0.2, 0.97 } };
+    r->addARKit(pose);
+    r->addOdometryOutput(pose, { -0.5, 0.25, 0.0 });
+    recorder::FrameData f0 { 5.0, 0, 1000.5, 1001.0, 640.0, 360.0 };
+    recorder::FrameData f1 { 5.0, 1, 0.0, 0.0, 0.0, 0.0 };
+    r->addFrameGroup(5.0, { f0, f1 });
+    const json custom = {{ "time", 6.0 }, { "note", "caf\u00e9 \"quoted\"" }, { "list", { 1, 2.5, nullptr }}};
+    r->addJson(custom);
+    r->flush();
+
+    std::vector<json> expected = {
+        {{ "time", 0.1 }, { "sensor", {{ "type", "gyroscope" }, { "values", { 1e-7, -0.3, 12345.678 }}, { "temperature", 31.5 }}}},
+        {{ "time", 2.0 }, { "sensor", {{ "type", "accelerometer" }, { "values", { 0.0, -9.81, 1.0 / 3.0 }}}}},
+        {{ "time", 3.25 }, { "gps", {{ "latitude", 60.1867 }, { "longitude", 24.8277 }, { "accuracy", 4.5 }, { "altitude", 12.0 }}}},
+        {{ "time", 4.0 }, { "ARKit", {{ "position", {{ "x", 1.0 }, { "y", 2.0 }, { "z", 3.0 }}}}}},
+        {{ "time", 4.0 }, { "output", {
+            { "position", {{ "x", 1.0 }, { "y", 2.0 }, { "z", 3.0 }}},
+            { "orientation", {{ "w", 0.97 }, { "x", 0.0 }, { "y", 0.1 }, { "z", 0.2 }}},
+            { "velocity", {{ "x", -0.5 }, { "y", 0.25 }, { "z", 0.0 }}}}}},
+        {{ "time", 5.0 }, { "number", 0 }, { "frames", {
+            {{ "time", 5.0 }, { "cameraInd", 0 }, { "number", 0 }, { "cameraParameters", {
+                { "focalLengthX", 1000.5 }, { "focalLengthY", 1001.0 },
+                { "principalPointX", 640.0 }, { "principalPointY", 360.0 }}}},
+            {{ "time", 5.0 }, { "cameraInd", 1 }, { "number", 0 }}}}},
+        custom,
+    };
+
+    std::istringstream lines(output.str());
+    std::string line;
+    for (const auto &e : expected) {
+        REQUIRE( std::getline(lines, line) );
+        REQUIRE( line == e.dump() );
+    }
+    REQUIRE( !std::getline(lines, line) );
+}
+
+TEST_CASE( "ring buffer", "[multithreading]" ) {
+    recorder::RingBuffer<int> ring(3);
+    REQUIRE( ring.capacity() == 4 );
+    for (int i = 0; i < 4; ++i) REQUIRE( ring.push(i) );
+    REQUIRE( !ring.push(4) );
+    REQUIRE( ring.size() == 4 );
+
+    int value = -1;
+    for (int i = 0; i < 4; ++i) {
+        REQUIRE( ring.pop(value) );
+        REQUIRE( value == i );
+    }
+    REQUIRE( !ring.pop(value) );
+    REQUIRE( ring.push(5) );
+    REQUIRE( ring.pop(value) );
+    REQUIRE( value == 5 );
+
+    REQUIRE( ring.push(6) );
+    REQUIRE( ring.pushMany(10, [](std::size_t i, int &v) { v = 7 + static_cast<int>(i); }) == 3 );
+    REQUIRE( ring.pushMany(1, [](std::size_t, int &v) { v = 0; }) == 0 );
+    for (int i = 6; i < 10; ++i) {
+        REQUIRE( ring.pop(value) );
+        REQUIRE( value == i );
+    }
+}
+
+TEST_CASE( "staging queue", "[multithreading]" ) {
+    recorder::StagingQueue<int> queue(4);
+    const auto key = [](int v) { return v; };
+    REQUIRE( queue.capacity() == 4 );
+    REQUIRE( &queue.local() == &queue.local() );
+    for (int v : { 1, 4, 5 }) REQUIRE( queue.local().push(v) );
+    std::thread([&queue]() {
+        for (int v : { 2, 3, 6 }) REQUIRE( queue.local().push(v) );
+    }).join();
+    REQUIRE( queue.size() == 6 );
+
+    int value = -1;
+    for (int i = 1; i <= 6; ++i) {
+        REQUIRE( queue.pop(value, key) );
+        REQUIRE( value == i );
+    }
+    REQUIRE( !queue.pop(value, key) );
+    REQUIRE( queue.size() == 0 );
+}
+
+TEST_CASE( "processor post and barrier", "[multithreading]" ) {
+    auto processor = recorder::Processor::createThreadPool(3);
+    std::atomic<int> done(0);
+    for (int i = 0; i < 100; ++i) {
+        processor->post([&done]() {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+            done++;
+        });
+    }
+    processor->barrier().wait();
+    REQUIRE( done.load() == 100 );
+    processor->barrier().wait();
+}
+
+TEST_CASE( "buffer pool", "[multithreading]" ) {
+    SECTION( "reuses released buffers" ) {
+        recorder::Allocator<std::string> pool(0, 2, 4);
+        std::string *a = pool.acquire();
+        a->assign(100, 'x');
+        const char *data = a->data();
+        pool.release(a);
+        std::string *b = pool.acquire();
+        REQUIRE( b == a );
+        REQUIRE( b->data() == data );
+        pool.release(b);
+        REQUIRE( pool.stats().capacity == 2 );
+        REQUIRE( pool.stats().inUse == 0 );
+        REQUIRE( pool.stats().highWater == 1 );
+        REQUIRE( pool.stats().acquired == 2 );
+    }
+
+    SECTION( "falls back to the heap when full" ) {
+        recorder::Allocator<std::vector<int> > pool(0, 3, 4);
+        std::vector<std::vector<int>*> held;
+        for (int i = 0; i < 6; ++i) held.push_back(pool.acquire());
+        REQUIRE( std::set<std::vector<int>*>(held.begin(), held.end()).size() == 6 );
+        auto stats = pool.stats();
+        REQUIRE( stats.capacity == 4 );
+        REQUIRE( stats.inUse == 6 );
+        REQUIRE( stats.overflows == 2 );
+        for (auto *v : held) pool.release(v);
+        REQUIRE( pool.stats().inUse == 0 );
+    }
+
+    SECTION( "steady state from many threads" ) {
+        recorder::Allocator<std::string> pool(0, 4, 64);
+        std::vector<std::thread> threads;
+        std::atomic<bool> corrupted(false);
+        for (int i = 0; i < 4; ++i) {
+            threads.emplace_back([&pool, &corrupted, i]() {
+                for (int j = 0; j < 20000; ++j) {
+                    std::string *s = pool.acquire();
+                    s->assign(16 + i, static_cast<char>('a' + i));
+                    std::this_thread::yield();
+                    if (*s != std::string(16 + i, static_cast<char>('a' + i))) corrupted = true;
+                    pool.release(s);
+                }
+            });
+        }
+        for (auto &t : threads) t.join();
+        const auto stats = pool.stats();
+        REQUIRE( !corrupted );
+        REQUIRE( stats.acquired == 80000 );
+        REQUIRE( stats.inUse == 0 );
+        REQUIRE( stats.highWater <= 4 );
+        REQUIRE( stats.overflows == 0 );
+        REQUIRE( stats.capacity <= 8 );
+    }
+}
+
+namespace {
+// String output that blocks writing until opened, to simulate a stalled disk.
+class GatedStringBuf : public std::stringbuf {
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool open = false;
+
+protected:
+    std::streamsize xsputn(const char *s, std::streamsize n) override {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [this] { return open; });
+        return std::stringbuf::xsputn(s, n);
+    }
+
+public:
+    void setOpen() {
+        std::lock_guard<std::mutex> lock(mutex);
+        open = true;
+        condition.notify_all();
+    }
+};
+}
+
+TEST_CASE( "queue overflow policies", "[jsonl-recorder]" ) {
+    GatedStringBuf buf;
+    std::ostream output(&buf);
+    recorder::Settings settings;
+    settings.flushPolicy.maxBytes = 0;
+    settings.queueCapacity = 4;
+    settings.overflowPolicy = recorder::OverflowPolicy::DROP_NEWEST;
+    settings.streamOverflowPolicies[recorder::Stream::GYROSCOPE] = recorder::OverflowPolicy::DROP_OLDEST;
+    auto r = recorder::Recorder::build(output, settings);
+
+    for (int i = 0; i < 100; ++i) r->addGyroscope(i, i, 0.0, 0.0);
+    for (int i = 0; i < 100; ++i) r->addAccelerometer(i, i, 0.0, 0.0);
+    REQUIRE( r->droppedRecords(recorder::Stream::GYROSCOPE) >= 90 );
+    REQUIRE( r->droppedRecords(recorder::Stream::ACCELEROMETER) >= 90 );
+    REQUIRE( r->droppedRecords(recorder::Stream::GPS) == 0 );
+
+    buf.setOpen();
+    r->flush();
+    const std::string s = buf.str();
+    // The newest gyroscope samples are kept, the newest accelerometer samples are not.
+    REQUIRE( s.find("\"values\":[99.0,0.0,0.0]") != std::string::npos );
+    REQUIRE( s.find("\"type\":\"accelerometer\",\"values\":[99.0,0.0,0.0]") == std::string::npos );
+    REQUIRE( s.find("\"stream\":\"gyroscope\"},\"time\":") != std::string::npos );
+    REQUIRE( s.find("\"stream\":\"accelerometer\"},\"time\":99.0}") != std::string::npos );
+}
+
+TEST_CASE( "frame records are never dropped", "[jsonl-recorder]" ) {
+    GatedStringBuf buf;
+    std::ostream output(&buf);
+    recorder::Settings settings;
+    settings.flushPolicy.maxBytes = 0;
+    settings.queueCapacity = 16;
+    settings.overflowPolicy = recorder::OverflowPolicy::DROP_OLDEST;
+    settings.streamOverflowPolicies[recorder::Stream::FRAMES] = recorder::OverflowPolicy::DROP_NEWEST;
+    auto r = recorder::Recorder::build(output, settings);
+    // Blocks the writer until the output is opened
+    r->addGyroscope(-1.0, 0.0, 0.0, 0.0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+
+    // The queue fills up, its two oldest gyroscope records are dropped, and
+    // then a frame record is the oldest one, with another one behind it.
+    std::thread producer([&r]() {
+        for (int j = 0; j < 2; ++j) r->addGyroscope(-0.5 + 0.01 * j, 0.0, 0.0, 0.0);
+        for (int i = 0; i < 20; ++i) {
+            r->addFrame({ 1.0 * i, 0, 500.0, 500.0, 320.0, 240.0 });
+            for (int j = 0; j < 8; ++j) r->addGyroscope(i + 0.01 * j, 0.0, 0.0, 0.0);
+        }
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    buf.setOpen();
+    producer.join();
+    r->flush();
+    REQUIRE( r->droppedRecords(recorder::Stream::GYROSCOPE) > 0 );
+    REQUIRE( r->droppedRecords(recorder::Stream::FRAMES) == 0 );
+    std::istringstream lines(buf.str());
+    std::string line;
+    int frames = 0;
+    while (std::getline(lines, line)) {
+        const nlohmann::json j = nlohmann::json::parse(line);
+        if (!j.count("frames")) continue;
+        // In order, so that the numbers match the video frames
+        REQUIRE( j["number"].get<int>() == frames );
+        REQUIRE( j["time"].get<double>() == 1.0 * frames );
+        frames++;
+    }
+    REQUIRE( frames == 20 );
+}
+
+TEST_CASE( "frames from caller-owned buffers", "[jsonl-recorder]" ) {
+    std::ostringstream output, expected;
+    auto r = recorder::Recorder::build(output);
+    std::vector<unsigned char> pixels(4 * 3, 7);
+    std::atomic<int> released(0);
+    recorder::ImageBuffer image;
+    image.data = pixels.data();
+    image.width = 4;
+    image.height = 3;
+    image.stride = 4;
+    image.release = [&released]() { released++; };
+
+    recorder::FrameData f0 { 1.0, 0, 500.0, 500.0, 2.0, 1.5 };
+    recorder::FrameData f1 { 1.0, 1, 0.0, 0.0, 0.0, 0.0 };
+    REQUIRE( r->addFrame(f0, image) );
+    REQUIRE( r->addFrameGroup(2.0, { f0, f1 }, { image, recorder::ImageBuffer() }) );
+    r->flush();
+    // Released exactly once each, right away without video output
+    REQUIRE( released.load() == 2 );
+
+    auto r2 = recorder::Recorder::build(expected);
+    r2->addFrame(f0);
+    r2->addFrameGroup(2.0, { f0, f1 });
+    r2->flush();
+    REQUIRE( output.str() == expected.str() );
+}
+
+TEST_CASE( "batch ingestion", "[jsonl-recorder]" ) {
+    std::vector<recorder::GyroscopeData> gyro;
+    std::vector<recorder::AccelerometerData> acc;
+    for (int i = 0; i < 50; ++i) {
+        gyro.push_back({ 0.001 * i, 0.1 * i, 0.2, 0.3 });
+        acc.push_back({ 0.001 * i, 0.1, 0.2 * i, 9.81 });
+    }
+
+    std::ostringstream batched, single;
+    auto r = recorder::Recorder::build(batched);
+    r->addGyroscopeBatch(gyro.data(), gyro.size());
+    r->addAccelerometerBatch(acc.data(), acc.size());
+    r->flush();
+
+    auto r2 = recorder::Recorder::build(single);
+    for (const auto &g : gyro) r2->addGyroscope(g);
+    for (const auto &a : acc) r2->addAccelerometer(a);
+    r2->flush();
+
+    REQUIRE( !batched.str().empty() );
+    REQUIRE( batched.str() == single.str() );
+}
+
+TEST_CASE( "concurrent producers", "[jsonl-recorder]" ) {
+    // More threads than there are per-thread buffers
+    constexpr int THREADS = 12;
+    constexpr int SAMPLES = 2000;
+    std::ostringstream output;
+    recorder::Settings settings;
+    settings.queueCapacity = 64;
+    settings.overflowPolicy = recorder::OverflowPolicy::BLOCK;
+    auto r = recorder::Recorder::build(output, settings);
+
+    std::vector<std::thread> threads;
+    for (int thread = 0; thread < THREADS; ++thread) {
+        threads.emplace_back([&r, thread]() {
+            for (int i = 0; i < SAMPLES; ++i) r->addGyroscope(i, thread, 0.0, 0.0);
+        });
+    }
+    for (auto &t : threads) t.join();
+    // Everything the other threads added is written before the flush resolves.
+    r->flush();
+
+    std::array<int, THREADS> next = {};
+    JsonlReader reader;
+    reader.onGyroscope = [&](double t, double x, double, double) {
+        const int thread = static_cast<int>(x);
+        REQUIRE( t == next[thread] );
+        next[thread]++;
+    };
+    const std::string path = "test_output.txt";
+    std::ofstream(path) << output.str();
+    reader.read(path);
+    for (int n : next) REQUIRE( n == SAMPLES );
+    REQUIRE( r->droppedRecords(recorder::Stream::GYROSCOPE) == 0 );
+}
+
+TEST_CASE( "reorder window", "[jsonl-recorder]" ) {
+    std::ostringstream output;
+    recorder::Settings settings;
+    std::size_t lines = 0;
+    const auto requireOrdered = [&]() {
+        std::istringstream input(output.str());
+        std::string line;
+        double lastTime = -INFINITY;
+        while (std::getline(input, line)) {
+            const nlohmann::json j = nlohmann::json::parse(line);
+            lines++;
+            if (!j.count("time")) continue;
+            const double t = j.at("time").get<double>();
+            REQUIRE( t >= lastTime );
+            lastTime = t;
+        }
+    };
+
+    SECTION( "by time" ) {
+        settings.reorderWindow.maxSpanSeconds = 0.05;
+        auto r = recorder::Recorder::build(output, settings);
+        for (int i = 0; i < 100; ++i) {
+            r->addGyroscope(0.01 * i, 0.1, 0.2, 0.3);
+            // Late, but within the window
+            if (i % 10 == 9) r->addGps(0.01 * i - 0.03, 60.0, 25.0, 1.0, 0.0);
+            if (i == 50) {
+                r->addJsonString("{\"time\":0.48,\n\"a\":1}");
+                r->addJson({ { "b", 2 } });
+            }
+        }
+        // Later than the window allows
+        r->addGps(0.2, 60.0, 25.0, 1.0, 0.0);
+        r->flush();
+        requireOrdered();
+        // and a droppedRecords line for the late GPS fix
+        REQUIRE( lines == 100 + 10 + 2 + 1 );
+        REQUIRE( output.str().find("\"stream\":\"gps\"") != std::string::npos );
+        REQUIRE( r->droppedRecords(recorder::Stream::GPS) == 1 );
+        const recorder::RecorderStats s = r->stats();
+        REQUIRE( s.lateRecords.size() == 1 );
+        REQUIRE( s.lateRecords.at(recorder::Stream::GPS) == 1 );
+        REQUIRE( output.str().find("{\"a\":1,\"time\":0.48}") != std::string::npos );
+    }
+
+    SECTION( "late frames are kept" ) {
+        settings.reorderWindow.maxSpanSeconds = 0.05;
+        auto r = recorder::Recorder::build(output, settings);
+        for (int i = 0; i < 100; ++i) r->addGyroscope(0.01 * i, 0.1, 0.2, 0.3);
+        r->addFrame({ 0.2, 0, 500.0, 500.0, 320.0, 240.0 });
+        r->addFrame({ 0.1, 0, 500.0, 500.0, 320.0, 240.0 });
+        r->flush();
+        const std::string text = output.str();
+        const std::size_t first = text.find("\"number\":0");
+        const std::size_t second = text.find("\"number\":1");
+        REQUIRE( first != std::string::npos );
+        REQUIRE( second != std::string::npos );
+        // In the order they were added, as their video frames
+        REQUIRE( text.find("\"time\":0.2", first) < second );
+        REQUIRE( r->droppedRecords(recorder::Stream::FRAMES) == 0 );
+        REQUIRE( r->stats().lateRecords.at(recorder::Stream::FRAMES) == 2 );
+    }
+
+    SECTION( "drops before anything is written" ) {
+        settings.reorderWindow.maxSpanSeconds = 10.0;
+        settings.queueCapacity = 2;
+        settings.overflowPolicy = recorder::OverflowPolicy::DROP_NEWEST;
+        auto r = recorder::Recorder::build(output, settings);
+        for (int i = 0; i < 1000; ++i) r->addGyroscope(100 + 0.001 * i, 0.1, 0.2, 0.3);
+        // Reported while all the records are still held
+        std::this_thread::sleep_for(std::chrono::milliseconds(30));
+        r->flush();
+        REQUIRE( r->droppedRecords(recorder::Stream::GYROSCOPE) > 0 );
+        std::istringstream input(output.str());
+        std::string line;
+        std::getline(input, line);
+        REQUIRE( line.find("{\"droppedRecords\":") == 0 );
+        REQUIRE( line.find("\"time\"") == std::string::npos );
+        while (std::getline(input, line)) {
+            const nlohmann::json j = nlohmann::json::parse(line);
+            if (j.count("time")) REQUIRE( j.at("time").get<double>() >= 100.0 );
+        }
+    }
+
+    SECTION( "by count" ) {
+        settings.reorderWindow.maxRecords = 4;
+        auto r = recorder::Recorder::build(output, settings);
+        for (int i = 0; i < 20; ++i) {
+            r->addGyroscope(i, 0.1, 0.2, 0.3);
+            if (i > 0) r->addAccelerometer(i - 1, 0.0, 0.0, 9.81);
+        }
+        r->flush();
+        requireOrdered();
+        REQUIRE( lines == 20 + 19 );
+        REQUIRE( r->stats().lateRecords.empty() );
+    }
+}
+
+namespace {
+void recordAndReadBack(const recorder::Settings &settings) {
+    const std::string path = "test_output.txt";
+    {
+        auto r = recorder::Recorder::build(path, settings);
+        for (int i = 0; i < 1000; ++i) {
+            r->addGyroscope(0.001 * i, 0.1, 0.2, 0.3);
+            r->addAccelerometer(0.001 * i, 0.0, 0.0, 9.81);
+            if (i % 33 == 0) r->addFrame({ 0.001 * i, 0, 500.0, 500.0, 320.0, 240.0 });
+        }
+    }
+
+    int nGyroscope = 0, nAccelerometer = 0, nFrames = 0;
+    double lastTime = -1.0;
+    JsonlReader reader;
+    reader.onGyroscope = [&](double t, double, double, double) {
+        REQUIRE( t > lastTime );
+        lastTime = t;
+        nGyroscope++;
+    };
+    reader.onAccelerometer = [&](double, double, double, double z) {
+        REQUIRE( z == 9.81 );
+        nAccelerometer++;
+    };
+    reader.onFrames = [&](std::vector<JsonlReader::FrameParameters> frames) {
+        REQUIRE( frames.size() == 1 );
+        REQUIRE( frames[0].focalLengthX == 500.0 );
+        nFrames++;
+    };
+    reader.read(path);
+    REQUIRE( nGyroscope == 1000 );
+    REQUIRE( nAccelerometer == 1000 );
+    REQUIRE( nFrames == 31 );
+    REQUIRE( reader.getSmallestTimestamp(path) == 0.0 );
+}
+}
+
+TEST_CASE( "read back recording", "[jsonl-reader]" ) {
+    recorder::Settings settings;
+    settings.flushPolicy.maxBytes = 4096;
+    SECTION( "plain" ) {
+        recordAndReadBack(settings);
+    }
+    SECTION( "binary" ) {
+        settings.format = recorder::Format::BINARY;
+        recordAndReadBack(settings);
+    }
+#ifdef USE_ZLIB_COMPRESSION
+    SECTION( "gzip" ) {
+        settings.compression = recorder::Compression::GZIP;
+        recordAndReadBack(settings);
+    }
+#else
+    SECTION( "gzip falls back to plain without zlib" ) {
+        settings.compression = recorder::Compression::GZIP;
+        recordAndReadBack(settings);
+    }
+#endif
+}
+
+TEST_CASE( "missing file", "[jsonl-reader]" ) {
+    const std::string path = "test_output_missing.txt";
+    std::remove(path.c_str());
+    int records = 0;
+    JsonlReader reader;
+    reader.onGyroscope = [&](double, double, double, double) { records++; };
+    reader.onOther = [&](double, const char *, std::size_t) { records++; };
+    SECTION( "single thread" ) {}
+    SECTION( "parallel" ) {
+        reader.threads = 4;
+    }
+    reader.read(path);
+    reader.readRange(path, 0.0, 1.0);
+    REQUIRE( records == 0 );
+    const JsonlReader::Summary summary = reader.getSummary(path);
+    REQUIRE( summary.streams.empty() );
+    REQUIRE( std::isinf(reader.getSmallestTimestamp(path)) );
+}
+
+TEST_CASE( "reader accepts any key order and number format", "[jsonl-reader]" ) {
+    const std::string path = "test_output.txt";
+    {
+        std::ofstream f(path);
+        f << R"({"time":1,"sensor":{"values":[1,2,3],"type":"gyroscope","extra":[{"a":null}]}})" "\n";
+        f << R"({"sensor":{"type":"accelerometer","values":[0.5,-1e2,9.81]},"time":1.5})" "\n";
+        f << R"({"gps":{"latitude":60.1,"longitude":24.9},"time":1.6})" "\n";
+        f << R"({"frames":[{"cameraInd":1,"time":2.0},{"cameraParameters":{"focalLength":400,"principalPointX":320.5,"principalPointY":240},"cameraInd":0}],"number":3,"time":2})" "\n";
+        f << R"({"time":3,"frames":[{"cameraInd":0,"cameraParameters":{"focalLengthX":500,"focalLengthY":501,"focalLength":400}}]})" "\n";
+        f << R"({"recordDrop":{"stream":"frames","count":2},"time":4})" "\n";
+    }
+
+    std::vector<std::array<double, 4> > gyro, acc;
+    std::vector< std::vector<JsonlReader::FrameParameters> > frames;
+    JsonlReader reader;
+    reader.onGyroscope = [&](double t, double x, double y, double z) { gyro.push_back({ t, x, y, z }); };
+    reader.onAccelerometer = [&](double t, double x, double y, double z) { acc.push_back({ t, x, y, z }); };
+    reader.onFrames = [&](std::vector<JsonlReader::FrameParameters> f) { frames.push_back(f); };
+    reader.read(path);
+
+    REQUIRE( gyro.size() == 1 );
+    REQUIRE( gyro[0] == (std::array<double, 4> { 1.0, 1.0, 2.0, 3.0 }) );
+    REQUIRE( acc.size() == 1 );
+    REQUIRE( acc[0] == (std::array<double, 4> { 1.5, 0.5, -100.0, 9.81 }) );
+    REQUIRE( frames.size() == 2 );
+    REQUIRE( frames[0].size() == 2 );
+    REQUIRE( frames[0][0].time == 2.0 );
+    REQUIRE( frames[0][0].focalLengthX == 400.0 );
+    REQUIRE( frames[0][0].focalLengthY == 400.0 );
+    REQUIRE( frames[0][0].principalPointX == 320.5 );
+    REQUIRE( frames[0][0].principalPointY == 240.0 );
+    REQUIRE( frames[0][1].focalLengthX == -1.0 );
+    REQUIRE( frames[1][0].focalLengthX == 500.0 );
+    REQUIRE( frames[1][0].focalLengthY == 501.0 );
+}
+
+TEST_CASE( "typed callbacks", "[jsonl-reader]" ) {
+    const std::string path = "test_output.txt";
+    recorder::Settings settings;
+    JsonlReader reader;
+    SECTION( "jsonl" ) {}
+    SECTION( "binary" ) {
+        settings.format = recorder::Format::BINARY;
+    }
+    SECTION( "parallel" ) {
+        reader.threads = 2;
+    }
+    {
+        auto r = recorder::Recorder::build(path, settings);
+        for (int i = 0; i < 10; ++i) {
+            const double t = 0.1 * i;
+            r->addGps(t, 60.18, 24.83, 5.0, NAN);
+            recorder::Pose pose = { t, { 1.0, 2.0, 3.0 }, { 0.1, 0.2, 0.3, 0.9 } };
+            r->addARKit(pose);
+            r->addGroundTruth(pose);
+            r->addOdometryOutput(pose, { 0.5, 0.0, -0.5 });
+            r->addJson({ { "custom", i }, { "time", t } });
+            r->addJsonString("{\"noTime\":true}");
+        }
+    }
+
+    int nGps = 0, nARKit = 0, nGroundTruth = 0, nOutput = 0, nTimed = 0, nUntimed = 0;
+    reader.onGps = [&](const recorder::GpsData &d) {
+        REQUIRE( d.t == 0.1 * nGps );
+        REQUIRE( d.latitude == 60.18 );
+        REQUIRE( d.accuracy == 5.0 );
+        REQUIRE( std::isnan(d.altitude) );
+        nGps++;
+    };
+    reader.onARKit = [&](const recorder::Pose &pose) {
+        REQUIRE( pose.position.z == 3.0 );
+        REQUIRE( std::isnan(pose.orientation.w) );
+        nARKit++;
+    };
+    reader.onGroundTruth = [&](const recorder::Pose &pose) {
+        REQUIRE( pose.time == 0.1 * nGroundTruth );
+        nGroundTruth++;
+    };
+    reader.onOdometryOutput = [&](const recorder::Pose &pose, const recorder::Vector3d &velocity) {
+        REQUIRE( pose.orientation.w == 0.9 );
+        REQUIRE( pose.orientation.x == 0.1 );
+        REQUIRE( velocity.z == -0.5 );
+        nOutput++;
+    };
+    reader.onOther = [&](double t, const char *line, std::size_t n) {
+        const std::string s(line, n);
+        if (std::isnan(t)) {
+            REQUIRE( s == "{\"noTime\":true}" );
+            nUntimed++;
+        } else {
+            REQUIRE( s == "{\"custom\":" + std::to_string(nTimed) + ",\"time\":" + nlohmann::json(t).dump() + "}" );
+            nTimed++;
+        }
+    };
+    reader.read(path);
+    REQUIRE( nGps == 10 );
+    REQUIRE( nARKit == 10 );
+    REQUIRE( nGroundTruth == 10 );
+    REQUIRE( nOutput == 10 );
+    REQUIRE( nTimed == 10 );
+    REQUIRE( nUntimed == 10 );
+}
+
+TEST_CASE( "parallel read", "[jsonl-reader]" ) {
+    const std::string path = "test_output.txt";
+    const int n = 20000;
+    {
+        recorder::Settings settings;
+        settings.overflowPolicy = recorder::OverflowPolicy::BLOCK;
+        auto r = recorder::Recorder::build(path, settings);
+        for (int i = 0; i < n; ++i) {
+            r->addGyroscope(0.001 * i, 0.1, 0.2, 0.3);
+            r->addAccelerometer(0.001 * i, 0.0, 0.0, 9.81);
+            if (i % 33 == 0) r->addFrame({ 0.001 * i, 0, 500.0, 500.0, 320.0, 240.0 });
+        }
+    }
+
+    JsonlReader reader;
+    reader.threads = 4;
+    SECTION( "ordered" ) {
+        std::vector<double> times;
+        int nFrames = 0;
+        reader.onGyroscope = [&](double t, double, double, double) { times.push_back(t); };
+        reader.onFrames = [&](std::vector<JsonlReader::FrameParameters>) { nFrames++; };
+        reader.read(path);
+        REQUIRE( times.size() == n );
+        for (int i = 0; i < n; ++i) REQUIRE( times[i] == 0.001 * i );
+        REQUIRE( nFrames == (n + 32) / 33 );
+    }
+    SECTION( "unordered" ) {
+        std::atomic<int> nGyroscope(0), nAccelerometer(0);
+        reader.ordered = false;
+        reader.onGyroscope = [&](double, double, double, double) { nGyroscope++; };
+        reader.onAccelerometer = [&](double, double, double, double) { nAccelerometer++; };
+        reader.read(path);
+        REQUIRE( nGyroscope == n );
+        REQUIRE( nAccelerometer == n );
+    }
+}
+
+TEST_CASE( "time index and range reads", "[jsonl-reader]" ) {
+    const std::string path = "test_output.txt";
+    const std::string indexPath = path + ".index";
+    std::remove(indexPath.c_str());
+    {
+        recorder::Settings settings;
+        settings.overflowPolicy = recorder::OverflowPolicy::BLOCK;
+        settings.indexInterval = 0.1;
+        auto r = recorder::Recorder::build(path, settings);
+        for (int i = 0; i < 2000; ++i) {
+            r->addGyroscope(0.001 * i, 0.1, 0.2, 0.3);
+            r->addAccelerometer(0.001 * i, 0.0, 0.0, 9.81);
+            // Frames arrive late, out of time order with the IMU
+            if (i % 33 == 0 && i >= 100) r->addFrame({ 0.001 * (i - 100), 0, 500.0, 500.0, 320.0, 240.0 });
+        }
+    }
+
+    const auto readRange = [&](unsigned threads) {
+        std::vector<double> gyro, frames;
+        JsonlReader reader;
+        reader.threads = threads;
+        reader.onGyroscope = [&](double t, double, double, double) { gyro.push_back(t); };
+        reader.onFrames = [&](std::vector<JsonlReader::FrameParameters> f) { frames.push_back(f[0].time); };
+        reader.readRange(path, 0.5, 0.8);
+        REQUIRE( gyro.size() == 300 );
+        REQUIRE( gyro.front() == 0.5 );
+        REQUIRE( gyro.back() == 0.001 * 799 );
+        REQUIRE( frames.size() == 9 );
+        for (double t : frames) REQUIRE( (t >= 0.5 && t < 0.8) );
+    };
+
+    std::ifstream index(indexPath);
+    REQUIRE( index.good() );
+    index.close();
+    readRange(1);
+    readRange(3);
+
+    JsonlReader reader;
+    reader.onGyroscope = [](double, double, double, double) {};
+    const std::size_t offset = reader.seek(path, 1.0);
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    const std::size_t size = file.tellg();
+    REQUIRE( offset > size / 3 );
+    REQUIRE( offset < size * 2 / 3 );
+    REQUIRE( reader.seek(path, 100.0) == size );
+
+    SECTION( "built when missing" ) {
+        std::remove(indexPath.c_str());
+        readRange(1);
+        REQUIRE( std::ifstream(indexPath).good() );
+        REQUIRE( reader.seek(path, 1.0) == offset );
+    }
+}
+
+namespace {
+void requireEqual(const JsonlReader::Summary &a, const JsonlReader::Summary &b) {
+    REQUIRE( a.minTime == b.minTime );
+    REQUIRE( a.maxTime == b.maxTime );
+    REQUIRE( a.droppedFrames == b.droppedFrames );
+    REQUIRE( a.streams.size() == b.streams.size() );
+    for (const auto &p : a.streams) {
+        REQUIRE( b.streams.count(p.first) == 1 );
+        const auto &s = b.streams.at(p.first);
+        REQUIRE( p.second.count == s.count );
+        REQUIRE( p.second.dropped == s.dropped );
+        REQUIRE( p.second.bytes == s.bytes );
+        REQUIRE( p.second.minTime == s.minTime );
+        REQUIRE( p.second.maxTime == s.maxTime );
+    }
+}
+}
+
+TEST_CASE( "recording summary", "[jsonl-reader]" ) {
+    recorder::Settings settings;
+    settings.overflowPolicy = recorder::OverflowPolicy::BLOCK;
+    SECTION( "jsonl" ) {}
+    SECTION( "binary" ) {
+        settings.format = recorder::Format::BINARY;
+    }
+
+    const auto record = [&](const std::string &path, bool summary) {
+        settings.writeSummary = summary;
+        auto r = recorder::Recorder::build(path, settings);
+        for (int i = 0; i < 1000; ++i) {
+            r->addGyroscope(0.5 + 0.001 * i, 0.1, 0.2, 0.3);
+            r->addAccelerometer(0.5 + 0.001 * i, 0.0, 0.0, 9.81);
+            if (i % 100 == 0) {
+                r->addFrame({ 0.5 + 0.001 * i, 0, 500.0, 500.0, 320.0, 240.0 });
+                r->addGps(0.5 + 0.001 * i, 60.18, 24.83, 5.0, 12.5);
+                r->addJson({ { "time", 0.25 + 0.001 * i } });
+            }
+        }
+    };
+    const std::string withSummary = "test_output.txt";
+    const std::string withoutSummary = "test_output.bin";
+    record(withSummary, true);
+    record(withoutSummary, false);
+
+    JsonlReader reader;
+    const auto summary = reader.getSummary(withSummary);
+    REQUIRE( summary.minTime == 0.25 );
+    REQUIRE( summary.maxTime == 0.5 + 0.001 * 999 );
+    REQUIRE( summary.streams.size() == 5 );
+    REQUIRE( summary.streams.at("gyroscope").count == 1000 );
+    REQUIRE( summary.streams.at("gyroscope").minTime == 0.5 );
+    REQUIRE( summary.streams.at("frames").count == 10 );
+    REQUIRE( summary.streams.at("json").minTime == 0.25 );
+    REQUIRE( summary.streams.at("accelerometer").bytes > 0 );
+    REQUIRE( reader.getSmallestTimestamp(withSummary) == 0.25 );
+
+    requireEqual(summary, reader.getSummary(withoutSummary));
+    reader.threads = 3;
+    requireEqual(summary, reader.getSummary(withoutSummary));
+}
+
+TEST_CASE( "summary and index written by closeOutputFile", "[jsonl-reader]" ) {
+    const std::string path = "test_output.txt";
+    const std::string indexPath = path + ".index";
+    std::remove(indexPath.c_str());
+    recorder::Settings settings;
+    settings.writeSummary = true;
+    settings.indexInterval = 0.1;
+    auto r = recorder::Recorder::build(path, settings);
+    for (int i = 0; i < 10; ++i) r->addGyroscope(0.5 + 0.1 * i, 0.1, 0.2, 0.3);
+    r->closeOutputFile();
+
+    std::ifstream file(path);
+    std::vector<std::string> lines;
+    for (std::string line; std::getline(file, line);) lines.push_back(line);
+    REQUIRE( lines.size() == 11 );
+    REQUIRE( lines.back().find("{\"summary\":") == 0 );
+    REQUIRE( std::ifstream(indexPath).good() );
+    JsonlReader reader;
+    const auto summary = reader.getSummary(path);
+    REQUIRE( summary.streams.at("gyroscope").count == 10 );
+    REQUIRE( summary.maxTime == 0.5 + 0.1 * 9 );
+
+    // Not written again when the recorder is destroyed
+    r.reset();
+    std::ifstream closed(path, std::ios::binary | std::ios::ate);
+    std::size_t size = 0;
+    for (const auto &line : lines) size += line.size() + 1;
+    REQUIRE( static_cast<std::size_t>(closed.tellg()) == size );
+}
+
+TEST_CASE( "segmented output", "[jsonl-recorder]" ) {
+    REQUIRE( recorder::segmentPath("dir/out.jsonl", 1) == "dir/out.0001.jsonl" );
+    REQUIRE( recorder::segmentPath("dir.d/out", 12) == "dir.d/out.0012" );
+
+    const std::string path = "test_output.txt";
+    const auto segment = [&](int i) { return recorder::segmentPath(path, i); };
+    std::remove(path.c_str());
+    for (int i = 1; i <= 5; ++i) std::remove(segment(i).c_str());
+
+    recorder::Settings settings;
+    settings.overflowPolicy = recorder::OverflowPolicy::BLOCK;
+    settings.writeSummary = true;
+    int segments = 4;
+    SECTION( "by duration" ) {
+        settings.segmentPolicy.maxDurationSeconds = 0.5;
+    }
+    SECTION( "by size" ) {
+        settings.segmentPolicy.maxBytes = 40000;
+        settings.indexInterval = 0.1;
+        segments = 0;
+    }
+    {
+        auto r = recorder::Recorder::build(path, settings);
+        for (int i = 0; i < 2000; ++i) {
+            r->addGyroscope(0.001 * i, 0.1, 0.2, 0.3);
+            if (i % 100 == 0) r->addFrame({ 0.001 * i, 0, 500.0, 500.0, 320.0, 240.0 });
+        }
+    }
+    REQUIRE( !std::ifstream(path).good() );
+    if (segments == 0) {
+        while (std::ifstream(segment(segments + 1)).good()) segments++;
+        REQUIRE( segments > 2 );
+    }
+    REQUIRE( !std::ifstream(segment(segments + 1)).good() );
+
+    std::size_t gyroscope = 0;
+    for (int i = 1; i <= segments; ++i) {
+        JsonlReader reader;
+        double minTime = INFINITY, maxTime = -INFINITY;
+        std::size_t count = 0;
+        reader.onGyroscope = [&](double t, double, double, double) {
+            minTime = std::min(minTime, t);
+            maxTime = std::max(maxTime, t);
+            count++;
+        };
+        if (settings.indexInterval > 0.0) {
+            REQUIRE( std::ifstream(segment(i) + ".index").good() );
+            reader.readRange(segment(i), -1.0, 10.0);
+        } else {
+            reader.read(segment(i));
+        }
+        const auto summary = reader.getSummary(segment(i));
+        REQUIRE( summary.streams.at("gyroscope").count == count );
+        REQUIRE( summary.minTime == minTime );
+        if (settings.segmentPolicy.maxDurationSeconds > 0.0) {
+            REQUIRE( minTime == 0.5 * (i - 1) );
+            REQUIRE( maxTime - minTime < 0.5 );
+        } else {
+            std::ifstream file(segment(i), std::ios::binary | std::ios::ate);
+            REQUIRE( static_cast<std::size_t>(file.tellg()) < 41000 );
+        }
+        gyroscope += count;
+    }
+    REQUIRE( gyroscope == 2000 );
+    for (int i = 1; i <= segments; ++i) {
+        std::remove(segment(i).c_str());
+        std::remove((segment(i) + ".index").c_str());
+    }
+}
+
+TEST_CASE( "asynchronous file backend", "[jsonl-recorder]" ) {
+    const std::string path = "test_output.txt";
+    const auto readAll = [](const std::string &p) {
+        std::ifstream file(p, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    };
+
+    recorder::Settings settings;
+    settings.overflowPolicy = recorder::OverflowPolicy::BLOCK;
+    // Many small blocks of unaligned sizes
+    settings.flushPolicy.maxBytes = 3000;
+    settings.writeSummary = true;
+    const auto record = [&](recorder::Recorder &r) {
+        for (int i = 0; i < 5000; ++i) {
+            r.addGyroscope(0.001 * i, 0.1 * i, 0.2, 0.3);
+            if (i % 1000 == 999) r.flush();
+        }
+    };
+
+    std::string expected;
+    {
+        auto r = recorder::Recorder::build(path, settings);
+        record(*r);
+    }
+    expected = readAll(path);
+    REQUIRE( expected.size() > 100000 );
+
+    settings.fileBackend = recorder::FileBackend::ASYNC;
+    SECTION( "page cache" ) {}
+    SECTION( "O_DIRECT" ) {
+        settings.directIO = true;
+    }
+    SECTION( "synced" ) {
+        settings.fileBackend = recorder::FileBackend::STREAM;
+        settings.flushPolicy.syncIntervalSeconds = 0.001;
+    }
+    SECTION( "synced O_DIRECT" ) {
+        settings.directIO = true;
+        settings.flushPolicy.syncIntervalSeconds = 0.001;
+    }
+    {
+        auto r = recorder::Recorder::build(path, settings);
+        record(*r);
+        r->flush();
+        REQUIRE( r->unflushedBytes() == 0 );
+        // Complete up to the summary after a flush, before the recorder is closed
+        const std::string flushed = readAll(path);
+        REQUIRE( flushed.size() > 100000 );
+        REQUIRE( expected.compare(0, flushed.size(), flushed) == 0 );
+    }
+    REQUIRE( readAll(path) == expected );
+    std::remove(path.c_str());
+}
+
+TEST_CASE( "torn final record", "[jsonl-reader]" ) {
+    const std::string path = "test_output.txt";
+    const auto readAll = [](const std::string &p) {
+        std::ifstream file(p, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    };
+
+    recorder::Settings settings;
+    settings.overflowPolicy = recorder::OverflowPolicy::BLOCK;
+    {
+        auto r = recorder::Recorder::build(path, settings);
+        for (int i = 0; i < 1000; ++i) r->addGyroscope(0.01 * i, 0.1, 0.2, 0.3);
+    }
+    const std::string complete = readAll(path);
+
+    std::string torn;
+    int expectedCount = 1000;
+    SECTION( "cut short" ) {
+        torn = "{\"sensor\":{\"type\":\"gyroscope\",\"values\":[0.1,";
+    }
+    SECTION( "zeros" ) {
+        torn = std::string(4096, '\0');
+    }
+    SECTION( "complete line without a newline" ) {
+        torn = "{\"sensor\":{\"type\":\"gyroscope\",\"values\":[0.1,0.2,0.3]},\"time\":10.5}";
+        expectedCount = 1001;
+    }
+    {
+        std::ofstream file(path, std::ios::out | std::ios::binary | std::ios::app);
+        file << torn;
+    }
+
+    for (unsigned threads : { 1u, 4u }) {
+        JsonlReader reader;
+        reader.threads = threads;
+        int count = 0;
+        reader.onGyroscope = [&](double, double, double, double) { count++; };
+        REQUIRE_NOTHROW( reader.read(path) );
+        REQUIRE( count == expectedCount );
+        REQUIRE( reader.getSummary(path).streams.at("gyroscope").count == static_cast<std::size_t>(expectedCount) );
+        count = 0;
+        reader.readRange(path, 5.0, 100.0);
+        REQUIRE( count == expectedCount - 500 );
+    }
+
+    const std::size_t removed = JsonlReader::truncateTornRecord(path);
+    if (expectedCount == 1000) {
+        REQUIRE( removed == torn.size() );
+        REQUIRE( readAll(path) == complete );
+    } else {
+        REQUIRE( removed == 0 );
+        REQUIRE( readAll(path) == complete + torn );
+    }
+    std::remove(path.c_str());
+    std::remove((path + ".index").c_str());
+}
+
+TEST_CASE( "MJPEG AVI container", "[video]" ) {
+    const std::string path = "test_output.avi";
+    const std::vector<std::string> frames = { "\xff\xd8jpeg\xff\xd9", "", "\xff\xd8odd\xff\xd9" };
+    {
+        recorder::MjpegAviWriter avi(path, 640, 480, 3, 30);
+        REQUIRE( avi.isOpen() );
+        for (const auto &f : frames) {
+            avi.writeFrame(reinterpret_cast<const unsigned char*>(f.data()), f.size());
+        }
+    }
+    std::ifstream in(path, std::ios::binary);
+    const std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    std::remove(path.c_str());
+    const auto u32 = [&](std::size_t offset) {
+        std::uint32_t x = 0;
+        for (int i = 3; i >= 0; --i) x = (x << 8) | static_cast<unsigned char>(data.at(offset + i));
+        return x;
+    };
+
+    REQUIRE( data.substr(0, 4) == "RIFF" );
+    REQUIRE( u32(4) == data.size() - 8 );
+    REQUIRE( data.substr(8, 4) == "AVI " );
+    REQUIRE( u32(48) == frames.size() );
+    REQUIRE( u32(64) == 640 );
+    REQUIRE( u32(68) == 480 );
+    REQUIRE( data.substr(212, 4) == "LIST" );
+    REQUIRE( data.substr(220, 4) == "movi" );
+    const std::size_t idx1 = 220 + u32(216);
+    REQUIRE( data.substr(idx1, 4) == "idx1" );
+    REQUIRE( u32(idx1 + 4) == 16 * frames.size() );
+    for (std::size_t i = 0; i < frames.size(); ++i) {
+        const std::size_t entry = idx1 + 8 + 16 * i;
+        REQUIRE( data.substr(entry, 4) == "00dc" );
+        const std::size_t chunk = 220 + u32(entry + 8);
+        REQUIRE( data.substr(chunk, 4) == "00dc" );
+        REQUIRE( u32(chunk + 4) == frames[i].size() );
+        REQUIRE( u32(entry + 12) == frames[i].size() );
+        REQUIRE( data.substr(chunk + 8, frames[i].size()) == frames[i] );
+    }
+}
+
+TEST_CASE( "MJPEG AVI size limit", "[video]" ) {
+    const std::string path = "test_output.avi";
+    const std::string frame = "\xff\xd8jpeg\xff\xd9";
+    const auto write = [&](recorder::MjpegAviWriter &avi, const std::string &f) {
+        return avi.writeFrame(reinterpret_cast<const unsigned char*>(f.data()), f.size());
+    };
+    // Header, two 16 byte chunks, the "idx1" header and two entries
+    const std::size_t twoFrames = 224 + 2 * 16 + 8 + 2 * 16;
+    {
+        recorder::MjpegAviWriter avi(path, 640, 480, 3, 30, twoFrames);
+        REQUIRE( write(avi, frame) );
+        REQUIRE( write(avi, frame) );
+        REQUIRE( !write(avi, frame) );
+        // Would fit, but is refused too so that the index has no gaps
+        REQUIRE( !write(avi, "") );
+    }
+    std::ifstream in(path, std::ios::binary);
+    const std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    std::remove(path.c_str());
+    const auto u32 = [&](std::size_t offset) {
+        std::uint32_t x = 0;
+        for (int i = 3; i >= 0; --i) x = (x << 8) | static_cast<unsigned char>(data.at(offset + i));
+        return x;
+    };
+
+    REQUIRE( data.size() == twoFrames );
+    REQUIRE( u32(4) == data.size() - 8 );
+    REQUIRE( u32(48) == 2 );
+    const std::size_t idx1 = 220 + u32(216);
+    REQUIRE( data.substr(idx1, 4) == "idx1" );
+    REQUIRE( u32(idx1 + 4) == 2 * 16 );
+    REQUIRE( idx1 + 8 + 2 * 16 == data.size() );
+}
+
+TEST_CASE( "raw video file and index", "[video]" ) {
+    const std::string path = "test_output.raw";
+    // A padded 10x10 CV_8UC3 frame (type 16), then frames spanning the
+    // preallocated windows.
+    std::vector<unsigned char> padded(10 * 32);
+    for (std::size_t i = 0; i < padded.size(); ++i) padded[i] = static_cast<unsigned char>(i);
+    std::vector<unsigned char> large(100000);
+    for (std::size_t i = 0; i < large.size(); ++i) large[i] = static_cast<unsigned char>(i * 7);
+    {
+        recorder::RawVideoWriter raw(path, 64 * 1024);
+        REQUIRE( raw.isOpen() );
+        raw.writeFrame(0, 10, 10, 16, padded.data(), 30, 32);
+        for (std::size_t n = 1; n <= 3; ++n) raw.writeFrame(n, 100, 1000, 0, large.data(), 1000, 1000);
+    }
+
+    std::ifstream in(path, std::ios::binary);
+    const std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    REQUIRE( data.size() == 300 + 3 * large.size() );
+    std::ifstream index(path + ".index");
+    std::string line;
+    std::size_t frames = 0;
+    while (std::getline(index, line)) {
+        const auto j = nlohmann::json::parse(line);
+        const std::size_t n = j["number"], offset = j["offset"], size = j["size"];
+        REQUIRE( n == frames++ );
+        if (n == 0) {
+            REQUIRE( size == 300 );
+            REQUIRE( j["type"] == 16 );
+            for (std::size_t row = 0; row < 10; ++row) {
+                REQUIRE( data.compare(offset + 30 * row, 30, reinterpret_cast<const char*>(padded.data() + 32 * row), 30) == 0 );
+            }
+        } else {
+            REQUIRE( size == large.size() );
+            REQUIRE( j["rows"] == 100 );
+            REQUIRE( data.compare(offset, size, reinterpret_cast<const char*>(large.data()), size) == 0 );
+        }
+    }
+    REQUIRE( frames == 4 );
+    std::remove(path.c_str());
+    std::remove((path + ".index").c_str());
+}
+
+TEST_CASE( "binary format converts to identical JSONL", "[jsonl-recorder]" ) {
+    const auto record = [](recorder::Recorder &r) {
+        for (int i = 0; i < 100; ++i) {
+            const double t = 0.01 * i + 1.0 / 3;
+            r.addGyroscope({ t, 0.1 * i, -0.2, 1e-9 });
+            r.addAccelerometer({ t, 0.0, 9.81, -1.5, 25.0 });
+            if (i % 10 == 0) {
+                r.addGps(t, 60.18, 24.83, 5.0, 12.5);
+                recorder::Pose pose = { t, { 1.0, 2.0, 3.0 }, { 0.0, 0.0, 0.0, 1.0 } };
+                r.addARKit(pose);
+                r.addGroundTruth(pose);
+                r.addOdometryOutput(pose, { 0.5, 0.0, -0.5 });
+                r.addFrameGroup(t, { { t, 0, 500.0, 500.0, 320.0, 240.0 }, { t, 1 } });
+                r.addJsonString("{\"custom\":" + std::to_string(i) + "}");
+                r.addJson({ { "time", t }, { "extra", { 1, 2, 3 } } });
+            }
+        }
+    };
+
+    std::ostringstream jsonl;
+    {
+        auto r = recorder::Recorder::build(jsonl);
+        record(*r);
+    }
+
+    const std::string path = "test_output.bin";
+    {
+        recorder::Settings settings;
+        settings.format = recorder::Format::BINARY;
+        auto r = recorder::Recorder::build(path, settings);
+        record(*r);
+    }
+    std::ostringstream converted;
+    REQUIRE( recorder::convertBinaryToJsonl(path, converted) );
+    REQUIRE( !jsonl.str().empty() );
+    REQUIRE( converted.str() == jsonl.str() );
+
+    std::ifstream binary(path, std::ios::binary | std::ios::ate);
+    REQUIRE( static_cast<std::size_t>(binary.tellg()) < jsonl.str().size() / 2 );
+}
@@ -0,0 +1,132 @@
+#include "time_index.hpp"
+#include "serializer.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <nlohmann/json.hpp>
+
+namespace recorder {
+TimeIndex::TimeIndex(double interval) :
+    interval(interval),
+    origin(NAN)
+{
+    lastBucket.fill({ 0, nullptr });
+}
+
+long long TimeIndex::bucket(double t) const {
+    // Clamp so that infinite times and distant outliers do not overflow.
+    const double b = std::floor((t - origin) / interval);
+    if (b <= -1e18) return std::numeric_limits<long long>::min();
+    if (b >= 1e18) return std::numeric_limits<long long>::max();
+    return static_cast<long long>(b);
+}
+
+void TimeIndex::add(Stream stream, double t, std::uint64_t begin, std::uint64_t end) {
+    if (std::isnan(t)) return;
+    if (std::isnan(origin)) origin = t;
+    const std::size_t s = static_cast<std::size_t>(stream);
+    const long long b = bucket(t);
+    auto &last = lastBucket[s];
+    if (!last.second || last.first != b) {
+        auto inserted = buckets[s].insert({ b, Range { begin, end } });
+        last = { b, &inserted.first->second };
+    }
+    Range &r = *last.second;
+    r.begin = std::min(r.begin, begin);
+    r.end = std::max(r.end, end);
+}
+
+bool TimeIndex::find(unsigned streamMask, double t0, double t1, Range &range) const {
+    if (std::isnan(origin) || !(t0 < t1)) return false;
+    const long long b0 = bucket(t0);
+    const long long b1 = bucket(t1);
+    range.begin = std::numeric_limits<std::uint64_t>::max();
+    range.end = 0;
+    for (std::size_t s = 0; s < STREAM_COUNT; ++s) {
+        if (!(streamMask & (1u << s))) continue;
+        // Records with t0 <= time start at or after the first byte of their
+        // bucket, and records with time < t1 end before the last one of theirs.
+        for (auto it = buckets[s].lower_bound(b0); it != buckets[s].end(); ++it) {
+            range.begin = std::min(range.begin, it->second.begin);
+        }
+        for (auto it = buckets[s].begin(); it != buckets[s].end() && it->first <= b1; ++it) {
+            range.end = std::max(range.end, it->second.end);
+        }
+    }
+    return range.begin < range.end;
+}
+
+std::uint64_t TimeIndex::fileSize() const {
+    return size;
+}
+
+bool TimeIndex::save(const std::string &path, std::uint64_t fileSize) const {
+    std::ofstream out(path);
+    if (!out) return false;
+    nlohmann::json header = {
+        { "indexInterval", interval },
+        { "fileSize", fileSize }
+    };
+    if (!std::isnan(origin)) header["origin"] = origin;
+    out << header.dump() << "\n";
+    // One line per stream with the buckets as parallel arrays
+    for (std::size_t s = 0; s < STREAM_COUNT; ++s) {
+        if (buckets[s].empty()) continue;
+        nlohmann::json line = {
+            { "stream", streamName(static_cast<Stream>(s)) },
+            { "bucket", nlohmann::json::array() },
+            { "begin", nlohmann::json::array() },
+            { "end", nlohmann::json::array() }
+        };
+        for (const auto &b : buckets[s]) {
+            line["bucket"].push_back(b.first);
+            line["begin"].push_back(b.second.begin);
+            line["end"].push_back(b.second.end);
+        }
+        out << line.dump() << "\n";
+    }
+    return out.good();
+}
+
+bool TimeIndex::load(const std::string &path) {
+    std::ifstream in(path);
+    if (!in) return false;
+    try {
+        std::string line;
+        if (!std::getline(in, line)) return false;
+        const auto header = nlohmann::json::parse(line);
+        interval = header.at("indexInterval").get<double>();
+        if (!(interval > 0.0)) return false;
+        size = header.at("fileSize").get<std::uint64_t>();
+        origin = header.count("origin") ? header["origin"].get<double>() : NAN;
+        for (auto &b : buckets) b.clear();
+        lastBucket.fill({ 0, nullptr });
+        while (std::getline(in, line)) {
+            const auto j = nlohmann::json::parse(line);
+            const std::string name = j.at("stream");
+            std::size_t s = 0;
+            while (s < STREAM_COUNT && name != streamName(static_cast<Stream>(s))) s++;
+            if (s == STREAM_COUNT) continue;
+            const auto &b = j.at("bucket");
+            const auto &begin = j.at("begin");
+            const auto &end = j.at("end");
+            if (b.size() != begin.size() || b.size() != end.size()) return false;
+            for (std::size_t i = 0; i < b.size(); ++i) {
+                buckets[s][b[i].get<long long>()] = Range {
+                    begin[i].get<std::uint64_t>(),
+                    end[i].get<std::uint64_t>()
+                };
+            }
+        }
+    } catch (const nlohmann::json::exception &) {
+        return false;
+    }
+    return true;
+}
+
+std::string timeIndexPath(const std::string &recordingPath) {
+    return recordingPath + ".index";
+}
+} // namespace recorder
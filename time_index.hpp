@@ -0,0 +1,63 @@
+// private header file
+#ifndef JSONL_RECORDER_TIME_INDEX_HPP
+#define JSONL_RECORDER_TIME_INDEX_HPP
+#include <array>
+#include <cstdint>
+#include <map>
+#include <string>
+
+#include "record.hpp"
+
+namespace recorder {
+/**
+ * Byte ranges of the records of a JSONL recording, per stream and per time
+ * bucket of a fixed length. Stored next to the recording (timeIndexPath())
+ * and used by JsonlReader::readRange(). Records do not need to be in time
+ * order: a bucket spans from the first to the last byte of its records.
+ */
+class TimeIndex {
+public:
+    struct Range {
+        std::uint64_t begin;
+        std::uint64_t end;
+    };
+
+    /** @param interval Bucket length in seconds */
+    TimeIndex(double interval);
+    TimeIndex(const TimeIndex&) = delete;
+    TimeIndex &operator=(const TimeIndex&) = delete;
+
+    /** Add a record of the stream with time t at bytes [begin, end) of the file */
+    void add(Stream stream, double t, std::uint64_t begin, std::uint64_t end);
+
+    /**
+     * Byte range containing every record with t0 <= time < t1 of the
+     * streams in the mask (bit 1 << Stream).
+     *
+     * @return false if there are no such records
+     */
+    bool find(unsigned streamMask, double t0, double t1, Range &range) const;
+
+    /** Size of the indexed file, as given to save() */
+    std::uint64_t fileSize() const;
+
+    bool save(const std::string &path, std::uint64_t fileSize) const;
+    /** @return false if the file is missing or invalid */
+    bool load(const std::string &path);
+
+private:
+    double interval;
+    double origin;
+    std::uint64_t size = 0;
+    std::array<std::map<long long, Range>, STREAM_COUNT> buckets;
+    // Bucket of the previous add() of each stream, the usual case
+    std::array<std::pair<long long, Range*>, STREAM_COUNT> lastBucket;
+
+    long long bucket(double t) const;
+};
+
+/** Sidecar file of the recording holding its TimeIndex */
+std::string timeIndexPath(const std::string &recordingPath);
+} // namespace recorder
+
+#endif
@@ -1,6 +1,9 @@
 #ifndef RECORDER_TYPES_H_
 #define RECORDER_TYPES_H_
 
+#include <cstddef>
+#include <functional>
+
 namespace cv { class Mat; } // fwd decl
 
 namespace recorder {
@@ -40,6 +43,34 @@ struct FrameData {
     const cv::Mat *frameData = nullptr;
 };
 
+enum class PixelFormat {
+    /** One byte per pixel */
+    GRAY8,
+    /** Blue, green and red bytes, like 3-channel OpenCV images */
+    BGR24,
+    /** Four bytes per pixel, encoded like 4-channel OpenCV images */
+    BGRA32
+};
+
+/**
+ * Frame image in memory owned by the caller, e.g., a camera driver buffer,
+ * recorded without copying it. See Recorder::addFrame(const FrameData&, const ImageBuffer&).
+ */
+struct ImageBuffer {
+    /** Null if the frame has no image */
+    const void *data = nullptr;
+    int width = 0;
+    int height = 0;
+    /** Bytes from the start of a row to the start of the next */
+    std::size_t stride = 0;
+    PixelFormat format = PixelFormat::GRAY8;
+    /**
+     * Called exactly once, possibly from another thread, when the recorder
+     * no longer reads data. Optional.
+     */
+    std::function<void()> release;
+};
+
 struct AccelerometerData {
   double t;
   double x, y, z;
@@ -51,6 +82,14 @@ struct GyroscopeData {
   double x, y, z;
   double temperature = -1.0;
 };
+
+struct GpsData {
+  double t;
+  double latitude, longitude;
+  /** Horizontal uncertainty. We have no standard for what this means */
+  double accuracy;
+  double altitude;
+};
 } // namespace recorder
 
 #endif
@@ -1,85 +1,478 @@
 #include "recorder.hpp"
 #include "video.hpp"
 
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <nlohmann/json.hpp>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 #ifdef USE_OPENCV_VIDEO_RECORDING
+#include <map>
+#include <mutex>
 #include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
 #include <opencv2/imgproc.hpp>
-#include <opencv2/videoio.hpp>
 #include <sstream>
+#endif
+
+#define log_warn std::printf
 
+#ifdef USE_OPENCV_VIDEO_RECORDING
 namespace recorder {
 namespace {
-std::unique_ptr<cv::VideoWriter> buildOpenCVVideoWriter(const std::string &path, float fps, const cv::Mat &modelFrame) {
-    assert(fps > 0.0);
-    assert(!path.empty());
-    const auto codec = cv::VideoWriter::fourcc('M', 'J', 'P', 'G');
-    // This is the only thing we can write without FFMPEG on Android
-    // The path name should end with .avi
-    const auto backend = cv::CAP_OPENCV_MJPEG;
-    const bool isColor = modelFrame.channels() > 1;
-    {
-        // OpenCV writer gives no errors even if it is unable to open file and
-        // write frames to it, so test writing by ourselves.
-        std::ofstream video(path);
-        assert(video.is_open() && "unable to open video file for writing");
-    }
-    // log_info("recording %s video stream to %s", isColor ? "color" : "gray", path.c_str());
-    auto writer = std::make_unique<cv::VideoWriter>(
-            path, backend, codec, fps, modelFrame.size(), isColor);
-    assert(writer && "failed to create video writer");
-    // TODO: set video quality
-    return writer;
-}
+// Same as the default of the OpenCV MJPEG backend
+constexpr int JPEG_QUALITY = 75;
 
-std::string videoOutputPath(const std::string &prefix, int cameraInd) {
+std::string videoOutputPath(const std::string &prefix, int cameraInd, int segment, VideoFormat format) {
     std::ostringstream oss;
     oss << prefix;
     if (cameraInd != 0) {
         oss << (cameraInd + 1);
     }
-    oss << ".avi"; // must be .avi so OpenCV can record this without FFMPEG
+    // Motion JPEG in AVI is playable without FFMPEG
+    oss << (format == VideoFormat::RAW ? ".raw" : ".avi");
+    if (segment > 0) return segmentPath(oss.str(), segment);
     return oss.str();
 }
 
 struct VideoWriterImplementation : public VideoWriter {
-    const std::unique_ptr<cv::VideoWriter> writer;
-    cv::Mat outputFrame;
+    const std::string prefix;
+    const int cameraInd;
+    const float fps;
+    const cv::Size size;
+    const bool isColor;
+
+    std::mutex mutex;
+    // Encoded frames waiting for the previous ones to be written, by number
+    std::map<std::size_t, std::vector<unsigned char> > encoded;
+    // First frame number of each segment not started yet
+    std::map<std::size_t, int> segments;
+    std::size_t nextFrame = 0;
+    bool appending = false;
+    std::unique_ptr<MjpegAviWriter> avi; // used by the appending thread only
 
-    VideoWriterImplementation(std::unique_ptr<cv::VideoWriter> writer) : writer(std::move(writer)) {}
+    VideoWriterImplementation(const std::string &prefix, int cameraInd, float fps, const cv::Mat &modelFrame, int segment) :
+        prefix(prefix),
+        cameraInd(cameraInd),
+        fps(fps),
+        size(modelFrame.size()),
+        isColor(modelFrame.channels() > 1),
+        avi(openFile(segment))
+    {}
+
+    std::unique_ptr<MjpegAviWriter> openFile(int segment) const {
+        assert(fps > 0.0);
+        const std::string path = videoOutputPath(prefix, cameraInd, segment, VideoFormat::MJPEG);
+        auto file = std::make_unique<MjpegAviWriter>(path, size.width, size.height, isColor ? 3 : 1, fps);
+        assert(file->isOpen() && "unable to open video file for writing");
+        // log_info("recording %s video stream to %s", isColor ? "color" : "gray", path.c_str());
+        return file;
+    }
 
-    void write(const cv::Mat &frame) final {
+    static void encode(const cv::Mat &frame, std::vector<unsigned char> &jpeg) {
+        bool ok;
         if (frame.channels() == 4) {
-            cv::cvtColor(frame, outputFrame, cv::COLOR_BGRA2BGR);
             // This took a while to debug: if the image has 3 channels, the
             // default channel order assumed by OpenCV image IO functions
             // is BGR (which everybody on the internet warns you about).
-            // However, if there are 4 channels, at least this particular
-            // function (on Android) assumes the color order RGBA
-            writer->write(outputFrame);
+            // However, if there are 4 channels, at least some of them (on
+            // Android) assume the color order RGBA
+            cv::Mat bgr;
+            cv::cvtColor(frame, bgr, cv::COLOR_BGRA2BGR);
+            ok = cv::imencode(".jpg", bgr, jpeg, { cv::IMWRITE_JPEG_QUALITY, JPEG_QUALITY });
         } else {
-            writer->write(frame);
+            ok = cv::imencode(".jpg", frame, jpeg, { cv::IMWRITE_JPEG_QUALITY, JPEG_QUALITY });
+        }
+        // Written as a dropped frame so that later frames keep their numbers
+        if (!ok) jpeg.clear();
+    }
+
+    void write(std::size_t number, const cv::Mat &frame) final {
+        std::vector<unsigned char> jpeg;
+        encode(frame, jpeg);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        encoded.emplace(number, std::move(jpeg));
+        // One thread at a time appends the frames that are next in order,
+        // while the others go back to encoding.
+        if (appending) return;
+        appending = true;
+        while (!encoded.empty() && encoded.begin()->first == nextFrame) {
+            std::vector<unsigned char> data = std::move(encoded.begin()->second);
+            encoded.erase(encoded.begin());
+            int segment = 0;
+            if (!segments.empty() && segments.begin()->first == nextFrame) {
+                segment = segments.begin()->second;
+                segments.erase(segments.begin());
+            }
+            nextFrame++;
+            lock.unlock();
+            if (segment > 0) {
+                avi->close();
+                avi = openFile(segment);
+            }
+            avi->writeFrame(data.data(), data.size());
+            lock.lock();
+        }
+        appending = false;
+    }
+
+    void startSegment(std::size_t number, int segment) final {
+        std::lock_guard<std::mutex> lock(mutex);
+        segments[number] = segment;
+    }
+};
+
+struct RawVideoWriterImplementation : public VideoWriter {
+    const std::string prefix;
+    const int cameraInd;
+
+    std::mutex mutex;
+    // First frame number of each segment not started yet
+    std::map<std::size_t, int> segments;
+    // Frame numbers in the index start from zero in each segment.
+    std::size_t firstFrame = 0;
+    std::unique_ptr<RawVideoWriter> file;
+
+    RawVideoWriterImplementation(const std::string &prefix, int cameraInd, int segment) :
+        prefix(prefix),
+        cameraInd(cameraInd),
+        file(openFile(segment))
+    {}
+
+    std::unique_ptr<RawVideoWriter> openFile(int segment) const {
+        auto f = std::make_unique<RawVideoWriter>(videoOutputPath(prefix, cameraInd, segment, VideoFormat::RAW));
+        assert(f->isOpen() && "unable to open video file for writing");
+        return f;
+    }
+
+    void write(std::size_t number, const cv::Mat &frame) final {
+        int segment = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!segments.empty() && segments.begin()->first == number) {
+                segment = segments.begin()->second;
+                segments.erase(segments.begin());
+            }
+        }
+        if (segment > 0) {
+            file->close();
+            file = openFile(segment);
+            firstFrame = number;
         }
+        file->writeFrame(number - firstFrame, frame.rows, frame.cols, frame.type(),
+            frame.data, frame.cols * frame.elemSize(), frame.step);
+    }
+
+    void startSegment(std::size_t number, int segment) final {
+        std::lock_guard<std::mutex> lock(mutex);
+        segments[number] = segment;
     }
 };
 }
 
-std::unique_ptr<VideoWriter> VideoWriter::build(const std::string &prefix, int cameraInd, float fps, const cv::Mat &modelFrame) {
-    auto fn = videoOutputPath(prefix, cameraInd);
-    return std::unique_ptr<VideoWriter>(new VideoWriterImplementation(buildOpenCVVideoWriter(fn, fps, modelFrame)));
+std::unique_ptr<VideoWriter> VideoWriter::build(const std::string &prefix, int cameraInd, float fps, const cv::Mat &modelFrame, VideoFormat format, int segment) {
+    if (format == VideoFormat::RAW) {
+        return std::unique_ptr<VideoWriter>(new RawVideoWriterImplementation(prefix, cameraInd, segment));
+    }
+    return std::unique_ptr<VideoWriter>(new VideoWriterImplementation(prefix, cameraInd, fps, modelFrame, segment));
 }
 }
 
 #else
 namespace recorder {
-std::unique_ptr<VideoWriter> VideoWriter::build(const std::string &prefix, int cameraInd, float fps, const cv::Mat &modelFrame) {
+std::unique_ptr<VideoWriter> VideoWriter::build(const std::string &prefix, int cameraInd, float fps, const cv::Mat &modelFrame, VideoFormat format, int segment) {
     (void)prefix;
     (void)cameraInd;
     (void)fps;
     (void)modelFrame;
+    (void)format;
+    (void)segment;
     assert(false && "not built with OpenCV video recording support");
     return nullptr;
 }
 }
 #endif
 
+namespace recorder {
+namespace {
+// Layout of the header written by MjpegAviWriter: RIFF "AVI " with an
+// "hdrl" list (main header, one video stream) and a "movi" list holding
+// the frames, followed by the "idx1" index. Fields only known at the end
+// are patched at these offsets by close().
+constexpr std::uint32_t TOTAL_FRAMES_OFFSET = 48;
+constexpr std::uint32_t MAIN_BUFFER_SIZE_OFFSET = 60;
+constexpr std::uint32_t STREAM_LENGTH_OFFSET = 140;
+constexpr std::uint32_t STREAM_BUFFER_SIZE_OFFSET = 144;
+constexpr std::uint32_t MOVI_SIZE_OFFSET = 216;
+// The "movi" fourcc, which index offsets are relative to
+constexpr std::uint32_t MOVI_OFFSET = 220;
+constexpr std::uint32_t HEADER_SIZE = 224;
+
+constexpr std::uint32_t AVIF_HASINDEX = 0x10;
+constexpr std::uint32_t AVIIF_KEYFRAME = 0x10;
+
+void putU16(std::string &out, std::uint16_t x) {
+    out.push_back(static_cast<char>(x & 0xff));
+    out.push_back(static_cast<char>(x >> 8));
+}
+
+void putU32(std::string &out, std::uint32_t x) {
+    char b[4];
+    for (int i = 0; i < 4; ++i) b[i] = static_cast<char>((x >> (8 * i)) & 0xff);
+    out.append(b, 4);
+}
+
+void putFourcc(std::string &out, const char *fourcc) {
+    out.append(fourcc, 4);
+}
+}
+
+constexpr std::uint64_t MjpegAviWriter::MAX_FILE_SIZE;
+
+MjpegAviWriter::MjpegAviWriter(const std::string &path, int width, int height, int channels, float fps, std::uint64_t maxFileSize) :
+    file(path, std::ios::out | std::ios::binary),
+    maxFileSize(std::min(maxFileSize, MAX_FILE_SIZE)),
+    position(0)
+{
+    const std::uint32_t w = static_cast<std::uint32_t>(width);
+    const std::uint32_t h = static_cast<std::uint32_t>(height);
+    std::string header;
+    putFourcc(header, "RIFF");
+    putU32(header, 0); // patched
+    putFourcc(header, "AVI ");
+
+    putFourcc(header, "LIST");
+    putU32(header, 4 + 8 + 56 + 8 + 4 + 8 + 56 + 8 + 40);
+    putFourcc(header, "hdrl");
+    putFourcc(header, "avih");
+    putU32(header, 56);
+    putU32(header, static_cast<std::uint32_t>(std::round(1e6 / fps))); // microseconds per frame
+    putU32(header, 0); // max bytes per second
+    putU32(header, 0); // padding granularity
+    putU32(header, AVIF_HASINDEX);
+    putU32(header, 0); // total frames, patched
+    putU32(header, 0); // initial frames
+    putU32(header, 1); // streams
+    putU32(header, 0); // suggested buffer size, patched
+    putU32(header, w);
+    putU32(header, h);
+    for (int i = 0; i < 4; ++i) putU32(header, 0);
+
+    putFourcc(header, "LIST");
+    putU32(header, 4 + 8 + 56 + 8 + 40);
+    putFourcc(header, "strl");
+    putFourcc(header, "strh");
+    putU32(header, 56);
+    putFourcc(header, "vids");
+    putFourcc(header, "MJPG");
+    putU32(header, 0); // flags
+    putU16(header, 0); // priority
+    putU16(header, 0); // language
+    putU32(header, 0); // initial frames
+    putU32(header, 1000); // scale
+    putU32(header, static_cast<std::uint32_t>(std::round(fps * 1000))); // rate, frames per scale seconds
+    putU32(header, 0); // start
+    putU32(header, 0); // length, patched
+    putU32(header, 0); // suggested buffer size, patched
+    putU32(header, 0xffffffff); // quality, default
+    putU32(header, 0); // sample size
+    putU16(header, 0); // frame rectangle
+    putU16(header, 0);
+    putU16(header, static_cast<std::uint16_t>(w));
+    putU16(header, static_cast<std::uint16_t>(h));
+    putFourcc(header, "strf");
+    putU32(header, 40);
+    putU32(header, 40); // BITMAPINFOHEADER size
+    putU32(header, w);
+    putU32(header, h);
+    putU16(header, 1); // planes
+    putU16(header, static_cast<std::uint16_t>(8 * channels)); // bits per pixel
+    putFourcc(header, "MJPG");
+    putU32(header, w * h * static_cast<std::uint32_t>(channels)); // image size
+    for (int i = 0; i < 4; ++i) putU32(header, 0);
+
+    putFourcc(header, "LIST");
+    putU32(header, 0); // patched
+    putFourcc(header, "movi");
+    assert(header.size() == HEADER_SIZE);
+    file.write(header.data(), header.size());
+    position = header.size();
+}
+
+MjpegAviWriter::~MjpegAviWriter() {
+    close();
+}
+
+bool MjpegAviWriter::isOpen() const {
+    return file.is_open();
+}
+
+bool MjpegAviWriter::writeFrame(const unsigned char *jpeg, std::size_t size) {
+    // The file size once closed with this frame: its chunk, the "idx1"
+    // header and an index entry for each frame.
+    const std::uint64_t closedSize = position + 8 + size + size % 2 + 8 + 16 * (index.size() + 1);
+    if (full || closedSize > maxFileSize) {
+        // Later frames are refused too, so that the index has no gaps.
+        if (!full) log_warn("MjpegAviWriter: file size limit reached, not writing frames from %zu on\n", index.size());
+        full = true;
+        return false;
+    }
+    std::string header;
+    putFourcc(header, "00dc");
+    putU32(header, static_cast<std::uint32_t>(size));
+    index.push_back({ static_cast<std::uint32_t>(position - MOVI_OFFSET), static_cast<std::uint32_t>(size) });
+    file.write(header.data(), header.size());
+    file.write(reinterpret_cast<const char*>(jpeg), size);
+    // Chunks are padded to an even size.
+    if (size % 2) file.put(0);
+    position += header.size() + size + size % 2;
+    maxFrameSize = std::max(maxFrameSize, static_cast<std::uint32_t>(size));
+    return true;
+}
+
+void MjpegAviWriter::close() {
+    if (!file.is_open()) return;
+    const std::uint64_t moviEnd = position;
+    std::string idx1;
+    putFourcc(idx1, "idx1");
+    putU32(idx1, static_cast<std::uint32_t>(16 * index.size()));
+    for (const auto &entry : index) {
+        putFourcc(idx1, "00dc");
+        putU32(idx1, entry.size > 0 ? AVIIF_KEYFRAME : 0);
+        putU32(idx1, entry.offset);
+        putU32(idx1, entry.size);
+    }
+    file.write(idx1.data(), idx1.size());
+    position += idx1.size();
+
+    const auto patch = [this](std::uint32_t offset, std::uint64_t value) {
+        std::string b;
+        putU32(b, static_cast<std::uint32_t>(value));
+        file.seekp(offset);
+        file.write(b.data(), b.size());
+    };
+    patch(4, position - 8);
+    patch(TOTAL_FRAMES_OFFSET, index.size());
+    patch(MAIN_BUFFER_SIZE_OFFSET, maxFrameSize);
+    patch(STREAM_LENGTH_OFFSET, index.size());
+    patch(STREAM_BUFFER_SIZE_OFFSET, maxFrameSize);
+    patch(MOVI_SIZE_OFFSET, moviEnd - MOVI_OFFSET);
+    file.close();
+}
+
+RawVideoWriter::~RawVideoWriter() {
+    close();
+}
+
+void RawVideoWriter::writeFrame(std::size_t number, int rows, int cols, int type, const unsigned char *data, std::size_t rowBytes, std::size_t step) {
+    if (!isOpen()) return;
+    const std::uint64_t offset = position;
+    if (step == rowBytes) {
+        append(data, rowBytes * rows);
+    } else {
+        for (int row = 0; row < rows; ++row) append(data + row * step, rowBytes);
+    }
+    if (!isOpen()) return;
+    const nlohmann::json entry = {
+        { "number", number },
+        { "offset", offset },
+        { "size", position - offset },
+        { "rows", rows },
+        { "cols", cols },
+        { "type", type }
+    };
+    index << entry.dump() << "\n";
+}
+
+#ifdef _WIN32
+RawVideoWriter::RawVideoWriter(const std::string &path, std::size_t preallocationBytes) :
+    index(path + ".index"),
+    file(path, std::ios::out | std::ios::binary)
+{
+    (void)preallocationBytes;
+}
+
+bool RawVideoWriter::isOpen() const {
+    return file.is_open();
+}
+
+void RawVideoWriter::append(const unsigned char *data, std::size_t n) {
+    file.write(reinterpret_cast<const char*>(data), n);
+    position += n;
+    if (!file) file.close();
+}
+
+void RawVideoWriter::close() {
+    index.close();
+    file.close();
+}
+#else
+RawVideoWriter::RawVideoWriter(const std::string &path, std::size_t preallocationBytes) :
+    index(path + ".index")
+{
+    const std::size_t page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+    windowSize = std::max<std::size_t>((preallocationBytes + page - 1) / page, 1) * page;
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0 && !mapNextWindow()) close();
+}
+
+bool RawVideoWriter::isOpen() const {
+    return fd >= 0;
+}
+
+// Unmap the current window, grow the file by windowSize and map that part
+bool RawVideoWriter::mapNextWindow() {
+    if (window) ::munmap(window, windowSize);
+    window = nullptr;
+    windowOffset = position;
+    // Allocate the disk space up front where possible, so that writing the
+    // frames through the mapping does not fail or fragment the file.
+#ifdef __linux__
+    if (::posix_fallocate(fd, windowOffset, windowSize) != 0 && ::ftruncate(fd, windowOffset + windowSize) != 0) return false;
+#else
+    if (::ftruncate(fd, windowOffset + windowSize) != 0) return false;
+#endif
+    void *p = ::mmap(nullptr, windowSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, windowOffset);
+    if (p == MAP_FAILED) return false;
+    window = static_cast<unsigned char*>(p);
+    return true;
+}
+
+void RawVideoWriter::append(const unsigned char *data, std::size_t n) {
+    while (n > 0) {
+        if (position == windowOffset + windowSize && !mapNextWindow()) {
+            close();
+            return;
+        }
+        const std::size_t k = std::min<std::uint64_t>(n, windowOffset + windowSize - position);
+        std::memcpy(window + (position - windowOffset), data, k);
+        position += k;
+        data += k;
+        n -= k;
+    }
+}
+
+void RawVideoWriter::close() {
+    index.close();
+    if (fd < 0) return;
+    if (window) ::munmap(window, windowSize);
+    window = nullptr;
+    // Drop the unused preallocated space. If this fails, the file just
+    // keeps it, and the index still tells where the frames are.
+    if (::ftruncate(fd, position) != 0) {}
+    ::close(fd);
+    fd = -1;
+}
+#endif
+}
+
 recorder::VideoWriter::~VideoWriter() = default;
@@ -1,16 +1,125 @@
 // private header file
 #ifndef JSONL_RECORDER_VIDEO_HPP
 #define JSONL_RECORDER_VIDEO_HPP
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
 #include <memory>
 #include <string>
+#include <vector>
+
+#include "recorder.hpp"
 
 namespace cv { class Mat; }
 
 namespace recorder {
+/**
+ * Video file of one camera. With VideoFormat::MJPEG, frames are JPEG
+ * compressed by the calling threads, in parallel, and appended to the file
+ * in the order of their numbers. With VideoFormat::RAW, frames must be
+ * written in order, from one thread at a time.
+ */
 struct VideoWriter {
-    virtual void write(const cv::Mat &frame) = 0;
+    /**
+     * Encode and write a frame. Thread safe. Frame numbers must be 0, 1,
+     * 2, ... without gaps, but may be written in any order.
+     */
+    virtual void write(std::size_t number, const cv::Mat &frame) = 0;
+    /**
+     * Write frames from the given number on to the file of the given
+     * segment. Call before writing that frame.
+     */
+    virtual void startSegment(std::size_t number, int segment) = 0;
     virtual ~VideoWriter();
-    static std::unique_ptr<VideoWriter> build(const std::string &prefix, int cameraInd, float fps, const cv::Mat &modelFrame);
+    /** @param segment Segment number for segmentPath(), 0 if not segmented */
+    static std::unique_ptr<VideoWriter> build(const std::string &prefix, int cameraInd, float fps, const cv::Mat &modelFrame, VideoFormat format, int segment = 0);
+};
+
+/**
+ * Motion JPEG AVI file from already compressed frames, as written by the
+ * OpenCV MJPEG backend. The frame count and index are written by close().
+ * Chunk sizes and offsets are 32-bit, so frames that would take the file,
+ * index included, over maxFileSize are not written, nor any after them.
+ * Use Settings::segmentPolicy to keep long recordings in smaller files.
+ */
+class MjpegAviWriter {
+public:
+    static constexpr std::uint64_t MAX_FILE_SIZE = 0xffffffff;
+
+    /**
+     * @param channels 1 for gray, 3 for color
+     * @param maxFileSize At most MAX_FILE_SIZE
+     */
+    MjpegAviWriter(const std::string &path, int width, int height, int channels, float fps, std::uint64_t maxFileSize = MAX_FILE_SIZE);
+    MjpegAviWriter(const MjpegAviWriter&) = delete;
+    MjpegAviWriter &operator=(const MjpegAviWriter&) = delete;
+    ~MjpegAviWriter();
+
+    bool isOpen() const;
+    /**
+     * An empty frame is recorded as a dropped frame. Returns false if the
+     * frame was not written because the file is full.
+     */
+    bool writeFrame(const unsigned char *jpeg, std::size_t size);
+    void close();
+
+private:
+    struct IndexEntry {
+        std::uint32_t offset;
+        std::uint32_t size;
+    };
+
+    std::ofstream file;
+    const std::uint64_t maxFileSize;
+    std::uint64_t position;
+    std::uint32_t maxFrameSize = 0;
+    bool full = false;
+    std::vector<IndexEntry> index;
+};
+
+/**
+ * Uncompressed frames appended to a preallocated, memory-mapped file (a
+ * plain file where mmap is not available), see VideoFormat::RAW. Each frame
+ * is indexed in path + ".index" as soon as it has been written.
+ */
+class RawVideoWriter {
+public:
+    /**
+     * @param preallocationBytes The file is grown and mapped this many bytes
+     *  at a time, rounded up to a multiple of the page size.
+     */
+    RawVideoWriter(const std::string &path, std::size_t preallocationBytes = 64 * 1024 * 1024);
+    RawVideoWriter(const RawVideoWriter&) = delete;
+    RawVideoWriter &operator=(const RawVideoWriter&) = delete;
+    ~RawVideoWriter();
+
+    /** False if the file could not be opened, or writing has failed */
+    bool isOpen() const;
+    /**
+     * Append a frame of the given number with rows rows of rowBytes bytes,
+     * which are step bytes apart in data.
+     *
+     * @param type OpenCV matrix type, recorded in the index
+     */
+    void writeFrame(std::size_t number, int rows, int cols, int type, const unsigned char *data, std::size_t rowBytes, std::size_t step);
+    /** Truncate the file to the frames written and close it */
+    void close();
+
+private:
+    std::ofstream index;
+    std::uint64_t position = 0;
+#ifdef _WIN32
+    std::ofstream file;
+#else
+    int fd = -1;
+    std::size_t windowSize;
+    std::uint64_t windowOffset = 0;
+    unsigned char *window = nullptr;
+
+    bool mapNextWindow();
+#endif
+
+    void append(const unsigned char *data, std::size_t n);
 };
 }
-#endif
\ No newline at end of file
+#endif